@@ -0,0 +1,60 @@
+#ifndef __nlmixr2est_grad_h__
+#define __nlmixr2est_grad_h__
+// C interface to the nlmixr2GradFun() objective/gradient functions.
+//
+// The objective is first setup in R with nlmixr2GradFun() (the
+// identifier is the md5 used in the returned eval/grad closures).
+// A C objective can then be registered for that identifier; without
+// one the R closure is called.
+//
+// Errors are not raised from these functions: nlmixr2GradSetObjC()
+// and nlmixr2GradGradC() return non-zero (the gradient is filled with
+// NA), nlmixr2GradEvalC() returns NA, and nlmixr2GradErrorC() has the
+// message.  The caller reports it (for example with Rf_error() from
+// its own .Call entry point).
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  typedef double (*nlmixr2GradObj_t)(int n, double *theta, void *ex);
+
+  typedef int (*nlmixr2GradSetObj_t)(const char *md5, nlmixr2GradObj_t fn, void *ex);
+  typedef double (*nlmixr2GradEval_t)(const char *md5, int n, double *theta);
+  typedef int (*nlmixr2GradGrad_t)(const char *md5, int n, double *theta, double *g);
+  typedef const char *(*nlmixr2GradError_t)(void);
+
+#ifndef __nlmixr2est_grad_internal__
+  static inline int nlmixr2GradSetObjC(const char *md5, nlmixr2GradObj_t fn, void *ex) {
+    static nlmixr2GradSetObj_t fun = NULL;
+    if (fun == NULL) fun = (nlmixr2GradSetObj_t) R_GetCCallable("nlmixr2est", "nlmixr2GradSetObj");
+    return fun(md5, fn, ex);
+  }
+
+  static inline double nlmixr2GradEvalC(const char *md5, int n, double *theta) {
+    static nlmixr2GradEval_t fun = NULL;
+    if (fun == NULL) fun = (nlmixr2GradEval_t) R_GetCCallable("nlmixr2est", "nlmixr2GradEval");
+    return fun(md5, n, theta);
+  }
+
+  static inline int nlmixr2GradGradC(const char *md5, int n, double *theta, double *g) {
+    static nlmixr2GradGrad_t fun = NULL;
+    if (fun == NULL) fun = (nlmixr2GradGrad_t) R_GetCCallable("nlmixr2est", "nlmixr2GradGrad");
+    return fun(md5, n, theta, g);
+  }
+
+  static inline const char *nlmixr2GradErrorC(void) {
+    static nlmixr2GradError_t fun = NULL;
+    if (fun == NULL) fun = (nlmixr2GradError_t) R_GetCCallable("nlmixr2est", "nlmixr2GradError");
+    return fun();
+  }
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __nlmixr2est_grad_h__
@@ -0,0 +1,56 @@
+#ifndef __nlmixr2est_llik_h__
+#define __nlmixr2est_llik_h__
+// C interface to the closed form log-likelihoods (and their
+// gradients) of the generalized likelihood families.
+//
+// All the observations of a subject are evaluated in one call; fx is
+// the log-likelihood of each observation.  For the poisson and
+// binomial families there is one parameter for each observation and J
+// is the derivative of each fx with respect to its own parameter
+// (length n).  For the other families the parameters are shared and J
+// is the n x npar Jacobian (column major):
+//
+//  - normal:       mu, sigma
+//  - student_t:    nu, mu, sigma
+//  - beta:         alpha, beta
+//  - neg_binomial: alpha, beta
+//  - betabinomial: alpha, beta (with N)
+//
+// N is only used by the binomial and betabinomial families.  The
+// return value is 0 on success, 1 when an observation is outside of
+// the support of the distribution and 2 for an unknown family.
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  typedef enum {
+    nlmixr2LlikPoisson = 1,
+    nlmixr2LlikBinomial,
+    nlmixr2LlikNormal,
+    nlmixr2LlikStudentT,
+    nlmixr2LlikBeta,
+    nlmixr2LlikNegBinomial,
+    nlmixr2LlikBetaBinomial
+  } nlmixr2LlikFamily_t;
+
+  typedef int (*nlmixr2Llik_t)(int family, int n, const double *y, const double *N,
+                               const double *params, double *fx, double *J);
+
+#ifndef __nlmixr2est_llik_internal__
+  static inline int nlmixr2LlikC(int family, int n, const double *y, const double *N,
+                                 const double *params, double *fx, double *J) {
+    static nlmixr2Llik_t fun = NULL;
+    if (fun == NULL) fun = (nlmixr2Llik_t) R_GetCCallable("nlmixr2est", "nlmixr2Llik");
+    return fun(family, n, y, N, params, fx, J);
+  }
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __nlmixr2est_llik_h__
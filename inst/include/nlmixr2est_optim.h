@@ -0,0 +1,75 @@
+#ifndef __nlmixr2est_optim_h__
+#define __nlmixr2est_optim_h__
+// C interface to the reentrant Nelder-Mead minimizer and the slice
+// sampler.
+//
+// nelder_fn2() minimizes func (which gets the context pointer ex);
+// work has nelder_work_size(n) doubles and the simplex vertices are
+// evaluated on cores threads, so func then needs to be thread safe.
+//
+// uni_slice2() takes one slice sampling step from x0 of the log
+// density g; slice_chains() runs nchain independent chains of nsamp
+// draws (out is nsamp x nchain, column major) on cores threads.  The
+// chain number is passed to g so it can keep per chain data in ex.
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  // objective with a context pointer
+  typedef void (*nmfn_ex_t) (double *, double *, void *);
+  // log density with the chain number and a context pointer
+  typedef double (*slice_ld_t)(double x, int chain, void *ex);
+
+  typedef int (*nelder_work_size_t)(int n);
+  typedef void (*nelder_fn2_t)(nmfn_ex_t func, void *ex, int n, double *start, double *step,
+                               int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
+                               int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
+                               int *iprint, double *work, int cores);
+  typedef double (*uni_slice2_t)(double x0, slice_ld_t g, void *ex, double w, int m,
+                                 double lower, double upper, int *nevals);
+  typedef void (*slice_chains_t)(slice_ld_t g, void *ex, int nchain, const double *x0, int nsamp,
+                                 double w, int m, double lower, double upper,
+                                 double *out, int *nevals, int cores);
+
+#ifndef __nlmixr2est_optim_internal__
+  static inline int nelder_work_sizeC(int n) {
+    static nelder_work_size_t fun = NULL;
+    if (fun == NULL) fun = (nelder_work_size_t) R_GetCCallable("nlmixr2est", "nelder_work_size");
+    return fun(n);
+  }
+
+  static inline void nelder_fn2C(nmfn_ex_t func, void *ex, int n, double *start, double *step,
+                                 int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
+                                 int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
+                                 int *iprint, double *work, int cores) {
+    static nelder_fn2_t fun = NULL;
+    if (fun == NULL) fun = (nelder_fn2_t) R_GetCCallable("nlmixr2est", "nelder_fn2");
+    fun(func, ex, n, start, step, itmax, ftol_rel, rcoef, ecoef, ccoef,
+        iconv, it, nfcall, ynewlo, xmin, iprint, work, cores);
+  }
+
+  static inline double uni_slice2C(double x0, slice_ld_t g, void *ex, double w, int m,
+                                   double lower, double upper, int *nevals) {
+    static uni_slice2_t fun = NULL;
+    if (fun == NULL) fun = (uni_slice2_t) R_GetCCallable("nlmixr2est", "uni_slice2");
+    return fun(x0, g, ex, w, m, lower, upper, nevals);
+  }
+
+  static inline void slice_chainsC(slice_ld_t g, void *ex, int nchain, const double *x0, int nsamp,
+                                   double w, int m, double lower, double upper,
+                                   double *out, int *nevals, int cores) {
+    static slice_chains_t fun = NULL;
+    if (fun == NULL) fun = (slice_chains_t) R_GetCCallable("nlmixr2est", "slice_chains");
+    fun(g, ex, nchain, x0, nsamp, w, m, lower, upper, out, nevals, cores);
+  }
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __nlmixr2est_optim_h__
@@ -3,9 +3,11 @@
 #define __STAN__MATH__FUNCTIONS__PKPDLIB_HPP__
 
 #include <stan/math/rev/core.hpp>
+#include <stan/math/fwd/core.hpp>
 #include <stan/math/prim/mat/fun/Eigen.hpp>
 #include <stan/math/prim/scal/err/check_greater_or_equal.hpp>
 #include <vector>
+#include <algorithm>
 #include <utility>
 #include <cmath>
 #include <iostream>
@@ -27,9 +29,10 @@ namespace stan {
 
 
 int locate_dose_index(const Eigen::VectorXd& dose_time, const double obs_time){
-  int m = 0;
-  while(m < dose_time.size() && dose_time[m] <= obs_time) m++;
-  return m-1;
+  // dose_time is sorted, so the last dose at or before obs_time is
+  // found with a binary search
+  const double *d = dose_time.data();
+  return (int)(std::upper_bound(d, d + dose_time.size(), obs_time) - d) - 1;
 }//subscript of dose
 
 
@@ -195,32 +198,109 @@ micros2macros(const Eigen::Matrix<T, Eigen::Dynamic, 1>& params,
 }
 
 
-template <class T>
+// Incremental superposition for observation times in increasing
+// order.  The contribution of the doses that are already given (or,
+// for infusions, have already ended) is carried forward between the
+// observations as one decaying sum for each exponential, so each dose
+// is only visited when it starts (and, for infusions, when it ends).
+template <class T, int NCMT, int ORAL, int INFUSION>
 Eigen::Matrix<T, Eigen::Dynamic, 1>
-generic_cmt_interface(const Eigen::VectorXd& obs_time,
-                      const Eigen::VectorXd& dose_time,
-                      const Eigen::VectorXd& dose,
-                      const Eigen::VectorXd& Tinf,
-                      const Eigen::Matrix<T, Eigen::Dynamic, 1>& params,
-                      const int ncmt,
-                      const int oral,
-                      const int infusion,
-                      const int parameterization){
+lin_cmt_kernel_inc(const Eigen::VectorXd& obs_time,
+                   const Eigen::VectorXd& dose_time,
+                   const Eigen::VectorXd& dose,
+                   const Eigen::VectorXd& Tinf,
+                   const T* alpha,
+                   const T* coef,
+                   const T& ka,
+                   const T& Tlag){
+
+  T S[NCMT];   // settled doses at tref for each exponential
+  T R = 0.0;   // absorption term at tref
+  for (int i = 0; i < NCMT; i++) S[i] = 0.0;
+  double tref = obs_time.size() > 0 ? obs_time[0] : 0.0;
+
+  std::vector<int> active; // infusions that have started but not ended
+  int nd = dose_time.size();
+  int l = 0;
 
-  stan::math::check_greater_or_equal("generic_cmt_interface", "params.size()", params.size(), 2*ncmt + 2*oral);
-  T ka   = params[2 * ncmt];
-  T Tlag = params[2 * ncmt + 1];
-  if (oral != 1) Tlag = 0.0;    //i.v.
+  Eigen::Matrix<T, Eigen::Dynamic, 1> g(obs_time.size());
 
-  Eigen::Matrix<T, Eigen::Dynamic, 2> par(ncmt, 2);
-  par = micros2macros(params, ncmt, oral, parameterization);
+  for(int b = 0; b < obs_time.size(); ++b){
+    const double t = obs_time[b];
+    if (t != tref) {
+      for (int i = 0; i < NCMT; i++) S[i] *= exp(-alpha[i] * (t - tref));
+      if (ORAL && !INFUSION) R *= exp(-ka * (t - tref));
+      tref = t;
+    }
+    // doses starting at or before this observation
+    while (l < nd && dose_time[l] <= t && t - dose_time[l] - Tlag >= 0) {
+      if (INFUSION) {
+        active.push_back(l);
+      } else {
+        T this_t = t - dose_time[l] - Tlag;
+        for (int i = 0; i < NCMT; i++) S[i] += dose[l] * exp(-alpha[i] * this_t);
+        if (ORAL) R += dose[l] * exp(-ka * this_t);
+      }
+      l++;
+    }
 
-  Eigen::Matrix<T, Eigen::Dynamic, 1> g(obs_time.size());
-  for(int i=0;i<obs_time.size();i++){
-    g(i,0) = 0;
+    T sum = 0.0;
+    if (INFUSION) {
+      int k = 0;
+      for (int j = 0; j < (int)active.size(); j++) {
+        int a = active[j];
+        T this_t = t - dose_time[a] - Tlag;
+        if (this_t >= Tinf[a]) {
+          // ended; move it to the carried sums
+          T t2 = this_t - Tinf[a];
+          for (int i = 0; i < NCMT; i++)
+            S[i] += dose[a] / Tinf[a] * (1 - exp(-alpha[i] * Tinf[a])) * exp(-alpha[i] * t2);
+        } else {
+          for (int i = 0; i < NCMT; i++)
+            sum += dose[a] / Tinf[a] * coef[i] * (1 - exp(-alpha[i] * this_t));
+          active[k++] = a;
+        }
+      }
+      active.resize(k);
+      for (int i = 0; i < NCMT; i++) sum += coef[i] * S[i];
+    } else {
+      for (int i = 0; i < NCMT; i++)
+        sum += coef[i] * (ORAL ? S[i] - R : S[i]);
+    }
+    g(b,0) = sum;
+  } // b
+
+  return g;
+}
+
+// Superposition of the doses with the number of compartments and the
+// dosing type fixed at compile time.  The macro constants (and the
+// infusion ratios) are set up once, outside of the observation loop.
+template <class T, int NCMT, int ORAL, int INFUSION>
+Eigen::Matrix<T, Eigen::Dynamic, 1>
+lin_cmt_kernel(const Eigen::VectorXd& obs_time,
+               const Eigen::VectorXd& dose_time,
+               const Eigen::VectorXd& dose,
+               const Eigen::VectorXd& Tinf,
+               const Eigen::Matrix<T, Eigen::Dynamic, 2>& par,
+               const T& ka,
+               const T& Tlag){
+
+  T alpha[NCMT];
+  T coef[NCMT];
+  for (int i = 0; i < NCMT; i++) {
+    alpha[i] = par(i,0);
+    coef[i]  = INFUSION ? par(i,1) / par(i,0) : par(i,1);
   }
 
+  if (std::is_sorted(obs_time.data(), obs_time.data() + obs_time.size()))
+    return lin_cmt_kernel_inc<T, NCMT, ORAL, INFUSION>(obs_time, dose_time, dose, Tinf,
+                                                       alpha, coef, ka, Tlag);
+
+  Eigen::Matrix<T, Eigen::Dynamic, 1> g(obs_time.size());
+
   for(int b = 0; b < obs_time.size(); ++b){
+    g(b,0) = 0;
 
     int m = locate_dose_index(dose_time, obs_time[b]);
     for(int l=0; l<=m; l++){    //superpostion
@@ -229,19 +309,19 @@ generic_cmt_interface(const Eigen::VectorXd& obs_time,
       if (this_t < 0) continue;
 
       T sum = 0.0;
-      if (infusion > 0) {
+      if (INFUSION) {
         T t1 = this_t < Tinf[l] ? this_t : Tinf[l];        //during infusion
         T t2 = this_t > Tinf[l] ? this_t - Tinf[l] : 0.0;  // after infusion
 
-        for (int i = 0; i < ncmt; i++)
-          sum += par(i,1) / par(i,0) * (1 - exp(-par(i,0) * t1)) * exp(-par(i,0) * t2);
+        for (int i = 0; i < NCMT; i++)
+          sum += coef[i] * (1 - exp(-alpha[i] * t1)) * exp(-alpha[i] * t2);
 
         g(b,0) += dose[l] / Tinf[l] * sum;
       }
       else {
-        T res = oral == 1 ? exp(-ka * this_t) : 0.0;
-        for (int i = 0; i < ncmt; i++)
-          sum += par(i,1) * (exp(-par(i,0) * this_t) - res);
+        T res = ORAL ? exp(-ka * this_t) : 0.0;
+        for (int i = 0; i < NCMT; i++)
+          sum += coef[i] * (exp(-alpha[i] * this_t) - res);
 
         g(b,0) += dose[l] * sum;
       }
@@ -251,6 +331,57 @@ generic_cmt_interface(const Eigen::VectorXd& obs_time,
   return g;
 }
 
+template <class T, int NCMT>
+Eigen::Matrix<T, Eigen::Dynamic, 1>
+lin_cmt_dispatch(const Eigen::VectorXd& obs_time,
+                 const Eigen::VectorXd& dose_time,
+                 const Eigen::VectorXd& dose,
+                 const Eigen::VectorXd& Tinf,
+                 const Eigen::Matrix<T, Eigen::Dynamic, 2>& par,
+                 const T& ka,
+                 const T& Tlag,
+                 const int oral,
+                 const int infusion){
+  if (infusion > 0) {
+    if (oral == 1) return lin_cmt_kernel<T, NCMT, 1, 1>(obs_time, dose_time, dose, Tinf, par, ka, Tlag);
+    return lin_cmt_kernel<T, NCMT, 0, 1>(obs_time, dose_time, dose, Tinf, par, ka, Tlag);
+  }
+  if (oral == 1) return lin_cmt_kernel<T, NCMT, 1, 0>(obs_time, dose_time, dose, Tinf, par, ka, Tlag);
+  return lin_cmt_kernel<T, NCMT, 0, 0>(obs_time, dose_time, dose, Tinf, par, ka, Tlag);
+}
+
+
+template <class T>
+Eigen::Matrix<T, Eigen::Dynamic, 1>
+generic_cmt_interface(const Eigen::VectorXd& obs_time,
+                      const Eigen::VectorXd& dose_time,
+                      const Eigen::VectorXd& dose,
+                      const Eigen::VectorXd& Tinf,
+                      const Eigen::Matrix<T, Eigen::Dynamic, 1>& params,
+                      const int ncmt,
+                      const int oral,
+                      const int infusion,
+                      const int parameterization){
+
+  stan::math::check_greater_or_equal("generic_cmt_interface", "params.size()", params.size(), 2*ncmt + 2*oral);
+  T ka   = params[2 * ncmt];
+  T Tlag = params[2 * ncmt + 1];
+  if (oral != 1) Tlag = 0.0;    //i.v.
+
+  Eigen::Matrix<T, Eigen::Dynamic, 2> par(ncmt, 2);
+  par = micros2macros(params, ncmt, oral, parameterization);
+
+  switch (ncmt) {
+  case 1:
+    return lin_cmt_dispatch<T, 1>(obs_time, dose_time, dose, Tinf, par, ka, Tlag, oral, infusion);
+  case 2:
+    return lin_cmt_dispatch<T, 2>(obs_time, dose_time, dose, Tinf, par, ka, Tlag, oral, infusion);
+  case 3:
+    return lin_cmt_dispatch<T, 3>(obs_time, dose_time, dose, Tinf, par, ka, Tlag, oral, infusion);
+  }
+  throw std::invalid_argument("Wrong number of compartments.");
+}
+
 
 template <class T>
 Eigen::Matrix<T, Eigen::Dynamic, 1>
@@ -328,6 +459,30 @@ struct lin_cmt_fun {
 	}
 };
 
+// Forward mode sensitivities of the linear compartment solutions.
+// There is one tangent sweep over the dose history for each of the
+// 2*ncmt+2 parameters instead of a reverse sweep (and autodiff tape)
+// for each observation.  J is nobs x npar.
+inline void lin_cmt_fwd_jacobian(const lin_cmt_fun& f,
+				 const Eigen::VectorXd& params,
+				 Eigen::VectorXd& fx,
+				 Eigen::MatrixXd& J) {
+	const int npar = params.size();
+	Eigen::Matrix<fvar<double>, -1, 1> x(npar);
+	for (int i = 0; i < npar; ++i) x(i) = fvar<double>(params(i), 0.0);
+	for (int j = 0; j < npar; ++j) {
+		x(j).d_ = 1.0;
+		Eigen::Matrix<fvar<double>, -1, 1> fj = f(x);
+		if (j == 0) {
+			fx.resize(fj.size());
+			J.resize(fj.size(), npar);
+			for (int i = 0; i < fj.size(); ++i) fx(i) = fj(i).val_;
+		}
+		for (int i = 0; i < fj.size(); ++i) J(i, j) = fj(i).d_;
+		x(j).d_ = 0.0;
+	}
+}
+
 
   } // ns math
 
@@ -2,6 +2,8 @@
 #include "../inst/include/nlmixr2est_types.h"
 #include "evaluate.h"
 #include "lin_cmt.h"
+#define __nlmixr2est_optim_internal__
+#include "../inst/include/nlmixr2est_optim.h"
 Rcpp::EvalBase *ev = NULL;                  // pointer to abstract base class
 int NPAR=0;
 
@@ -30,9 +32,10 @@ BEGIN_RCPP
     ev = new Rcpp::EvalStandard(fcallSEXP, rhoSEXP);    // assign R function and environment
     int i, Iconv, Itnum, Nfcall, Itmax, iprint;
     double ftol_rel, rcoef, ecoef, ccoef;
-    double Start[99], Xmin[99], Ynewlo, Step[99];
+    double Ynewlo;
 
     NPAR = INTEGER(nparSEXP)[0];
+    std::vector<double> Start(NPAR), Xmin(NPAR), Step(NPAR);
     for (i=0; i<NPAR; i++) Start[i] = REAL(startSEXP)[i];
     for (i=0; i<NPAR; i++) Step[i]  = REAL(stepSEXP )[i];
     Itmax = INTEGER(itmaxSEXP)[0];
@@ -42,9 +45,9 @@ BEGIN_RCPP
     ccoef = REAL(ccoefSEXP)[0];
     iprint = INTEGER(iprintSEXP)[0];
 
-    nelder_fn(nmfn_wrap, NPAR, Start, Step,
+    nelder_fn(nmfn_wrap, NPAR, Start.data(), Step.data(),
             Itmax, ftol_rel, rcoef, ecoef, ccoef,
-            &Iconv, &Itnum, &Nfcall, &Ynewlo, Xmin,
+            &Iconv, &Itnum, &Nfcall, &Ynewlo, Xmin.data(),
             &iprint);
   //Rcpp::Rcout <<ev->getNbEvals() <<std::endl;
 
@@ -61,13 +64,18 @@ END_RCPP
 
 
 //------------
-double uni_slice(double x0, double (*g)(double), double w, int m, double lower, double upper);
-
-double slcfn_wrap(double x)
+extern "C" double uni_slice2(double x0, slice_ld_t g, void *ex, double w, int m,
+                             double lower, double upper, int *nevals);
+extern "C" void slice_chains(slice_ld_t g, void *ex, int nchain, const double *x0, int nsamp,
+                             double w, int m, double lower, double upper,
+                             double *out, int *nevals, int cores);
+
+// R closure log density; ex is the Rcpp::EvalBase
+double slcfn_wrap(double x, int chain, void *ex)
 {
 	Rcpp::NumericVector par(1);
 	par[0] = x;
-	return as<double>(ev->eval(par));
+	return as<double>(((Rcpp::EvalBase*)ex)->eval(par));
 }
 
 RcppExport SEXP
@@ -75,15 +83,48 @@ slice_wrap(SEXP fcallSEXP, SEXP rhoSEXP, SEXP x0SEXP, SEXP wSEXP, SEXP mSEXP, SE
 {
 BEGIN_RCPP
 
-    ev = new Rcpp::EvalStandard(fcallSEXP, rhoSEXP);    // assign R function and environment
+    Rcpp::RNGScope rngScope;
+    Rcpp::EvalStandard evs(fcallSEXP, rhoSEXP);    // assign R function and environment
     double x0=REAL(x0SEXP)[0], x1;
     double w=REAL(wSEXP)[0];
     int m=INTEGER(mSEXP)[0];
     double lower=REAL(lowerSEXP)[0];
     double upper=REAL(upperSEXP)[0];
-    x1 = uni_slice(x0, slcfn_wrap, w, m, lower, upper);
+    int nevals = 0;
+    x1 = uni_slice2(x0, slcfn_wrap, &evs, w, m, lower, upper, &nevals);
+
+	return Rcpp::List::create(Rcpp::Named("x1") = x1,
+	                          Rcpp::Named("nevals") = nevals);
+
+END_RCPP
+}
+
+// One chain for each element of x0 with nsamp updates each; the R
+// closure is evaluated on the main thread
+RcppExport SEXP
+slice_chains_wrap(SEXP fcallSEXP, SEXP rhoSEXP, SEXP x0SEXP, SEXP nsampSEXP, SEXP wSEXP,
+                  SEXP mSEXP, SEXP lowerSEXP, SEXP upperSEXP)
+{
+BEGIN_RCPP
 
-	return Rcpp::List::create(Rcpp::Named("x1") = x1);
+    Rcpp::RNGScope rngScope;
+    Rcpp::EvalStandard evs(fcallSEXP, rhoSEXP);
+    Rcpp::NumericVector x0(x0SEXP);
+    int nchain = x0.size();
+    int nsamp = INTEGER(nsampSEXP)[0];
+    double w=REAL(wSEXP)[0];
+    int m=INTEGER(mSEXP)[0];
+    double lower=REAL(lowerSEXP)[0];
+    double upper=REAL(upperSEXP)[0];
+    Rcpp::NumericMatrix x(nsamp, nchain);
+    Rcpp::IntegerVector nevals(nchain);
+    if (nchain > 0 && nsamp > 0) {
+      slice_chains(slcfn_wrap, &evs, nchain, &x0[0], nsamp, w, m, lower, upper,
+                   &x[0], &nevals[0], 1);
+    }
+
+	return Rcpp::List::create(Rcpp::Named("x") = x,
+	                          Rcpp::Named("nevals") = nevals);
 
 END_RCPP
 }
@@ -117,6 +117,17 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// checkpointRead
+List checkpointRead(std::string file);
+RcppExport SEXP _nlmixr2est_checkpointRead(SEXP fileSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    rcpp_result_gen = Rcpp::wrap(checkpointRead(file));
+    return rcpp_result_gen;
+END_RCPP
+}
 // foceiNumericGrad
 NumericVector foceiNumericGrad(NumericVector theta);
 RcppExport SEXP _nlmixr2est_foceiNumericGrad(SEXP thetaSEXP) {
@@ -224,6 +235,17 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// nlmixr2GradReset_
+RObject nlmixr2GradReset_(std::string md5);
+RcppExport SEXP _nlmixr2est_nlmixr2GradReset_(SEXP md5SEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type md5(md5SEXP);
+    rcpp_result_gen = Rcpp::wrap(nlmixr2GradReset_(md5));
+    return rcpp_result_gen;
+END_RCPP
+}
 // nlmixr2Grad_
 NumericVector nlmixr2Grad_(NumericVector theta, std::string md5);
 RcppExport SEXP _nlmixr2est_nlmixr2Grad_(SEXP thetaSEXP, SEXP md5SEXP) {
@@ -339,6 +361,47 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// lin_cmt_sens
+SEXP lin_cmt_sens(Eigen::Map<Eigen::VectorXd> obs_time, Eigen::Map<Eigen::VectorXd> dose_time, Eigen::Map<Eigen::VectorXd> dose, Eigen::Map<Eigen::VectorXd> Tinf, Eigen::Map<Eigen::VectorXd> params, SEXP oralSEXP, SEXP infusionSEXP, SEXP ncmtSEXP, SEXP parameterizationSEXP);
+RcppExport SEXP _nlmixr2est_lin_cmt_sens(SEXP obs_timeSEXP, SEXP dose_timeSEXP, SEXP doseSEXP, SEXP TinfSEXP, SEXP paramsSEXP, SEXP oralSEXPSEXP, SEXP infusionSEXPSEXP, SEXP ncmtSEXPSEXP, SEXP parameterizationSEXPSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Eigen::Map<Eigen::VectorXd> >::type obs_time(obs_timeSEXP);
+    Rcpp::traits::input_parameter< Eigen::Map<Eigen::VectorXd> >::type dose_time(dose_timeSEXP);
+    Rcpp::traits::input_parameter< Eigen::Map<Eigen::VectorXd> >::type dose(doseSEXP);
+    Rcpp::traits::input_parameter< Eigen::Map<Eigen::VectorXd> >::type Tinf(TinfSEXP);
+    Rcpp::traits::input_parameter< Eigen::Map<Eigen::VectorXd> >::type params(paramsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type oralSEXP(oralSEXPSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type infusionSEXP(infusionSEXPSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type ncmtSEXP(ncmtSEXPSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type parameterizationSEXP(parameterizationSEXPSEXP);
+    rcpp_result_gen = Rcpp::wrap(lin_cmt_sens(obs_time, dose_time, dose, Tinf, params, oralSEXP, infusionSEXP, ncmtSEXP, parameterizationSEXP));
+    return rcpp_result_gen;
+END_RCPP
+}
+// lin_cmt_pop_sens
+SEXP lin_cmt_pop_sens(NumericVector obs_time, IntegerVector obs_off, NumericVector dose_time, NumericVector dose, NumericVector Tinf, IntegerVector dose_off, NumericMatrix params, SEXP oralSEXP, SEXP infusionSEXP, SEXP ncmtSEXP, SEXP parameterizationSEXP, SEXP coresSEXP);
+RcppExport SEXP _nlmixr2est_lin_cmt_pop_sens(SEXP obs_timeSEXP, SEXP obs_offSEXP, SEXP dose_timeSEXP, SEXP doseSEXP, SEXP TinfSEXP, SEXP dose_offSEXP, SEXP paramsSEXP, SEXP oralSEXPSEXP, SEXP infusionSEXPSEXP, SEXP ncmtSEXPSEXP, SEXP parameterizationSEXPSEXP, SEXP coresSEXPSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type obs_time(obs_timeSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type obs_off(obs_offSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type dose_time(dose_timeSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type dose(doseSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type Tinf(TinfSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type dose_off(dose_offSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type params(paramsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type oralSEXP(oralSEXPSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type infusionSEXP(infusionSEXPSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type ncmtSEXP(ncmtSEXPSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type parameterizationSEXP(parameterizationSEXPSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type coresSEXP(coresSEXPSEXP);
+    rcpp_result_gen = Rcpp::wrap(lin_cmt_pop_sens(obs_time, obs_off, dose_time, dose, Tinf, dose_off, params, oralSEXP, infusionSEXP, ncmtSEXP, parameterizationSEXP, coresSEXP));
+    return rcpp_result_gen;
+END_RCPP
+}
 // llik_binomial_c
 SEXP llik_binomial_c(Eigen::Map<Eigen::VectorXd> y, Eigen::Map<Eigen::VectorXd> N, Eigen::Map<Eigen::VectorXd> params);
 RcppExport SEXP _nlmixr2est_llik_binomial_c(SEXP ySEXP, SEXP NSEXP, SEXP paramsSEXP) {
@@ -425,6 +488,20 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// llik_closed
+SEXP llik_closed(SEXP familySEXP, NumericVector y, NumericVector N, NumericVector params);
+RcppExport SEXP _nlmixr2est_llik_closed(SEXP familySEXPSEXP, SEXP ySEXP, SEXP NSEXP, SEXP paramsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type familySEXP(familySEXPSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type y(ySEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type N(NSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type params(paramsSEXP);
+    rcpp_result_gen = Rcpp::wrap(llik_closed(familySEXP, y, N, params));
+    return rcpp_result_gen;
+END_RCPP
+}
 // augPredTrans
 RObject augPredTrans(NumericVector& pred, NumericVector& ipred, NumericVector& lambda, RObject& yjIn, NumericVector& low, NumericVector& hi);
 RcppExport SEXP _nlmixr2est_augPredTrans(SEXP predSEXP, SEXP ipredSEXP, SEXP lambdaSEXP, SEXP yjInSEXP, SEXP lowSEXP, SEXP hiSEXP) {
@@ -14,8 +14,12 @@
 
 
 
-arma::mat cholSE__(arma::mat A, double tol);
+arma::mat cholSE__(const arma::mat &A, double tol);
 bool cholSE0(arma::mat &Ao, arma::mat &E, arma::mat A, double tol);
+// Fixed size (n <= 8) Cholesky/generalized Cholesky; NULL otherwise
+typedef bool (*cholFix_t)(double *Ao, const double *A, double tol);
+cholFix_t cholFixGet(int n);
+cholFix_t cholSEFixGet(int n);
 
 using namespace arma;
 using namespace Rcpp;
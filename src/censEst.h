@@ -1,5 +1,6 @@
 #ifndef __CENSEST_H__
 #define __CENSEST_H__
+#include <Rmath.h>
 
 // Cumulative distribution function of a standardized normal distribution (mean
 // of zero, standard deviation of 1); x = (value - mean)/standard deviation
@@ -14,6 +15,32 @@
 #define _as_dbleps(a) (fabs(a) < sqrt(DBL_EPSILON) ? ((a) < 0 ? -sqrt(DBL_EPSILON)  : sqrt(DBL_EPSILON)) : a)
 
 
+// Log of the standard normal cumulative distribution (lower tail),
+// its upper tail and density.  R's pnorm() keeps the precision of the
+// log in the tails where log(PHI(x)) or log(1 - PHI(x)) would give -Inf
+static inline double censLogPhi(double x) {
+  return Rf_pnorm5(x, 0.0, 1.0, 1, 1);
+}
+
+static inline double censLogQ(double x) {
+  return Rf_pnorm5(x, 0.0, 1.0, 0, 1);
+}
+
+static inline double censLogDens(double x) {
+  return Rf_dnorm4(x, 0.0, 1.0, 1);
+}
+
+// log(PHI(a) - PHI(b)) for a > b; when both are in the upper tail it
+// is calculated as log((1-PHI(b)) - (1-PHI(a)))
+static inline double censLogDiff(double a, double b) {
+  if (b > 0) {
+    double qb = censLogQ(b);
+    return qb + log1p(-exp(censLogQ(a) - qb));
+  }
+  double pa = censLogPhi(a);
+  return pa + log1p(-exp(censLogPhi(b) - pa));
+}
+
 // This is the core censoring likelihood function for nlmixr2
 //
 // @param cens Censoring input value, can be -1, 0, or 1, based on the CENS column
@@ -36,23 +63,31 @@ static inline double doCensNormal1(double cens, double limDv, double lim, double
     // Note the ll is the numerator of equation 1 in Beal 2001, Ways to fit a PK model with some data below the quantification limit
     // So the negative represents the fact this is the denominator
     // The M2 can also be applied for quantitation above the limit.
-    return ll - log(1.0 - PHI(((lim<f)*2.0 - 1.0)*(lim - f)/sqrt(r))) - adj;
+    // log(1.0 - PHI(((lim<f)*2.0 - 1.0)*(lim - f)/sqrt(r)))
+    return ll - censLogQ(((lim<f)*2.0 - 1.0)*(lim - f)/sqrt(r)) - adj;
   } else if (isM3orM4(cens)) {
     if (hasFiniteLimit(lim)) {
       // M4 method
+      // log(PHI(cens*(limDv-f)/sd) - PHI(cens*(lim-f)/sd)) - log(1 - PHI(cens*(lim-f)/sd))
       double sd = sqrt(r);
-      double cum1 = PHI(cens*(limDv-f)/sd);
-      double cum2 = PHI(cens*(lim - f)/sd);
-      return log(cum1-cum2) - log(1.0 - cum2) - adj;
+      double z2 = cens*(lim - f)/sd;
+      return censLogDiff(cens*(limDv-f)/sd, z2) - censLogQ(z2) - adj;
     } else {
       // M3 method
-      return log(PHI(cens*(limDv-f)/sqrt(r))) - adj;
+      // log(PHI(cens*(limDv-f)/sqrt(r)))
+      return censLogPhi(cens*(limDv-f)/sqrt(r)) - adj;
     }
   }
   return ll;
 }
+
 // Calculate the censoring derivative
 //
+// With z = c*(x - f)/sqrt(r), dz = -c*df/sqrt(r) - 0.5*z*dr/r and the
+// derivatives of log(PHI(z)) and log(1-PHI(z)) are the inverse Mills
+// ratios phi(z)/PHI(z)*dz and -phi(z)/(1-PHI(z))*dz; these ratios are
+// calculated from the logs so they stay finite in the tails.
+//
 // @param cens Censoring input value, can be -1, 0, or 1, based on the CENS column
 // @param limDv represents the limit captured in the DV column
 // @param lim represents the upper or lower limit based on the LIMIT column
@@ -68,120 +103,42 @@ static inline double dCensNormal1(double cens, double limDv, double lim,
                                   double dll,
                                   double f, double r,
                                   double df, double dr) {
-  // M2 has the contribution of the dll as well as the censoring
-  if (isM2(cens, lim)) { /*
-  #log(1.0 - PHI(((lim<f)*2.0 - 1.0)*(lim - f)/sqrt(r))) - adj;
-# Case 1 lim < f
-# > rxToSE("log(1.0 - phi((lim - f)/sqrt(r)))")
-# Then changed to 
-# D(S("log(1-0.5*(1+erf(((lim-f(x))/sqrt(r(x)))/sqrt(2))))"),"x")
-(Mul)	-1.0*exp((-1/2)*(lim - f(x))^2/r(x))*((-1/2)*sqrt(2)*Derivative(f(x), x)/sqrt(r(x)) + (-1/4)*sqrt(2)*Derivative(r(x), x)*(lim - f(x))/r(x)^(3/2))/(sqrt(pi)*(1 - 0.5*(1 + erf((1/2)*sqrt(2)*(lim - f(x))/sqrt(r(x))))))
-
-ll=-1.0*exp((-1/2)*(lim - f)^2/r)*((-1/2)*sqrt(2)*fpm/sqrt(r) + (-1/4)*sqrt(2)*dr*(lim - f)/r^(3/2))/(sqrt(pi)*(1 - 0.5*(1 + erf((1/2)*sqrt(2)*(lim - f)/sqrt(r)))))
-
-tmp <- rxode2(rxOptExpr("ll=-1.0*exp((-1/2)*(lim - f)^2/r)*((-1/2)*sqrt(2)*fpm/sqrt(r) + (-1/4)*sqrt(2)*dr*(lim - f)/r^(3/2))/(sqrt(pi)*(1 - 0.5*(1 + erf((1/2)*sqrt(2)*(lim - f)/sqrt(r)))))"))
- */
-    if (lim < f) {
-      double rx_expr_0 =lim-f;
-      double rx_expr_1 = M_SQRT2;
-      double rx_expr_2 =_safe_sqrt(r);
- return dll -exp((-0.5)*((rx_expr_0)*(rx_expr_0))/_safe_zero(r))*((-0.5)*rx_expr_1*df/_safe_zero(rx_expr_2)+(-0.25)*rx_expr_1*dr*(rx_expr_0)/_safe_zero(R_pow(_as_dbleps(r),(1.5))))/_safe_zero((M_SQRT_PI*(1-0.5*(1+erf((0.5)*rx_expr_1*(rx_expr_0)/_safe_zero(rx_expr_2))))));
-    } else {
-      /*
-Case 2:
-
-D(S("log(1-0.5*(1+erf(((f(x)-lim)/sqrt(r(x)))/sqrt(2))))"),"x")
-(Mul)	-1.0*exp((-1/2)*(-lim + f)^2/r)*((1/2)*sqrt(2)*fpm/sqrt(r) + (-1/4)*sqrt(2)*dr*(-lim + f)/r^(3/2))/(sqrt(pi)*(1 - 0.5*(1 + erf((1/2)*sqrt(2)*(-lim + f)/sqrt(r)))))
-*/
-      double rx_expr_0 =M_SQRT2;
-      double rx_expr_1 =_safe_sqrt(r);
-      double rx_expr_2 =(0.5)*rx_expr_0;
-  return dll -exp((-0.5)*((-lim+f)*(-lim+f))/_safe_zero(r))*(rx_expr_2*df/_safe_zero(rx_expr_1)+(-0.25)*rx_expr_0*dr*(-lim+f)/_safe_zero(R_pow(_as_dbleps(r),(1.5))))/_safe_zero((M_SQRT_PI*(1-0.5*(1+erf(rx_expr_2*(-lim+f)/_safe_zero(rx_expr_1))))));
-    }
-  } else if (isM3orM4(cens)) {
-    // M3 and M4 has no contribution based on the "normal" likelihood slope
-    if (hasFiniteLimit(lim)) {                          /*
-> rxToSE("log(phi(cens*(dv-f)/sqrt(g))-phi(cens*(lim-f)/sqrt(g)))-log(1-phi(cens*(lim-f)/sqrt(g))")
-
-Then changed to
-
-D(S("log(0.5*(1+erf((cens*(dv-f(x))/sqrt(g(x)))/sqrt(2)))-0.5*(1+erf((cens*(lim-f(x))/sqrt(g(x)))/sqrt(2))))-log(1-0.5*(1+erf((cens*(lim-f(x))/sqrt(g(x)))/sqrt(2))))"),"x")
-(Add)	(-1.0*exp((-1/2)*cens^2*(lim - f(x))^2/g(x))*((-1/2)*sqrt(2)*Derivative(f(x), x)*cens/sqrt(g(x)) + (-1/4)*sqrt(2)*Derivative(g(x), x)*cens*(lim - f(x))/g(x)^(3/2))/sqrt(pi) + 1.0*exp((-1/2)*(dv - f(x))^2*cens^2/g(x))*((-1/2)*sqrt(2)*Derivative(f(x), x)*cens/sqrt(g(x)) + (-1/4)*sqrt(2)*Derivative(g(x), x)*(dv - f(x))*cens/g(x)^(3/2))/sqrt(pi))/(-0.5*(1 + erf((1/2)*sqrt(2)*cens*(lim - f(x))/sqrt(g(x)))) + 0.5*(1 + erf((1/2)*sqrt(2)*(dv - f(x))*cens/sqrt(g(x))))) + 1.0*exp((-1/2)*cens^2*(lim - f(x))^2/g(x))*((-1/2)*sqrt(2)*Derivative(f(x), x)*cens/sqrt(g(x)) + (-1/4)*sqrt(2)*Derivative(g(x), x)*cens*(lim - f(x))/g(x)^(3/2))/(sqrt(pi)*(1 - 0.5*(1 + erf((1/2)*sqrt(2)*cens*(lim - f(x))/sqrt(g(x))))))
-
-
-# Note that:
-#  - Derivative(g(x), x) = dr
-#  - Derivative(f(x), x) = df
-#  - f(x)                = f
-#  - g(x)                = r
-#  - cens^2 = 1 (removed)
-
-	(-1.0*exp((-1/2)*(lim - f)^2/r)*((-1/2)*sqrt(2)*df*cens/sqrt(r) + (-1/4)*sqrt(2)*dr*cens*(lim - f)/r^(3/2))/sqrt(pi) + 1.0*exp((-1/2)*(dv - f)^2/r)*((-1/2)*sqrt(2)*df*cens/sqrt(r) + (-1/4)*sqrt(2)*dr*(dv - f)*cens/r^(3/2))/sqrt(pi))/(-0.5*(1 + erf((1/2)*sqrt(2)*cens*(lim - f)/sqrt(r))) + 0.5*(1 + erf((1/2)*sqrt(2)*(dv - f)*cens/sqrt(r)))) + 1.0*exp((-1/2)*(lim - f)^2/r)*((-1/2)*sqrt(2)*df*cens/sqrt(r) + (-1/4)*sqrt(2)*dr*cens*(lim - f)/r^(3/2))/(sqrt(pi)*(1 - 0.5*(1 + erf((1/2)*sqrt(2)*cens*(lim - f)/sqrt(r)))))
-
-rxOptExpr(
-rxode2({ll = (-1.0*exp((-1/2)*(lim - f)^2/r)*((-1/2)*sqrt(2)*df*cens/sqrt(r) + (-1/4)*sqrt(2)*dr*cens*(lim - f)/r^(3/2))/sqrt(pi) + 1.0*exp((-1/2)*(dv - f)^2/r)*((-1/2)*sqrt(2)*df*cens/sqrt(r) + (-1/4)*sqrt(2)*dr*(dv - f)*cens/r^(3/2))/sqrt(pi))/(-0.5*(1 + erf((1/2)*sqrt(2)*cens*(lim - f)/sqrt(r))) + 0.5*(1 + erf((1/2)*sqrt(2)*(dv - f)*cens/sqrt(r)))) + 1.0*exp((-1/2)*(lim - f)^2/r)*((-1/2)*sqrt(2)*df*cens/sqrt(r) + (-1/4)*sqrt(2)*dr*cens*(lim - f)/r^(3/2))/(sqrt(pi)*(1 - 0.5*(1 + erf((1/2)*sqrt(2)*cens*(lim - f)/sqrt(r)))))}))
-
-rx_expr_0~dv-f
-rx_expr_1~lim-f
-rx_expr_2~sqrt(2)
-rx_expr_3~sqrt(r)
-rx_expr_4~r^(1.5)
-rx_expr_5~sqrt(pi)
-rx_expr_6~(0.5)*rx_expr_2
-rx_expr_7~(-0.5)*rx_expr_2
-rx_expr_8~(-0.25)*rx_expr_2
-rx_expr_9~rx_expr_8*dr
-rx_expr_10~rx_expr_7*df
-rx_expr_11~rx_expr_6*cens
-rx_expr_12~rx_expr_9*cens
-rx_expr_13~rx_expr_10*cens
-rx_expr_15~rx_expr_11*(rx_expr_1)
-rx_expr_16~rx_expr_13/rx_expr_3
-rx_expr_18~rx_expr_12*(rx_expr_1)
-rx_expr_20~rx_expr_15/rx_expr_3
-rx_expr_22~rx_expr_18/rx_expr_4
-rx_expr_23~erf(rx_expr_20)
-rx_expr_24~1+rx_expr_23
-ll=(-exp((-0.5)*((rx_expr_1)*(rx_expr_1))/r)*(rx_expr_16+rx_expr_22)/rx_expr_5+exp((-0.5)*((rx_expr_0)*(rx_expr_0))/r)*(rx_expr_16+rx_expr_9*(rx_expr_0)*cens/rx_expr_4)/rx_expr_5)/(-0.5*(rx_expr_24)+0.5*(1+erf(rx_expr_6*(rx_expr_0)*cens/rx_expr_3)))+exp((-0.5)*((rx_expr_1)*(rx_expr_1))/r)*(rx_expr_16+rx_expr_22)/(rx_expr_5*(1-0.5*(rx_expr_24)))
+  if (!isM2(cens, lim) && !isM3orM4(cens)) return dll;
+  double sd = _safe_sqrt(r);
+  double r0 = sd*sd;
+  if (isM2(cens, lim)) {
+    // M2 has the contribution of the dll as well as the censoring
+    double s = (lim<f)*2.0 - 1.0;
+    double u = s*(lim - f)/sd;
+    double du = -s*df/sd - 0.5*u*dr/r0;
+    return dll - exp(censLogDens(u) - censLogQ(u))*du;
+  }
+  // M3 and M4 has no contribution based on the "normal" likelihood slope
+  double z1 = cens*(limDv - f)/sd;
+  double dz1 = -cens*df/sd - 0.5*z1*dr/r0;
+  if (hasFiniteLimit(lim)) {
+    // M4 method
+    double z2 = cens*(lim - f)/sd;
+    double dz2 = -cens*df/sd - 0.5*z2*dr/r0;
+    double ld = censLogDiff(z1, z2);
+    return exp(censLogDens(z1) - ld)*dz1 - exp(censLogDens(z2) - ld)*dz2 +
+      exp(censLogDens(z2) - censLogQ(z2))*dz2;
+  }
+  // M3 method
+  return exp(censLogDens(z1) - censLogPhi(z1))*dz1;
+}
 
-rxOptExpr(x)
-                    */
-                    double rx_expr_0 =limDv-f;
-                    double rx_expr_1 =lim-f;
-                    double rx_expr_2 =M_SQRT2;
-                    double rx_expr_3 =sqrt(r);
-                    double rx_expr_4 =R_pow(_as_dbleps(r),(1.5));
-                    double rx_expr_5 =M_SQRT_PI;
-                    double rx_expr_6 =(0.5)*rx_expr_2;
-                    double rx_expr_7 =(-0.5)*rx_expr_2;
-                    double rx_expr_8 =(-0.25)*rx_expr_2;
-                    double rx_expr_9 =rx_expr_8*dr;
-                    double rx_expr_10 =rx_expr_7*df;
-                    double rx_expr_11 =rx_expr_6*cens;
-                    double rx_expr_12 =rx_expr_9*cens;
-                    double rx_expr_13 =rx_expr_10*cens;
-                    double rx_expr_15 =rx_expr_11*(rx_expr_1);
-                    double rx_expr_16 =rx_expr_13/_safe_zero(rx_expr_3);
-                    double rx_expr_18 =rx_expr_12*(rx_expr_1);
-                    double rx_expr_20 =rx_expr_15/_safe_zero(rx_expr_3);
-                    double rx_expr_22 =rx_expr_18/_safe_zero(rx_expr_4);
-                    double rx_expr_23 =erf(rx_expr_20);
-                    double rx_expr_24 =1+rx_expr_23;
-    return  (-exp((-0.5)*((rx_expr_1)*(rx_expr_1))/_safe_zero(r))*(rx_expr_16+rx_expr_22)/_safe_zero(rx_expr_5)+exp((-0.5)*((rx_expr_0)*(rx_expr_0))/_safe_zero(r))*(rx_expr_16+rx_expr_9*(rx_expr_0)*cens/_safe_zero(rx_expr_4))/_safe_zero(rx_expr_5))/_safe_zero((-0.5*(rx_expr_24)+0.5*(1+erf(rx_expr_6*(rx_expr_0)*cens/_safe_zero(rx_expr_3)))))+exp((-0.5)*((rx_expr_1)*(rx_expr_1))/_safe_zero(r))*(rx_expr_16+rx_expr_22)/_safe_zero((rx_expr_5*(1-0.5*(rx_expr_24))));
-    } else {
-      // M3 method
-      // logLik = log(phi((QL-f(x)/sqrt(g(x)))))
-      // logLik = log(1/2*(1+erf((cens*(dv-f(x)))/sqrt(g(x))))/sqrt(2))
-      // > D(S("log(1/2*(1+erf((cens*(dv-f(x)))/sqrt(g(x))/M_SQRT2)))"),"x")
-      // (Mul) 2*exp(-(dv - f(x))^2*cens^2/(g(x)*M_SQRT2^2))*(-Derivative(f(x), x)*cens/(sqrt(g(x))*M_SQRT2) + (-1/2)*Derivative(g(x), x)*(limDv - f(x))*cens/(g(x)^(3/2)*M_SQRT2))/(sqrt(pi)*(1 + erf((limDv - f(x))*cens/(sqrt(g(x))*M_SQRT2))))
-      // 2*exp(-(limDv - f)^2*cens^2/(r*M_SQRT2^2))*(-df*cens/(sqrt(r)*M_SQRT2) + (-0.5)*dr*(limDv - f)*cens/(r^(1.5)*M_SQRT2))/(sqrt(pi)*(1 + erf((limDv - f)*cens/(sqrt(r)*M_SQRT2))))
-      double rx_expr_0=limDv-f;
-      double rx_expr_1=_safe_sqrt(r);
-      double rx_expr_2=rx_expr_1*M_SQRT2;
-      return  2*exp(-(rx_expr_0*rx_expr_0)/_safe_zero(r*2))*(-df*cens/_safe_zero(rx_expr_2)-0.5*dr*rx_expr_0*cens/_safe_zero(R_pow(r,1.5)*M_SQRT2))/(M_SQRT_PI*(1+erf(rx_expr_0*cens/_safe_zero(rx_expr_2))));
-    }
+// Censoring likelihood for arrays of observations.  ll has the
+// uncensored values on input and is replaced by the censored values.
+//
+// @noRd
+static inline void doCensNormalV(int n, const double *cens, const double *limDv,
+                                 const double *lim, double *ll, const double *f,
+                                 const double *r, int adjLik) {
+  for (int i = 0; i < n; ++i) {
+    if (cens[i] == 0.0 && !hasFiniteLimit(lim[i])) continue;
+    ll[i] = doCensNormal1(cens[i], limDv[i], lim[i], ll[i], f[i], r[i], adjLik);
   }
-  return dll;
 }
 
 #undef hasFiniteLimit
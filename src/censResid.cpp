@@ -1,5 +1,6 @@
 #define STRICT_R_HEADER
 #include "censResid.h"
+#include "tbs.h"
 
 bool censTruncatedMvnReturnInterestingLimits(arma::vec& dv, arma::vec& dvt,
 					     arma::vec& ipred, arma::vec &ipredt,
@@ -9,10 +10,12 @@ bool censTruncatedMvnReturnInterestingLimits(arma::vec& dv, arma::vec& dvt,
 					     arma::vec &lowerLim, arma::vec &upperLim, arma::vec &ri,
 					     bool &doSim, int& censMethod) {
   bool interestingLim = false;
+  // ipredt is the transformation information
+  tbsDvD(ipred.memptr(), ipredt.memptr(), dv.size(), lambda.memptr(), yj.memptr(),
+         low.memptr(), hi.memptr(), 1);
+  tbsDvD(pred.memptr(), predt.memptr(), dv.size(), lambda.memptr(), yj.memptr(),
+         low.memptr(), hi.memptr(), 1);
   for (int i = dv.size(); i--;) {
-    // ipredt is the transformation information
-    ipred[i]= _powerDi(ipredt[i], lambda[i], (int)yj[i], low[i], hi[i]);
-    pred[i]= _powerDi(predt[i], lambda[i], (int)yj[i], low[i], hi[i]);
     switch (cens[i]){
     case 1:
       // (limit, dv) ; limit could be -inf
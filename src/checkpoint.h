@@ -0,0 +1,157 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#if defined(__cplusplus)
+#include <RcppArmadillo.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Checkpoints of long fits (foceiControl(checkpoint=) and
+// saemControl(checkpoint=)).  A checkpoint is a small binary file of
+// named double arrays: the magic string, the format version and the
+// number of arrays, then for each array the length of the name, the
+// name, the number of rows and columns and the values (column major).
+// Numbers are in the native byte order, so a checkpoint is meant to be
+// resumed on the same kind of machine.  The file is written to a
+// temporary file that is renamed when it is complete, so an
+// interrupted write keeps the previous checkpoint.
+#define CKPT_MAGIC "NLMIXR2CKPT"
+#define CKPT_VERSION 1
+
+typedef struct {
+  std::string name;
+  int nrow;
+  int ncol;
+  std::vector<double> x;
+} ckptArray_t;
+
+typedef std::vector<ckptArray_t> ckpt_t;
+
+static inline void ckptAdd(ckpt_t &ck, const char *name, const double *x,
+                           int nrow, int ncol) {
+  ckptArray_t a;
+  a.name = name;
+  a.nrow = nrow;
+  a.ncol = ncol;
+  a.x.assign(x, x + (size_t)nrow*(size_t)ncol);
+  ck.push_back(a);
+}
+
+static inline void ckptAdd(ckpt_t &ck, const char *name, double x) {
+  ckptAdd(ck, name, &x, 1, 1);
+}
+
+static inline void ckptAdd(ckpt_t &ck, const char *name, const arma::mat &m) {
+  ckptAdd(ck, name, m.memptr(), m.n_rows, m.n_cols);
+}
+
+static inline void ckptAdd(ckpt_t &ck, const char *name, const int *x, int n) {
+  std::vector<double> d(x, x + n);
+  ckptAdd(ck, name, d.data(), n, 1);
+}
+
+static inline const ckptArray_t *ckptGet(const ckpt_t &ck, const char *name) {
+  for (size_t i = 0; i < ck.size(); ++i) {
+    if (ck[i].name == name) return &ck[i];
+  }
+  return NULL;
+}
+
+// Returns false when the checkpoint could not be written
+static inline bool ckptWrite(const ckpt_t &ck, const std::string &file) {
+  std::string tmp = file + ".tmp";
+  std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out) return false;
+  int hdr[2] = {CKPT_VERSION, (int)ck.size()};
+  out.write(CKPT_MAGIC, sizeof(CKPT_MAGIC));
+  out.write((const char*)hdr, sizeof(hdr));
+  for (size_t i = 0; i < ck.size(); ++i) {
+    const ckptArray_t &a = ck[i];
+    int dim[3] = {(int)a.name.size(), a.nrow, a.ncol};
+    out.write((const char*)dim, sizeof(dim));
+    out.write(a.name.c_str(), a.name.size());
+    out.write((const char*)a.x.data(), sizeof(double)*a.x.size());
+  }
+  out.close();
+  if (!out) return false;
+  return std::rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+static inline void ckptRead(ckpt_t &ck, const std::string &file) {
+  std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+  if (!in) Rcpp::stop("cannot open checkpoint '%s'", file.c_str());
+  char magic[sizeof(CKPT_MAGIC)];
+  int hdr[2];
+  in.read(magic, sizeof(magic));
+  in.read((char*)hdr, sizeof(hdr));
+  if (!in || std::memcmp(magic, CKPT_MAGIC, sizeof(magic)) != 0) {
+    Rcpp::stop("'%s' is not a nlmixr2 checkpoint", file.c_str());
+  }
+  if (hdr[0] != CKPT_VERSION) {
+    Rcpp::stop("unsupported checkpoint version %d in '%s'", hdr[0], file.c_str());
+  }
+  ck.clear();
+  for (int i = 0; i < hdr[1]; ++i) {
+    ckptArray_t a;
+    int dim[3];
+    in.read((char*)dim, sizeof(dim));
+    if (!in || dim[0] < 0 || dim[1] < 0 || dim[2] < 0) {
+      Rcpp::stop("truncated checkpoint '%s'", file.c_str());
+    }
+    a.name.resize(dim[0]);
+    in.read(&a.name[0], dim[0]);
+    a.nrow = dim[1];
+    a.ncol = dim[2];
+    a.x.resize((size_t)dim[1]*(size_t)dim[2]);
+    in.read((char*)a.x.data(), sizeof(double)*a.x.size());
+    if (!in) Rcpp::stop("truncated checkpoint '%s'", file.c_str());
+    ck.push_back(a);
+  }
+}
+
+// Named list of the arrays; vectors for one column and matrices
+// otherwise
+static inline Rcpp::List ckptList(const ckpt_t &ck) {
+  Rcpp::List ret(ck.size());
+  Rcpp::CharacterVector nm(ck.size());
+  for (size_t i = 0; i < ck.size(); ++i) {
+    const ckptArray_t &a = ck[i];
+    nm[i] = a.name;
+    if (a.ncol == 1) {
+      ret[i] = Rcpp::NumericVector(a.x.begin(), a.x.end());
+    } else {
+      Rcpp::NumericMatrix m(a.nrow, a.ncol);
+      std::copy(a.x.begin(), a.x.end(), m.begin());
+      ret[i] = m;
+    }
+  }
+  ret.attr("names") = nm;
+  return ret;
+}
+
+// R's random number generator state (.Random.seed) so a resumed fit
+// draws the same numbers as an uninterrupted one
+static inline void ckptAddRNG(ckpt_t &ck) {
+  PutRNGstate();
+  SEXP seed = Rf_findVarInFrame(R_GlobalEnv, Rf_install(".Random.seed"));
+  if (seed != R_UnboundValue && TYPEOF(seed) == INTSXP) {
+    ckptAdd(ck, ".Random.seed", INTEGER(seed), Rf_length(seed));
+  }
+}
+
+static inline void ckptSetRNG(const ckpt_t &ck) {
+  const ckptArray_t *a = ckptGet(ck, ".Random.seed");
+  if (a == NULL) return;
+  SEXP seed = PROTECT(Rf_allocVector(INTSXP, a->x.size()));
+  for (size_t i = 0; i < a->x.size(); ++i) INTEGER(seed)[i] = (int)(a->x[i]);
+  Rf_defineVar(Rf_install(".Random.seed"), seed, R_GlobalEnv);
+  UNPROTECT(1);
+  GetRNGstate();
+}
+
+#endif
+
+#endif
@@ -5,7 +5,7 @@
 using namespace Rcpp;
 using namespace arma;
 
-arma::mat gershNested(arma::mat A, int j, int n) {
+arma::mat gershNested(const arma::mat &A, int j, int n) {
   arma::mat g(n, 1, fill::zeros);
   double sumToI, sumAfterI;
   for (int ii = j; ii < n; ++ii){
@@ -163,13 +163,225 @@ bool cholSE0(arma::mat &Ao, arma::mat &E, arma::mat A, double tol) {
   return phase1;
 }
 
-arma::mat cholSE__(arma::mat A, double tol) {
+arma::mat cholSE__(const arma::mat &A, double tol) {
   arma::mat Ao, E;
   cholSE0(Ao, E, A, tol);
   return Ao;
 }
+
+// Fixed size (n <= 8) versions for the individual Hessians.  The
+// matrices are column major n x n buffers; the work is done on the
+// stack and the upper triangular factor is written to Ao.
+
+#define A_(i, j) A[(i) + (j)*N]
+
+template <int N>
+static inline void gershFix(const double *A, double *g, int j) {
+  for (int ii = 0; ii < j; ++ii) g[ii] = 0.0;
+  for (int ii = j; ii < N; ++ii){
+    double sumToI = 0.0, sumAfterI = 0.0;
+    if (ii == 0){
+      sumToI = 0.0;
+    } else if (j == ii){
+      sumToI = std::fabs(A_(ii, ii-1)) + std::fabs(A_(ii, ii));
+    } else {
+      for (int k = j; k < ii; ++k) sumToI += std::fabs(A_(ii, k));
+    }
+    for (int k = ii+1; k < N; ++k) sumAfterI += std::fabs(A_(k, ii));
+    g[ii] = sumToI + sumAfterI - A_(ii, ii);
+  }
+}
+
+// Same algorithm as cholSE0() (n >= 2; n = 1 is specialized below)
+template <int N>
+static bool cholSEFix(double *Ao, const double *A0, double tol) {
+  double A[N*N];
+  std::copy(A0, A0 + N*N, A);
+  double g[N], E[N];
+  for (int j = N; j--;) {
+    g[j] = 0.0;
+    E[j] = 0.0;
+  }
+  double tau1 = tol, tau2 = tol;
+  bool phase1 = true;
+  double delta = 0;
+  int j;
+  double gamma = A_(N-1, N-1);
+  if (gamma < 0) phase1 = false;
+  for (j = 0; j < N-1; j++){
+    if (A_(j, j) < 0) phase1 = false;
+    if (A_(j, j) > gamma) gamma = A_(j, j);
+  }
+  double taugam = tau1*gamma;
+  if (!phase1) gershFix<N>(A, g, 0);
+  int jp1, ii, k;
+  double tempjj, temp=1., normj, tmp;
+  for (j = 0; j < N-1; j++){
+    if (phase1){
+      jp1 = j+1;
+      if (A_(j, j) > 0){
+        double mintmp = A_(jp1, jp1) - A_(jp1, j)*A_(jp1, j)/A_(j, j);
+        for (ii = jp1 + 1; ii < N; ii++) {
+          tmp = A_(ii, ii) - A_(ii, j)*A_(ii, j)/A_(j, j);
+          if (tmp < mintmp) mintmp = tmp;
+        }
+        if (mintmp < taugam) phase1=false;
+      } else phase1 = false;
+      if (phase1){
+        A_(j, j) = _safe_sqrt(A_(j, j));
+        tempjj = A_(j, j);
+        for (ii = jp1; ii < N; ii++){
+          A_(ii, j) = A_(ii, j)/tempjj;
+        }
+        for (ii = jp1; ii < N; ii++){
+          temp = A_(ii, j);
+          for (k = jp1; k < ii+1; k++){
+            A_(ii, k) = A_(ii, k) - (temp * A_(k, j));
+          }
+        }
+        if (j == N-2){
+          A_(N-1, N-1) = _safe_sqrt(A_(N-1, N-1));
+        }
+      } else {
+        gershFix<N>(A, g, j);
+      }
+    }
+    if (!phase1){
+      if (j != N-2){
+        normj = 0.0;
+        for (ii = j+1; ii < N; ii++) normj += std::fabs(A_(ii, j));
+        if (delta < 0) delta = 0;
+        tmp  = -A_(j, j) + normj;
+        if (delta < tmp) delta = tmp;
+        tmp  = -A_(j, j) + taugam;
+        if (delta < tmp) delta = tmp;
+        E[j] = delta;
+        A_(j, j) = A_(j, j) + E[j];
+        if (A_(j, j) != normj){
+          temp = (normj/A_(j, j)) - 1;
+          for (ii = j+1; ii < N; ii++){
+            g[ii] = g[ii] + std::fabs(A_(ii, j)) * temp;
+          }
+        }
+        for (ii = j+1; ii < N; ii++){
+          g[ii] = g[ii] + std::fabs(A_(ii, j)) * temp;
+        }
+        A_(j, j) = _safe_sqrt(A_(j, j));
+        tempjj = A_(j, j);
+        for (ii = j+1; ii < N; ii++){
+          A_(ii, j) = A_(ii, j) / tempjj;
+        }
+        for (ii = j+1; ii < N; ii++){
+          temp = A_(ii, j);
+          for (k = j+1; k < ii+1; k++){
+            A_(ii, k) = A_(ii, k) - (temp * A_(k, j));
+          }
+        }
+      } else {
+        // Closed form eigenvalues of the final 2 by 2 submatrix
+        double p2 = A_(N-2, N-2), q2 = A_(N-1, N-2), s2 = A_(N-1, N-1);
+        double m2 = 0.5*(p2 + s2), d2 = std::hypot(0.5*(p2 - s2), q2);
+        double eigMin = m2 - d2, eigMax = m2 + d2;
+        if (delta < 0) delta = 0;
+        tmp = (eigMax - eigMin)/(1-tau1);
+        if (tmp < gamma) tmp = gamma;
+        tmp = tau2*tmp;
+        tmp = tmp - eigMin;
+        if (delta < tmp) delta = tmp;
+        if (delta > 0){
+          A_(N-2, N-2) = A_(N-2, N-2) + delta;
+          A_(N-1, N-1) = A_(N-1, N-1) + delta;
+          E[N-2] = delta;
+          E[N-1] = delta;
+        }
+        A_(N-2, N-2) = _safe_sqrt(A_(N-2, N-2));
+        A_(N-1, N-2) = A_(N-1, N-2)/A_(N-2, N-2);
+        A_(N-1, N-1) = A_(N-1, N-1) - A_(N-1, N-2)*A_(N-1, N-2);
+        A_(N-1, N-1) = _safe_sqrt(A_(N-1, N-1));
+      }
+    }
+  }
+  // Ao = t(trimatl(A))
+  for (j = 0; j < N; j++) {
+    for (ii = 0; ii < N; ii++) {
+      Ao[ii + j*N] = (ii <= j) ? A_(j, ii) : 0.0;
+    }
+  }
+  return phase1;
+}
+
+template <>
+bool cholSEFix<1>(double *Ao, const double *A, double tol) {
+  double E = 0.0;
+  double delta = tol*std::fabs(A[0]) - A[0];
+  if (delta > 0) E = delta;
+  if (A[0] == 0) E = tol;
+  Ao[0] = _safe_sqrt(A[0] + E);
+  return true;
+}
+
+// Upper Cholesky factor (like arma::chol(Ao, A)); false when A is not
+// positive definite
+template <int N>
+static bool cholFix(double *Ao, const double *A, double) {
+  for (int j = 0; j < N; ++j) {
+    double s = A_(j, j);
+    for (int k = 0; k < j; ++k) s -= Ao[k + j*N]*Ao[k + j*N];
+    if (!(s > 0.0)) return false;
+    double ujj = sqrt(s);
+    Ao[j + j*N] = ujj;
+    for (int i = j+1; i < N; ++i) {
+      double t = A_(j, i);
+      for (int k = 0; k < j; ++k) t -= Ao[k + j*N]*Ao[k + i*N];
+      Ao[j + i*N] = t/ujj;
+      Ao[i + j*N] = 0.0;
+    }
+  }
+  return true;
+}
+
+#undef A_
+
+#define cholFixCase(fun, n) case n: return &fun<n>
+
+cholFix_t cholFixGet(int n) {
+  switch (n) {
+    cholFixCase(cholFix, 1);
+    cholFixCase(cholFix, 2);
+    cholFixCase(cholFix, 3);
+    cholFixCase(cholFix, 4);
+    cholFixCase(cholFix, 5);
+    cholFixCase(cholFix, 6);
+    cholFixCase(cholFix, 7);
+    cholFixCase(cholFix, 8);
+  }
+  return NULL;
+}
+
+cholFix_t cholSEFixGet(int n) {
+  switch (n) {
+    cholFixCase(cholSEFix, 1);
+    cholFixCase(cholSEFix, 2);
+    cholFixCase(cholSEFix, 3);
+    cholFixCase(cholSEFix, 4);
+    cholFixCase(cholSEFix, 5);
+    cholFixCase(cholSEFix, 6);
+    cholFixCase(cholSEFix, 7);
+    cholFixCase(cholSEFix, 8);
+  }
+  return NULL;
+}
+
+#undef cholFixCase
+
 //[[Rcpp::export]]
 NumericMatrix cholSE_(NumericMatrix A, double tol){
+  cholFix_t cholSEn = (A.nrow() == A.ncol()) ? cholSEFixGet(A.nrow()) : NULL;
+  if (cholSEn != NULL) {
+    NumericMatrix Ao(A.nrow(), A.ncol());
+    cholSEn(&Ao[0], &A[0], tol);
+    return Ao;
+  }
   arma::mat Ao, E;
   cholSE0(Ao, E, as<arma::mat>(A), tol);
   return wrap(Ao);
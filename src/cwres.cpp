@@ -1,5 +1,13 @@
 #define STRICT_R_HEADER
 #include "cwres.h"
+#include "tbs.h"
+// dErr/dEta * eta of the rows [i0, i1] written directly into out
+static inline void cwresDerrRows(arma::vec &out, arma::mat &fpm, arma::mat &etas,
+                                 int i0, int i1, int col) {
+  arma::vec cur(out.memptr() + i0, i1 - i0 + 1, false, true);
+  cur = fpm.rows(i0, i1) * trans(etas.row(col));
+}
+
 static inline void calculateCwresDerr(arma::mat& fppm, arma::mat& fpim,
 				      arma::ivec& ID, arma::mat &etas,
 				      arma::vec &dErr_dEta_i, arma::vec &dErr_dEta_p,
@@ -16,11 +24,8 @@ static inline void calculateCwresDerr(arma::mat& fppm, arma::mat& fpim,
 	std::fill_n(cur.begin()+j+1,lastIndex-j,curEta);
       }
       etaFulli--;
-      // FIXME do it without copy?
-      arma::vec tmp = fppm.rows(j+1, lastIndex) * trans(etas.row(lastCol));
-      std::copy(tmp.begin(),tmp.end(),dErr_dEta_p.begin()+j+1);
-      tmp = fpim.rows(j+1, lastIndex) * trans(etas.row(lastCol));
-      std::copy(tmp.begin(),tmp.end(),dErr_dEta_i.begin()+j+1);
+      cwresDerrRows(dErr_dEta_p, fppm, etas, j+1, lastIndex, lastCol);
+      cwresDerrRows(dErr_dEta_i, fpim, etas, j+1, lastIndex, lastCol);
       lastId=ID[j];
       lastIndex=j;
       lastCol--;
@@ -32,10 +37,8 @@ static inline void calculateCwresDerr(arma::mat& fppm, arma::mat& fpim,
 	  std::fill_n(cur.begin(),lastIndex+1,curEta);
 	}
 	// Finalize dErr_dEta
-	arma::vec tmp = fppm.rows(0, lastIndex) * trans(etas.row(lastCol));
-	std::copy(tmp.begin(),tmp.end(),dErr_dEta_p.begin());
-	tmp = fpim.rows(0, lastIndex) * trans(etas.row(lastCol));
-	std::copy(tmp.begin(),tmp.end(),dErr_dEta_i.begin());
+	cwresDerrRows(dErr_dEta_p, fppm, etas, 0, lastIndex, lastCol);
+	cwresDerrRows(dErr_dEta_i, fpim, etas, 0, lastIndex, lastCol);
 	break;
       }
     }
@@ -60,37 +63,14 @@ BEGIN_RCPP
   int npred = getPredIndex(ipredL);
 
   arma::vec ipredt(REAL(ipredL[npred]), ncalc, false, true);
-  arma::vec ipred(ipredt.size());
-
   arma::vec predt(REAL(predL[npred]), ncalc, false, true);
-  arma::vec pred(predt.size());
-
-  arma::vec dv(REAL(dvIn), ncalc, false, true);
-  arma::vec dvt(ncalc);
-
-  arma::ivec cens;
-  if (Rf_isNull(censIn)) {
-    cens = arma::ivec(ncalc, fill::zeros);
-  } else {
-    cens = as<arma::ivec>(censIn);
-  }
-  arma::ivec evid;
-  if (Rf_isNull(evidIn)) {
-    evid = arma::ivec(ncalc, fill::zeros);
-  } else {
-    evid = as<arma::ivec>(evidIn);
-  }
 
-  arma::vec limit;
-  int hasLimit=0;
-  getLimitFromInput(limitIn, ncalc, limit, hasLimit);
+  resObs_t obs(dvIn, evidIn, censIn, limitIn, ncalc);
 
   arma::vec     hi(REAL(ipredL[ipredL.size()-1]), ncalc, false, true);
   arma::vec    low(REAL(ipredL[ipredL.size()-2]), ncalc, false, true);
   arma::vec     yj(REAL(ipredL[ipredL.size()-3]), ncalc, false, true);
   arma::vec lambda(REAL(ipredL[ipredL.size()-4]), ncalc, false, true);
-  arma::vec lowerLim(ncalc);
-  arma::vec upperLim(ncalc);
 
   arma::mat omegaMat = as<arma::mat>(omegaMatSEXP);
   unsigned int neta = omegaMat.n_rows;
@@ -98,24 +78,19 @@ BEGIN_RCPP
   arma::vec rpv(REAL(predL[npred+1+neta]), ncalc, false, true);
   arma::vec riv(REAL(ipredL[npred+1+neta]), ncalc, false, true);
 
-  bool doSim = true;
   List opt = as<List>(cwresOpt);
-  if (opt.containsElementNamed("doSim")) {
-    RObject tmp = opt["doSim"];
-    if (TYPEOF(tmp) == LGLSXP) {
-      doSim = as<bool>(tmp);
-    }
-  }
-  int censMethod = CENS_TNORM;
-  if (opt.containsElementNamed("censMethod")) {
-    RObject tmp = opt["censMethod"];
-    if (TYPEOF(tmp) == INTSXP) {
-      censMethod = as<int>(opt["censMethod"]);
-    }
-  }
-  bool interestingLimits = censTruncatedMvnReturnInterestingLimits(dv, dvt, ipred, ipredt, pred, predt, cens, limit,
-  								   lambda, yj, low, hi, lowerLim, upperLim,
-  								   riv, doSim, censMethod);
+  resOpt_t ropt = getResOpt(opt);
+
+  // The output columns are allocated once and filled in place
+  NumericVector PRED(ncalc), RES(ncalc), WRES(ncalc), IPRED(ncalc), IRES(ncalc),
+    IWRES(ncalc), CPRED(ncalc), CRES(ncalc), CWRES(ncalc);
+  arma::vec ipred(REAL(IPRED), ncalc, false, true);
+  arma::vec pred(REAL(PRED), ncalc, false, true);
+
+  bool interestingLimits = censTruncatedMvnReturnInterestingLimits(obs.dv, obs.dvt, ipred, ipredt, pred, predt,
+                                                                   obs.cens, obs.limit,
+                                                                   lambda, yj, low, hi, obs.lowerLim, obs.upperLim,
+                                                                   riv, ropt.doSim, ropt.censMethod);
 
 
   arma::ivec ID(INTEGER(predL[0]), ncalc, false, true);
@@ -139,8 +114,10 @@ BEGIN_RCPP
   etasDfFull.attr("row.names")=IntegerVector::create(NA_INTEGER,-ncalc);
   etasDfFull.attr("class") = "data.frame";
 
-  arma::mat V_fo_p = (fppm * omegaMat * fppm.t()); // From Mentre 2006 p. 352
-  arma::mat V_fo_i = (fpim * omegaMat * fpim.t()); // From Mentre 2006 p. 352
+  // Only the diagonal of the FO variance (fppm * omega * fppm^T) is
+  // used, so it is calculated without the ncalc x ncalc matrix
+  // (From Mentre 2006 p. 352)
+  //
   // There seems to be a difference between how NONMEM and R/S types
   // of software calculate WRES.  Mentre 2006 states that the
   // Variance under the FO condition should only be diag(Vfo_full) + Sigma,
@@ -160,98 +137,36 @@ BEGIN_RCPP
   // the FOCE condition for the Vfo and the FO conditions for
   // dh/deta
   //
-
-  arma::vec Vfop = V_fo_p.diag();
-  arma::vec Vfoi = V_fo_i.diag();
+  arma::vec vp = sum((fppm * omegaMat) % fppm, 1) + rpv;
+  arma::vec vi = sum((fpim * omegaMat) % fpim, 1) + riv;
 
   arma::vec dErr_dEta_i(ncalc);
   arma::vec dErr_dEta_p(ncalc);
   calculateCwresDerr(fppm, fpim, ID, etas, dErr_dEta_i, dErr_dEta_p, etasDfFull, nid, neta);
 
-  arma::vec rest = dvt - predt;
-  arma::vec vsum = abs(Vfop+rpv);
-  arma::vec wres = rest;
-  arma::uvec vsum0 = find(vsum != 0);
-  wres.elem(vsum0) /= sqrt(vsum.elem(vsum0));
-
   arma::vec cpredt = ipredt - dErr_dEta_i;
-  arma::vec crest = dvt - cpredt;
-
-  arma::vec cpred(cpredt.size());
-  arma::vec cres(crest.size());
-  for (unsigned int i = cres.size(); i--;){
-    cpred[i] = _powerDi(cpredt[i], lambda[i], (int)yj[i], low[i], hi[i]);
-    cres[i]  = dv[i] - cpred[i];
-    pred[i] = _powerDi(predt[i], lambda[i], (int)yj[i], low[i], hi[i]);
-  }
-  arma::vec res = dv - pred;
-  vsum = Vfoi+riv;
-  vsum0 = find(vsum != 0);
-  arma::vec cwres = crest;
-  cwres.elem(vsum0) /= sqrt(vsum.elem(vsum0));
-  arma::uvec riv0 = find(riv!=0);
-  arma::vec iwres=(dvt-ipredt);
-  iwres.elem(riv0)/=sqrt(riv.elem(riv0));
-  arma::vec ires = dv - ipred;
-
-  for (unsigned int j = ires.size(); j--; ) {
-    if (censMethod == CENS_OMIT && cens[j] != 0) {
-      dv[j]	= NA_REAL;
-      pred[j]	= NA_REAL;
-      res[j]	= NA_REAL;
-      wres[j]	= NA_REAL;
-      ipred[j]	= NA_REAL;
-      ires[j]	= NA_REAL;
-      iwres[j]	= NA_REAL;
-      cpred[j]	= NA_REAL;
-      cres[j]	= NA_REAL;
-      cwres[j]	= NA_REAL;
-    } else if (evid[j] != 0) {
-      dv[j]	= NA_REAL;
-      res[j]	= NA_REAL;
-      wres[j]	= NA_REAL;
-      ires[j]	= NA_REAL;
-      iwres[j]	= NA_REAL;
-      cres[j]	= NA_REAL;
-      cwres[j]	= NA_REAL;
-    }
-  }
-  int ncol = 9;
-  if (interestingLimits) {
-    ncol += 3 + hasLimit;
-  }
-  List retDF(ncol);
-  CharacterVector nm(ncol);
-  int i=0;
-  //nm[i] = "DV"; retDF[i++] = wrap(dv);
-  nm[i] = "PRED"; retDF[i++] = wrap(pred);
-  nm[i] = "RES"; retDF[i++] = wrap(res);
-  nm[i] = "WRES"; retDF[i++] = wrap(wres);
-  nm[i] = "IPRED"; retDF[i++] = wrap(ipred);
-  nm[i] = "IRES"; retDF[i++] = wrap(ires);
-  nm[i] = "IWRES"; retDF[i++] = wrap(iwres);
-  nm[i] = "CPRED"; retDF[i++] = wrap(cpred);
-  nm[i] = "CRES"; retDF[i++] = wrap(cres);
-  nm[i] = "CWRES"; retDF[i++] = wrap(cwres);
-  if (interestingLimits) {
-    nm[i] = "CENS"; retDF[i++] = wrap(cens);
-    if (hasLimit){
-      nm[i] = "LIMIT"; retDF[i++] = wrap(limit);
-    }
-    nm[i] = "lowerLim"; retDF[i++] = wrap(lowerLim);
-    nm[i] = "upperLim"; retDF[i++] = wrap(upperLim);
-  }
-  retDF.names() = nm;
-  retDF.attr("row.names") = IntegerVector::create(NA_INTEGER,-ncalc);
-  retDF.attr("class") = "data.frame";
-  calcShrinkFinalize(omegaMat, nid, etaLst, iwres, evid, etaN2, 1);
+  tbsDvD(REAL(CPRED), cpredt.memptr(), ncalc, lambda.memptr(), yj.memptr(),
+         low.memptr(), hi.memptr(), 1);
+
+  resFused_t r = {ipredt.memptr(), ipred.memptr(), riv.memptr(),
+                  predt.memptr(), pred.memptr(), vp.memptr(),
+                  cpredt.memptr(), REAL(CPRED), vi.memptr(),
+                  REAL(IRES), REAL(IWRES), REAL(RES), REAL(WRES), REAL(CRES), REAL(CWRES)};
+  resFusedCalc(obs, ropt, r);
+
+  List retDF = resDf(obs, interestingLimits,
+                     CharacterVector::create("PRED", "RES", "WRES", "IPRED", "IRES", "IWRES",
+                                             "CPRED", "CRES", "CWRES"),
+                     List::create(PRED, RES, WRES, IPRED, IRES, IWRES, CPRED, CRES, CWRES));
+  arma::vec iwres(REAL(IWRES), ncalc, false, true);
+  calcShrinkFinalize(omegaMat, nid, etaLst, iwres, obs.evid, etaN2, 1);
   List retC = List::create(retDF, etasDfFull, getDfSubsetVars(ipredL, stateSXP),
 			   getDfSubsetVars(ebeL, relevantLHSSEXP),
 			   getDfSubsetVars(ebeL, covSXP));
   dfSetStateLhsOps(retC, opt);
   retC = dfCbindList(wrap(retC));
   List ret(4);
-  ret[0] = wrap(dv);
+  ret[0] = wrap(obs.dv);
   ret[1] = getDfIdentifierCols(ebeL, npred, stateSXP, IDlabelSEXP);
   ret[2] = retC;
   ret[3] = etaLst;
@@ -9,6 +9,8 @@
 #include "ires.h"
 #include "utilc.h"
 #include "shrink.h"
+#define __nlmixr2est_optim_internal__
+#include "../inst/include/nlmixr2est_optim.h"
 
 /* Internal C calls, should not be called outside of C code. */
 typedef void (*S_fp) (double *, double *);
@@ -16,12 +18,30 @@ extern void nelder_fn(S_fp func, int n, double *start, double *step,
 	       int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
 	       int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
 	       int *iprint);
+extern int nelder_work_size(int n);
+extern void nelder_fn2(nmfn_ex_t func, void *ex, int n, double *start, double *step,
+                       int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
+                       int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
+                       int *iprint, double *work, int cores);
+extern double uni_slice2(double x0, slice_ld_t g, void *ex, double w, int m,
+                         double lower, double upper, int *nevals);
+extern void slice_chains(slice_ld_t g, void *ex, int nchain, const double *x0, int nsamp,
+                         double w, int m, double lower, double upper,
+                         double *out, int *nevals, int cores);
+typedef double (*nlmixr2GradObj_t)(int n, double *theta, void *ex);
+extern int nlmixr2GradSetObj(const char *md5, nlmixr2GradObj_t fn, void *ex);
+extern double nlmixr2GradEval(const char *md5, int n, double *theta);
+extern int nlmixr2GradGrad(const char *md5, int n, double *theta, double *g);
+extern const char *nlmixr2GradError(void);
+extern int nlmixr2Llik(int family, int n, const double *y, const double *N,
+                       const double *params, double *fx, double *J);
 
 /* .Call calls */
 extern SEXP neldermead_wrap(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 /* extern SEXP n1qn1_wrap(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP); */
 extern SEXP _nlmixr2est_llik_binomial_c(SEXP, SEXP, SEXP);
 extern SEXP slice_wrap(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP slice_chains_wrap(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 
 extern SEXP _nlmixr2est_llik_poisson(SEXP, SEXP);
 extern SEXP _nlmixr2est_llik_normal(SEXP, SEXP);
@@ -29,7 +49,10 @@ extern SEXP _nlmixr2est_llik_betabinomial(SEXP, SEXP, SEXP);
 extern SEXP _nlmixr2est_llik_student_t(SEXP, SEXP);
 extern SEXP _nlmixr2est_llik_beta(SEXP, SEXP);
 extern SEXP _nlmixr2est_lin_cmt_stan(SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP);
+extern SEXP _nlmixr2est_lin_cmt_sens(SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP);
+extern SEXP _nlmixr2est_lin_cmt_pop_sens(SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP , SEXP);
 extern SEXP _nlmixr2est_llik_neg_binomial(SEXP, SEXP);
+extern SEXP _nlmixr2est_llik_closed(SEXP, SEXP, SEXP, SEXP);
 
 // FOCEi
 extern SEXP _nlmixr2est_nlmixr2Parameters(SEXP, SEXP);
@@ -41,6 +64,7 @@ SEXP _nlmixr2est_foceiLik(SEXP);
 SEXP _nlmixr2est_foceiOfv(SEXP);
 SEXP _nlmixr2est_foceiLik(SEXP);
 SEXP _nlmixr2est_foceiOfv(SEXP);
+SEXP _nlmixr2est_checkpointRead(SEXP);
 SEXP _nlmixr2est_foceiNumericGrad(SEXP);
 
 SEXP _nlmixr2est_foceiSetup_(SEXP, SEXP, SEXP, SEXP, SEXP,
@@ -63,6 +87,7 @@ SEXP _nlmixr2est_nlmixr2Eval_(SEXP, SEXP);
 SEXP _nlmixr2est_nlmixr2ParHist_(SEXP);
 SEXP _nlmixr2est_nlmixr2Hess_(SEXP, SEXP, SEXP, SEXP);
 SEXP _nlmixr2est_nlmixr2Unscaled_(SEXP, SEXP);
+SEXP _nlmixr2est_nlmixr2GradReset_(SEXP);
 
 SEXP _nlmixr2est_saem_fit(SEXP);
 SEXP _nlmixr2est_saem_do_pred(SEXP, SEXP, SEXP);
@@ -85,6 +110,8 @@ static const R_CallMethodDef CallEntries[] = {
   {"neldermead_wrap",      (DL_FUNC) &neldermead_wrap,      11},
   /* {"n1qn1_wrap",           (DL_FUNC) &n1qn1_wrap,           13}, */
   {"_nlmixr2est_lin_cmt_stan",  (DL_FUNC) &_nlmixr2est_lin_cmt_stan,   9},
+  {"_nlmixr2est_lin_cmt_sens",  (DL_FUNC) &_nlmixr2est_lin_cmt_sens,   9},
+  {"_nlmixr2est_lin_cmt_pop_sens",  (DL_FUNC) &_nlmixr2est_lin_cmt_pop_sens,   12},
   {"_nlmixr2est_llik_binomial_c", (DL_FUNC) &_nlmixr2est_llik_binomial_c,  3},
   {"_nlmixr2est_llik_poisson",  (DL_FUNC) &_nlmixr2est_llik_poisson,   2},
   {"_nlmixr2est_llik_normal",   (DL_FUNC) &_nlmixr2est_llik_normal,    2},
@@ -92,7 +119,9 @@ static const R_CallMethodDef CallEntries[] = {
   {"_nlmixr2est_llik_student_t",  (DL_FUNC) &_nlmixr2est_llik_student_t, 2},
   {"_nlmixr2est_llik_beta",     (DL_FUNC) &_nlmixr2est_llik_beta, 2},
   {"_nlmixr2est_llik_neg_binomial", (DL_FUNC) &_nlmixr2est_llik_neg_binomial, 2},
+  {"_nlmixr2est_llik_closed", (DL_FUNC) &_nlmixr2est_llik_closed, 4},
   {"slice_wrap",           (DL_FUNC) &slice_wrap,            7},
+  {"slice_chains_wrap",    (DL_FUNC) &slice_chains_wrap,     8},
   {"_nlmixr2est_nlmixr2Parameters", (DL_FUNC) &_nlmixr2est_nlmixr2Parameters, 2},
   // FOCEi
   {"_nlmixr2est_foceiInnerLp", (DL_FUNC) &_nlmixr2est_foceiInnerLp, 2},
@@ -100,6 +129,7 @@ static const R_CallMethodDef CallEntries[] = {
   {"_nlmixr2est_likInner", (DL_FUNC) &_nlmixr2est_likInner, 2},
   {"_nlmixr2est_foceiLik", (DL_FUNC) &_nlmixr2est_foceiLik, 1},
   {"_nlmixr2est_foceiOfv", (DL_FUNC) &_nlmixr2est_foceiOfv, 1},
+  {"_nlmixr2est_checkpointRead", (DL_FUNC) &_nlmixr2est_checkpointRead, 1},
   {"_nlmixr2est_foceiNumericGrad", (DL_FUNC) &_nlmixr2est_foceiNumericGrad, 1},
   {"_nlmixr2est_foceiSetup_", (DL_FUNC) &_nlmixr2est_foceiSetup_, 10},
   {"_nlmixr2est_foceiOuterF", (DL_FUNC) &_nlmixr2est_foceiOuterF, 1},
@@ -117,6 +147,7 @@ static const R_CallMethodDef CallEntries[] = {
   {"_nlmixr2est_nlmixr2Hess_", (DL_FUNC) &_nlmixr2est_nlmixr2Hess_, 4},
   {"_nlmixr2est_augPredTrans", (DL_FUNC) &_nlmixr2est_augPredTrans, 6},
   {"_nlmixr2est_nlmixr2Unscaled_", (DL_FUNC) &_nlmixr2est_nlmixr2Unscaled_, 2},
+  {"_nlmixr2est_nlmixr2GradReset_", (DL_FUNC) &_nlmixr2est_nlmixr2GradReset_, 1},
   {"_nlmixr2est_setSilentErr", (DL_FUNC) &_nlmixr2est_setSilentErr, 1},
   {"_nlmixr2est_saem_fit", (DL_FUNC) &_nlmixr2est_saem_fit, 1},
   {"_nlmixr2est_saem_do_pred", (DL_FUNC) &_nlmixr2est_saem_do_pred, 3},
@@ -124,6 +155,7 @@ static const R_CallMethodDef CallEntries[] = {
   {"_nlmixr2est_powerL", (DL_FUNC) &_nlmixr2est_powerL, 5},
   {"_saemResidF", (DL_FUNC) &_saemResidF, 1},
   {"_nlmixr2est_npdeCalc", (DL_FUNC) &_nlmixr2est_npdeCalc, 6},
+  {"_nlmixr2est_npdeWarn", (DL_FUNC) &_nlmixr2est_npdeWarn, 2},
   {"_nlmixr2est_cwresCalc",  (DL_FUNC) &_nlmixr2est_cwresCalc, 12},
   {"_nlmixr2est_resCalc",  (DL_FUNC) &_nlmixr2est_resCalc, 12},
   {"_nlmixr2est_iresCalc", (DL_FUNC) &_nlmixr2est_iresCalc, 10},
@@ -136,6 +168,15 @@ static const R_CallMethodDef CallEntries[] = {
 void R_init_nlmixr2est(DllInfo *dll)
 {
   R_RegisterCCallable("nlmixr2est","nelder_fn", (DL_FUNC) &nelder_fn);
+  R_RegisterCCallable("nlmixr2est","nelder_fn2", (DL_FUNC) &nelder_fn2);
+  R_RegisterCCallable("nlmixr2est","nelder_work_size", (DL_FUNC) &nelder_work_size);
+  R_RegisterCCallable("nlmixr2est","uni_slice2", (DL_FUNC) &uni_slice2);
+  R_RegisterCCallable("nlmixr2est","slice_chains", (DL_FUNC) &slice_chains);
+  R_RegisterCCallable("nlmixr2est","nlmixr2GradSetObj", (DL_FUNC) &nlmixr2GradSetObj);
+  R_RegisterCCallable("nlmixr2est","nlmixr2GradEval", (DL_FUNC) &nlmixr2GradEval);
+  R_RegisterCCallable("nlmixr2est","nlmixr2GradGrad", (DL_FUNC) &nlmixr2GradGrad);
+  R_RegisterCCallable("nlmixr2est","nlmixr2GradError", (DL_FUNC) &nlmixr2GradError);
+  R_RegisterCCallable("nlmixr2est","nlmixr2Llik", (DL_FUNC) &nlmixr2Llik);
   R_registerRoutines(dll, CEntries, CallEntries, NULL, NULL);
   R_useDynamicSymbols(dll, TRUE);
   R_forceSymbols(dll,FALSE);
@@ -5,6 +5,16 @@
 #include "utilc.h"
 #include <lbfgsb3c.h>
 #include "censEst.h"
+#include "profile.h"
+#include "tbs.h"
+#include "checkpoint.h"
+#include "parHist.h"
+#define __nlmixr2est_grad_internal__
+#include "../inst/include/nlmixr2est_grad.h"
+#include <map>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifdef ENABLE_NLS
 #include <libintl.h>
@@ -18,8 +28,10 @@
 
 #define min2( a , b )  ( (a) < (b) ? (a) : (b) )
 #define max2( a , b )  ( (a) > (b) ? (a) : (b) )
-#define innerOde(id) ind_solve(rx, id, rxInner.dydt_liblsoda, rxInner.dydt_lsoda_dum, rxInner.jdum_lsoda, rxInner.dydt, rxInner.update_inis, rxInner.global_jt)
-#define predOde(id) ind_solve(rx, id, rxPred.dydt_liblsoda, rxPred.dydt_lsoda_dum, rxPred.jdum_lsoda, rxPred.dydt, rxPred.update_inis, rxPred.global_jt)
+#define innerOde0(id) ind_solve(rx, id, rxInner.dydt_liblsoda, rxInner.dydt_lsoda_dum, rxInner.jdum_lsoda, rxInner.dydt, rxInner.update_inis, rxInner.global_jt)
+#define predOde0(id) ind_solve(rx, id, rxPred.dydt_liblsoda, rxPred.dydt_lsoda_dum, rxPred.jdum_lsoda, rxPred.dydt, rxPred.update_inis, rxPred.global_jt)
+#define innerOde(id) foceiProfOde(id, true)
+#define predOde(id) foceiProfOde(id, false)
 #define getCholOmegaInv() (as<arma::mat>(rxode2::rxSymInvCholEnvCalculate(_rxInv, "chol.omegaInv", R_NilValue)))
 #define getOmega() (as<NumericMatrix>(rxode2::rxSymInvCholEnvCalculate(_rxInv, "omega", R_NilValue)))
 #define getOmegaMat() (as<arma::mat>(rxode2::rxSymInvCholEnvCalculate(_rxInv, "omega", R_NilValue)))
@@ -104,6 +116,7 @@ typedef struct {
   // std::string obfStr;
   //
   List mvi;
+  double *etaArena = NULL; // Allocation holding all the per-subject buffers below
   double *etaUpper = NULL;
   double *etaLower = NULL;
   int *nbdInner = NULL;
@@ -127,11 +140,17 @@ typedef struct {
   double *gH = NULL;
   double *gH0 = NULL;
   double *gVid = NULL;
+  // Per-thread a/B/c rows with foceiControl(innerMemory="low")
+  double *gScratch = NULL;
+  size_t scratchStride = 0;
+  size_t arenaBytes = 0;
+  double peakBytes = 0;
 
   double *likSav = NULL;
 
   // Integer of ETAs
   unsigned int gEtaGTransN;
+  unsigned int etaStride; // per-subject stride of the eta sized buffers
   // Where likelihood is saved.
 
   int *etaTrans = NULL;
@@ -199,6 +218,7 @@ typedef struct {
   int imp;
   // int printInner;
   int printOuter;
+  double printSummary; // seconds between progress summaries (0 prints the rows)
 
 
   mat omega;
@@ -305,6 +325,20 @@ typedef struct {
   bool canDoFD  = false;
   bool adjLik = false;
   bool fallbackFD = false;
+  int cores = 1;
+  bool innerPar = false;
+  int etaCacheN = 0;
+  unsigned int etaCacheGen = 0;
+  bool etaCacheOff = false;
+  // foceiControl(warmStart=); n1qn1 then restarts from its converted
+  // curvature
+  bool warmStart = false;
+  // Fixed size factorizations of the individual Hessian (neta <= 8)
+  cholFix_t cholFix = NULL;
+  cholFix_t cholSEFix = NULL;
+  // a, B and c are only kept while the subject is solved; the Hessian
+  // is then assembled in likInner0()
+  bool lowMem = false;
 } focei_options;
 
 focei_options op_focei;
@@ -350,6 +384,16 @@ typedef struct {
   int doFD=0;
   int doEtaNudge;
   int badSolve=0;
+  int hessInf=0; // Infinite Hessian found in likInner0() (innerMemory="low")
+  // The last ODE solve of this subject failed; rxode2's op->badSolve
+  // is shared by the threads of the inner problem
+  int odeBadSolve=0;
+  // Resets done by innerOpt1_() for this subject; merged into op_focei
+  // by innerResetFlags() so the threaded inner problem does not write
+  // the shared flags
+  int didEtaReset;
+  int didHessianReset;
+  int didEtaNudge;
   double curF;
   double curT;
   double *curS;
@@ -357,13 +401,140 @@ typedef struct {
 
 focei_ind *inds_focei = NULL;
 
-// Parameter table
-std::vector<int> niter;
-std::vector<int> iterType;
-std::vector<double> vPar;
-std::vector<double> vGrad;
-std::vector<int> niterGrad;
-std::vector<int> gradType;
+// Parameter table (fit$parHistData) and the buffer for its unscaled
+// and back-transformed rows
+parHist_t foceiHist;
+std::vector<double> foceiHistRow;
+double foceiSummaryT0 = 0.0, foceiSummaryLast = 0.0, foceiSummaryBest = R_PosInf;
+
+// Gradient objective functions calculated ahead of time (in parallel)
+typedef struct {
+  int cpar;
+  double x; // perturbed (scaled) theta[cpar]
+  int cpar2; // second perturbed parameter (Hessian) or -1
+  double x2;
+  double scaleC;
+  double scaleC2;
+  double f;
+  int lik; // offset of the individual likelihoods in gradPreLik; -1 = not solved
+} gradPre_t;
+
+std::vector<gradPre_t> gradPre;
+std::vector<double> gradPreTheta;
+std::vector<double> gradPreLik;
+// Subject state before the first perturbation: eta, zm, saveEta,
+// lik[0] and mode/uzm/doEtaNudge/doChol
+std::vector<double> gradPreEta, gradPreZm, gradPreSaveEta, gradPreLik0;
+std::vector<int> gradPreInd;
+int gradPreNext = 0; // next perturbation used by the serial code
+bool gradPreKeepLik0 = false; // the serial code keeps lik[0] (S matrix)
+// Starting state of the threaded inner problem of each subject
+// (eta, zm and mode/uzm/doEtaNudge/doChol).  A subject whose threaded
+// solve fails goes back to it and is solved again serially, so the
+// ODE tolerance changes and resets are the ones the serial code does
+std::vector<double> innerParEta, innerParZm;
+std::vector<int> innerParInd;
+
+// Recent inner problem solutions by subject, keyed by ETA
+typedef struct {
+  unsigned int gen; // etaCacheGen when solved; 0 = empty
+  int doFD;
+  unsigned int use; // last use (least recently used is replaced)
+} etaCache_t;
+
+typedef struct {
+  size_t off; // offset of the subject's entries in etaCacheVal
+  int len; // doubles per entry
+  int nobs;
+  unsigned int use;
+  double nhit;
+  double nmiss;
+} etaCacheInd_t;
+
+std::vector<etaCache_t> etaCache;
+std::vector<etaCacheInd_t> etaCacheInd;
+std::vector<double> etaCacheVal;
+
+// Gill step sizes seeded from an earlier fit (foceiControl(gillCache=));
+// aEps, rEps, aEpsC and rEpsC for each estimated parameter (NA when
+// there is no seed).  gillSeedN is the number of seeds reused and the
+// number of seeds rejected (and searched again).
+std::vector<double> gillSeed;
+int gillSeedN[2] = {0, 0};
+
+// Checkpoint of the outer problem (foceiControl(checkpoint=)); written
+// at an improved objective function at most every foceiCkptInterval
+// seconds while the outer problem is optimized.
+std::string foceiCkptFile;
+double foceiCkptInterval = 0.0, foceiCkptLast = 0.0, foceiCkptBest = R_PosInf;
+bool foceiCkptOn = false;
+
+// Profiling counters by subject (fit$profile)
+typedef struct {
+  profPhase_t inner; // inner problem optimizations
+  profPhase_t innerOde;
+  profPhase_t predOde;
+  double nInnerF;
+  double nInnerG;
+  double nCholSE; // Hessians factored by cholSE (not positive definite)
+  double nReset; // ETA resets after a failed inner optimization
+} foceiProfInd_t;
+
+std::vector<foceiProfInd_t> foceiProfInd;
+
+// Cost-aware schedule of the threaded inner problem (fit$subjectCost).
+// The time of each subject's last inner problem is kept and the
+// subjects are handed to the threads longest first; with
+// schedule(dynamic) an idle thread takes the next most expensive
+// subject, so the cheap subjects fill in the end of the pass.  Before
+// a subject is timed its number of records is used as its cost.
+std::vector<double> foceiSchedTime;
+std::vector<int> foceiSchedOrder;
+
+static inline void foceiSchedSetup(rx_solve *rx) {
+  foceiSchedTime.assign(rx->nsub, NA_REAL);
+  foceiSchedOrder.resize(rx->nsub);
+  for (int id = rx->nsub; id--;) foceiSchedOrder[id] = id;
+  std::stable_sort(foceiSchedOrder.begin(), foceiSchedOrder.end(),
+                   [rx](int a, int b) {
+                     return rx->subjects[a].n_all_times > rx->subjects[b].n_all_times;
+                   });
+}
+
+// Reorder by the last recorded times; untimed subjects keep their
+// place after the timed ones
+static inline void foceiSchedUpdate() {
+  std::vector<double> &t = foceiSchedTime;
+  std::stable_sort(foceiSchedOrder.begin(), foceiSchedOrder.end(),
+                   [&t](int a, int b) {
+                     if (ISNA(t[b])) return !ISNA(t[a]);
+                     if (ISNA(t[a])) return false;
+                     return t[a] > t[b];
+                   });
+}
+
+// Profiling counters for the phases of the whole fit
+typedef struct {
+  profPhase_t ofv; // objective function evaluations
+  profPhase_t inner; // inner problem (all subjects)
+  profPhase_t grad; // outer gradient evaluations
+  profPhase_t cov; // covariance step
+  double nMuRef; // gradient elements from the mu-referenced shortcut
+} foceiProf_t;
+
+foceiProf_t foceiProf;
+
+// Mu-referenced gradient shortcut (foceiControl(muRefGrad=)): the
+// thetas and inverse omega of the last inner problem, the shortcut
+// gradient of each parameter and whether the Gill search accepted it
+// (1), rejected it (-1) or has not compared it yet (0)
+double foceiMuRefTol = 0.0;
+std::vector<double> foceiMuRefTheta, foceiMuRefG;
+std::vector<int> foceiMuRefOk;
+arma::mat foceiMuRefOmegaInv;
+// Shortcut gradients since the last comparison with finite differences
+int foceiMuRefNGrad = 0;
+#define FOCEI_MUREF_CHECK 10
 
 extern "C" void rxOptionsFreeFocei(){
 
@@ -373,7 +544,8 @@ extern "C" void rxOptionsFreeFocei(){
   if (op_focei.fullTheta != NULL) R_Free(op_focei.fullTheta);
   op_focei.fullTheta = NULL;
 
-  if (op_focei.etaUpper != NULL) R_Free(op_focei.etaUpper);
+  if (op_focei.etaArena != NULL) R_Free(op_focei.etaArena);
+  op_focei.etaArena = NULL;
   op_focei.etaUpper = NULL;
 
   if (op_focei.gillRet != NULL) R_Free(op_focei.gillRet);
@@ -395,12 +567,26 @@ extern "C" void rxOptionsFreeFocei(){
   focei_options newf;
   op_focei= newf;
 
-  vGrad.clear();
-  vPar.clear();
-  iterType.clear();
-  gradType.clear();
-  niter.clear();
-  niterGrad.clear();
+  parHistClear(foceiHist);
+  foceiHistRow.clear();
+  gradPre.clear();
+  gradPreTheta.clear();
+  gradPreLik.clear();
+  gradPreEta.clear();
+  gradPreZm.clear();
+  gradPreSaveEta.clear();
+  gradPreLik0.clear();
+  gradPreInd.clear();
+  innerParEta.clear();
+  innerParZm.clear();
+  innerParInd.clear();
+  gradPreNext = 0;
+  etaCache.clear();
+  etaCacheInd.clear();
+  etaCacheVal.clear();
+  foceiProfInd.clear();
+  foceiSchedTime.clear();
+  foceiSchedOrder.clear();
 }
 
 //[[Rcpp::export]]
@@ -480,6 +666,19 @@ void rxClearFuns(rxSolveF *inner){
 
 rx_solve* rx;
 
+// Solve one subject with the inner (sensitivity) or pred model, timed
+// for fit$profile
+static inline void foceiProfOde(int id, bool inner) {
+  double t0 = profNow();
+  if (inner) {
+    innerOde0(id);
+    if (!foceiProfInd.empty()) profAdd(&(foceiProfInd[id].innerOde), t0);
+  } else {
+    predOde0(id);
+    if (!foceiProfInd.empty()) profAdd(&(foceiProfInd[id].predOde), t0);
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // n1qn1 functions
 uvec lowerTri(mat H, bool diag = false){
@@ -492,32 +691,75 @@ uvec lowerTri(mat H, bool diag = false){
   }
 }
 
+// Lower triangle (column major) of the Hessian from the n1qn1 L D L'
+// curvature kept in zm
+static inline vec zmHess(focei_ind *indF) {
+  int n = op_focei.neta;
+  mat L = eye(n, n);
+  mat D = mat(n, n, fill::zeros);
+  mat H = mat(n, n);
+  unsigned int l_n = n * (n + 1)/2;
+  vec zmV(l_n);
+  std::copy(&indF->zm[0], &indF->zm[0]+l_n, zmV.begin());
+  H.elem(lowerTri(H, true)) = zmV;
+  if (n == 1) H = D;
+  else{
+    L.elem(lowerTri(H,false)) = H.elem(lowerTri(H,0));
+    D.diag() = H.diag();
+    H = L*D*L.t();
+  }
+  return H.elem(lowerTri(H, true));
+}
+
 void updateZm(focei_ind *indF){
+  if (indF->uzm == 2) {
+    // Hessian from a parent fit (foceiControl(warmStart=)) is already
+    // in zm
+    indF->uzm = 1;
+    indF->mode = 2;
+    return;
+  }
+  if (!indF->uzm && op_focei.warmStart) {
+    // With a warm start n1qn1 restarts from its last curvature
+    vec hessV = zmHess(indF);
+    std::fill(&indF->zm[0], &indF->zm[0]+op_focei.nzm,0.0);
+    std::copy(hessV.begin(),hessV.end(),&indF->zm[0]);
+    indF->uzm = 1;
+    indF->mode=2;
+    return;
+  }
   std::fill(&indF->zm[0], &indF->zm[0]+op_focei.nzm,0.0);
   if (!indF->uzm){
     // Udate the curvature to Hessian to restart n1qn1
-    int n = op_focei.neta;
-    mat L = eye(n, n);
-    mat D = mat(n, n, fill::zeros);
-    mat H = mat(n, n);
-    unsigned int l_n = n * (n + 1)/2;
-    vec zmV(l_n);
-    std::copy(&indF->zm[0], &indF->zm[0]+l_n, zmV.begin());
-    H.elem(lowerTri(H, true)) = zmV;
-    if (n == 1) H = D;
-    else{
-      L.elem(lowerTri(H,false)) = H.elem(lowerTri(H,0));
-      D.diag() = H.diag();
-      H = L*D*L.t();
-    }
+    vec hessV = zmHess(indF);
     // Hessian -> c.hess
-    vec hessV = H.elem(lowerTri(H, true));
     std::copy(hessV.begin(),hessV.end(),&indF->zm[0]);
     indF->uzm = 1;
     indF->mode=2;
   }
 }
 
+// Inner Hessians of each subject (one row per subject, the lower
+// triangle by column) to warm start later fits; NA when the subject
+// has no n1qn1 curvature
+static inline NumericMatrix foceiEtaHess() {
+  int n = op_focei.neta, l_n = n*(n+1)/2;
+  NumericMatrix ret(rx->nsub, l_n);
+  std::fill(ret.begin(), ret.end(), NA_REAL);
+  if (inds_focei == NULL || n == 0) return ret;
+  for (int id = rx->nsub; id--;) {
+    focei_ind *fInd = &(inds_focei[id]);
+    if (fInd->uzm == 1) continue;
+    if (fInd->uzm == 2) {
+      for (int k = l_n; k--;) ret(id, k) = fInd->zm[k];
+    } else {
+      vec hessV = zmHess(fInd);
+      for (int k = l_n; k--;) ret(id, k) = hessV[k];
+    }
+  }
+  return ret;
+}
+
 static inline double getScaleC(int i){
   if (ISNA(op_focei.scaleC[i])){
     switch (op_focei.xPar[i]){
@@ -628,9 +870,236 @@ static inline double scalePar(double *x, int i){
 }
 
 
+// Drop all the cached inner solutions; Called when theta or the ODE
+// tolerances change
+static inline void etaCacheReset() {
+  op_focei.etaCacheGen++;
+  if (op_focei.etaCacheGen == 0) {
+    for (unsigned int k = etaCache.size(); k--;) {
+      etaCache[k].gen = 0;
+    }
+    op_focei.etaCacheGen = 1;
+  }
+}
+
+// Allocate foceiControl(etaCache=) solutions per subject; Only the
+// FOCE(i) inner problem is cached (FO is not optimized by ETA)
+static inline void etaCacheSetup() {
+  etaCache.clear();
+  etaCacheInd.clear();
+  etaCacheVal.clear();
+  op_focei.etaCacheGen = 1;
+  if (op_focei.etaCacheN <= 0 || op_focei.neta == 0 || op_focei.fo == 1) return;
+  rx_solve *rx = getRx();
+  int neta = op_focei.neta;
+  size_t off = 0;
+  etaCacheInd.resize(rx->nsub);
+  for (int id = 0; id < rx->nsub; id++) {
+    rx_solving_options_ind *ind = &(rx->subjects[id]);
+    etaCacheInd_t *ci = &(etaCacheInd[id]);
+    ci->nobs = ind->n_all_times - ind->ndoses - ind->nevid2;
+    if (op_focei.lowMem) {
+      // eta, llik, tbsLik, lp, H, hessInf
+      ci->len = 2*neta + 2 + neta*neta + 1;
+    } else {
+      // eta, llik, tbsLik, lp, a, B, c
+      ci->len = 2*neta + 2 + ci->nobs*(2*neta + 1);
+    }
+    ci->off = off;
+    ci->use = 0;
+    ci->nhit = 0;
+    ci->nmiss = 0;
+    off += (size_t)(ci->len)*op_focei.etaCacheN;
+  }
+  etaCacheVal.resize(off);
+  etaCache.resize(rx->nsub*op_focei.etaCacheN);
+  for (unsigned int k = etaCache.size(); k--;) {
+    etaCache[k].gen = 0;
+    etaCache[k].doFD = 0;
+    etaCache[k].use = 0;
+  }
+}
+
+// Restore a saved inner solution for this eta; returns false when the
+// eta has not been solved under the current theta
+static inline bool etaCacheGet(double *eta, int id, focei_ind *fInd) {
+  if (etaCacheInd.empty() || op_focei.etaCacheOff) return false;
+  int neta = op_focei.neta;
+  etaCacheInd_t *ci = &(etaCacheInd[id]);
+  for (int k = 0; k < op_focei.etaCacheN; k++) {
+    etaCache_t *cur = &(etaCache[id*op_focei.etaCacheN + k]);
+    if (cur->gen != op_focei.etaCacheGen || cur->doFD != fInd->doFD) continue;
+    double *v = &etaCacheVal[ci->off + k*ci->len];
+    bool match = true;
+    for (int j = neta; j--;) {
+      if (v[j] != eta[j]) {
+        match = false;
+        break;
+      }
+    }
+    if (!match) continue;
+    fInd->llik   = v[neta];
+    fInd->tbsLik = v[neta + 1];
+    v += neta + 2;
+    std::copy(v, v + neta, &fInd->lp[0]);
+    v += neta;
+    if (op_focei.lowMem) {
+      std::copy(v, v + neta*neta, &fInd->H[0]);
+      fInd->hessInf = (int)(v[neta*neta]);
+    } else {
+      std::copy(v, v + ci->nobs*neta, &fInd->a[0]);
+      v += ci->nobs*neta;
+      std::copy(v, v + ci->nobs, &fInd->B[0]);
+      v += ci->nobs;
+      std::copy(v, v + ci->nobs*neta, &fInd->c[0]);
+    }
+    std::copy(&eta[0], &eta[0] + neta, &fInd->oldEta[0]);
+    cur->use = ++(ci->use);
+    ci->nhit++;
+    return true;
+  }
+  ci->nmiss++;
+  return false;
+}
+
+// Save the inner solution just calculated, replacing the least
+// recently used entry
+static inline void etaCachePut(double *eta, int id, focei_ind *fInd) {
+  if (etaCacheInd.empty() || op_focei.etaCacheOff) return;
+  int neta = op_focei.neta;
+  etaCacheInd_t *ci = &(etaCacheInd[id]);
+  int w = 0;
+  for (int k = 0; k < op_focei.etaCacheN; k++) {
+    etaCache_t *cur = &(etaCache[id*op_focei.etaCacheN + k]);
+    if (cur->gen != op_focei.etaCacheGen) {
+      w = k;
+      break;
+    }
+    if (cur->use < etaCache[id*op_focei.etaCacheN + w].use) w = k;
+  }
+  etaCache_t *cur = &(etaCache[id*op_focei.etaCacheN + w]);
+  double *v = &etaCacheVal[ci->off + w*ci->len];
+  std::copy(&eta[0], &eta[0] + neta, v);
+  v[neta]   = fInd->llik;
+  v[neta+1] = fInd->tbsLik;
+  v += neta + 2;
+  std::copy(&fInd->lp[0], &fInd->lp[0] + neta, v);
+  v += neta;
+  if (op_focei.lowMem) {
+    std::copy(&fInd->H[0], &fInd->H[0] + neta*neta, v);
+    v[neta*neta] = (double)(fInd->hessInf);
+  } else {
+    std::copy(&fInd->a[0], &fInd->a[0] + ci->nobs*neta, v);
+    v += ci->nobs*neta;
+    std::copy(&fInd->B[0], &fInd->B[0] + ci->nobs, v);
+    v += ci->nobs;
+    std::copy(&fInd->c[0], &fInd->c[0] + ci->nobs*neta, v);
+  }
+  cur->gen  = op_focei.etaCacheGen;
+  cur->doFD = fInd->doFD;
+  cur->use  = ++(ci->use);
+}
+
+static inline NumericVector etaCacheStats() {
+  double nhit = 0, nmiss = 0;
+  for (unsigned int id = etaCacheInd.size(); id--;) {
+    nhit  += etaCacheInd[id].nhit;
+    nmiss += etaCacheInd[id].nmiss;
+  }
+  NumericVector ret = NumericVector::create(_["size"]=op_focei.etaCacheN,
+                                            _["hit"]=nhit,
+                                            _["miss"]=nmiss);
+  return ret;
+}
+
+// Keep track of the largest size of the FOCEi buffers (in bytes)
+static inline void foceiBufferPeak() {
+  double cur = (double)(op_focei.arenaBytes) +
+    (double)(etaCacheVal.size())*sizeof(double) +
+    (double)(gradPreLik.capacity() + gradPreEta.capacity() + gradPreZm.capacity() +
+             gradPreSaveEta.capacity() + gradPreLik0.capacity() +
+             innerParEta.capacity() + innerParZm.capacity())*sizeof(double) +
+    (double)(gradPre.capacity())*sizeof(gradPre_t);
+  if (cur > op_focei.peakBytes) op_focei.peakBytes = cur;
+}
+
+static inline NumericVector foceiBufferSize() {
+  foceiBufferPeak();
+  NumericVector ret = NumericVector::create(_["subject"]=(double)(op_focei.arenaBytes),
+                                            _["etaCache"]=(double)(etaCacheVal.size())*sizeof(double),
+                                            _["gradient"]=(double)(gradPreLik.capacity())*sizeof(double),
+                                            _["peak"]=op_focei.peakBytes);
+  return ret;
+}
+
+static inline void foceiProfSetup(int nsub) {
+  foceiProfInd.resize(nsub);
+  for (int id = nsub; id--;) {
+    foceiProfInd_t *p = &(foceiProfInd[id]);
+    profZero(&(p->inner));
+    profZero(&(p->innerOde));
+    profZero(&(p->predOde));
+    p->nInnerF = 0;
+    p->nInnerG = 0;
+    p->nCholSE = 0;
+    p->nReset = 0;
+  }
+  profZero(&(foceiProf.ofv));
+  profZero(&(foceiProf.inner));
+  profZero(&(foceiProf.grad));
+  profZero(&(foceiProf.cov));
+  foceiProf.nMuRef = 0;
+}
+
+// fit$profile; the phases of the whole fit overlap (the objective
+// includes the inner problem, the gradient includes objective calls)
+static inline List foceiProfTable(SEXP idLvl) {
+  profTable_t tab;
+  profTableAdd(tab, 0, "objective", foceiProf.ofv);
+  profTableAdd(tab, 0, "inner", foceiProf.inner);
+  profTableAdd(tab, 0, "gradient", foceiProf.grad);
+  profTableAdd(tab, 0, "covariance", foceiProf.cov);
+  profTableAdd(tab, 0, "muRefGradient", foceiProf.nMuRef, NA_REAL);
+  for (unsigned int id = 0; id < foceiProfInd.size(); ++id) {
+    foceiProfInd_t *p = &(foceiProfInd[id]);
+    profTableAdd(tab, id + 1, "inner", p->inner);
+    profTableAdd(tab, id + 1, "innerOde", p->innerOde);
+    profTableAdd(tab, id + 1, "predOde", p->predOde);
+    profTableAdd(tab, id + 1, "innerF", p->nInnerF, NA_REAL);
+    profTableAdd(tab, id + 1, "innerG", p->nInnerG, NA_REAL);
+    profTableAdd(tab, id + 1, "cholSE", p->nCholSE, NA_REAL);
+    profTableAdd(tab, id + 1, "etaReset", p->nReset, NA_REAL);
+  }
+  return profTableDf(tab, idLvl);
+}
+
+// fit$subjectCost; the last inner problem time and iterations of each
+// subject and its place in the threaded schedule (1 is first)
+static inline List foceiSchedTable(SEXP idLvl) {
+  int n = foceiSchedTime.size();
+  IntegerVector id(n), order(n);
+  NumericVector t(n), nF(n);
+  for (int i = 0; i < n; ++i) {
+    id[i] = i + 1;
+    t[i] = foceiSchedTime[i];
+    nF[i] = inds_focei == NULL ? NA_REAL : inds_focei[i].nInnerF;
+  }
+  for (int k = 0; k < n; ++k) order[foceiSchedOrder[k]] = k + 1;
+  if (TYPEOF(idLvl) == STRSXP) {
+    id.attr("levels") = idLvl;
+    id.attr("class") = "factor";
+  }
+  List ret = List::create(_["ID"]=id, _["time"]=t, _["nInnerF"]=nF,
+                          _["order"]=order);
+  ret.attr("class") = "data.frame";
+  ret.attr("row.names") = IntegerVector::create(NA_INTEGER, -n);
+  return ret;
+}
+
 void updateTheta(double *theta){
   // Theta is the acutal theta
   unsigned int j, k;
+  etaCacheReset();
   for (k = op_focei.npars; k--;){
     j=op_focei.fixedTrans[k];
     op_focei.fullTheta[j] = unscalePar(theta, k);
@@ -665,7 +1134,7 @@ void updateTheta(double *theta){
   }
 }
 
-arma::mat cholSE__(arma::mat A, double tol);
+arma::mat cholSE__(const arma::mat &A, double tol);
 
 typedef void (*gill83fn_type)(double *fp, double *theta, int id);
 
@@ -761,8 +1230,82 @@ static inline double calcGradForEtaR(double *eta,
   return calcGradForEtaGeneral(eta,aEps, cpar, cid, 1);
 }
 
+static inline int foceiThread() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Individual Hessian (actually -H):
+//
+// H = 0.5*t(a) %*% diag(B) %*% a + 0.5*t(c) %*% c + omegaInv
+//
+// The lower triangle is accumulated as weighted column cross
+// products (a and c are column major, so the inner loop over
+// observations is contiguous) and then mirrored.  Everything is
+// written in the subject's H buffer so there are no temporaries; c is
+// NULL without interaction.  Returns false for an infinite Hessian.
+static inline bool innerHessian(double *H, double *a, double *B, double *c,
+                                int nobs) {
+  int neta = op_focei.neta;
+  for (int k = 0; k < neta; ++k) {
+    double *ak = a + k*nobs;
+    double *ck = (c == NULL) ? NULL : c + k*nobs;
+    for (int l = 0; l <= k; ++l) {
+      double *al = a + l*nobs;
+      double sum = 0.0;
+      if (ck == NULL) {
+        for (int i = 0; i < nobs; ++i) {
+          sum += al[i]*B[i]*ak[i];
+        }
+      } else {
+        double *cl = c + l*nobs;
+        for (int i = 0; i < nobs; ++i) {
+          sum += al[i]*B[i]*ak[i] + cl[i]*ck[i];
+        }
+      }
+      double cur = 0.5*sum + op_focei.omegaInv(k, l);
+      if (std::isinf(cur)) return false;
+      H[k + l*neta] = cur;
+      H[l + k*neta] = cur;
+    }
+  }
+  return true;
+}
+
+// Non-finite solution of subject id
+static inline bool innerOdeNonFinite(rx_solving_options_ind *ind, rx_solving_options *op) {
+  if (op->neq <= 0) return false;
+  int nsolve = (op->neq + op->nlin)*ind->n_all_times;
+  for (int ns = 0; ns < nsolve; ++ns) {
+    if (ISNA(ind->solve[ns]) || std::isnan(ind->solve[ns]) ||
+        std::isinf(ind->solve[ns])) return true;
+  }
+  return false;
+}
+
+// Solve subject id and record whether its solve failed.  rxode2's
+// op->badSolve is shared by the threads of the inner problem, so it is
+// only used (and cleared first) when solving serially; the threaded
+// solves check the subject's own solution
+static inline void innerOdeSolve(int id, rx_solving_options_ind *ind, rx_solving_options *op,
+                                 focei_ind *fInd) {
+  if (op_focei.innerPar) {
+    innerOde(id);
+    fInd->odeBadSolve = innerOdeNonFinite(ind, op);
+  } else {
+    op->badSolve = 0;
+    innerOde(id);
+    fInd->odeBadSolve = op->badSolve;
+  }
+}
+
 double likInner0(double *eta, int id){
-  rx = getRx();
+  // Local solve pointer; the global rx is not touched since this may
+  // be called from the threaded inner problem
+  rx_solve *rx = getRx();
   rx_solving_options_ind *ind = &(rx->subjects[id]);
   rx_solving_options *op = rx->op;
   int i, j;
@@ -784,33 +1327,44 @@ double likInner0(double *eta, int id){
   } else {
     recalc = true;
   }
+  // A recently visited eta only needs the saved solution copied back
+  if (recalc && op_focei.neta > 0 && !(op->neq > 0 && ISNA(ind->solve[0])) &&
+      etaCacheGet(eta, id, fInd)) {
+    return fInd->llik;
+  }
   if (recalc){
     for (j = op_focei.neta; j--;){
       ind->par_ptr[op_focei.etaTrans[j]] = eta[j];
     }
-    if (op_focei.stickyRecalcN2 <= op_focei.stickyRecalcN){
+    if (!op_focei.innerPar && op_focei.stickyRecalcN2 <= op_focei.stickyRecalcN){
       op_focei.stickyRecalcN2=0;
     }
     ind->solved = -1;
     // Solve ODE
     bool predSolve = false;
     if (fInd->doFD == 0) {
-      innerOde(id);
+      innerOdeSolve(id, ind, op, fInd);
       j=0;
-      while (op_focei.stickyRecalcN2 <= op_focei.stickyRecalcN && op->badSolve && j < op_focei.maxOdeRecalc) {
+      // When threaded, bad solves return NA and the subject is re-run
+      // serially (with the tolerance changes) after the parallel region
+      while (!op_focei.innerPar &&
+             op_focei.stickyRecalcN2 <= op_focei.stickyRecalcN && fInd->odeBadSolve &&
+             j < op_focei.maxOdeRecalc) {
         op_focei.stickyRecalcN2++;
         op_focei.reducedTol  = 1;
         op_focei.reducedTol2 = 1;
         // Not thread safe
         rxode2::atolRtolFactor_(op_focei.odeRecalcFactor);
+        etaCacheReset();
         ind->solved = -1;
-        innerOde(id);
+        innerOdeSolve(id, ind, op, fInd);
         j++;
       }
       if (j != 0) {
         if (op_focei.stickyRecalcN2 <= op_focei.stickyRecalcN){
           // Not thread safe
           rxode2::atolRtolFactor_(pow(op_focei.odeRecalcFactor, -j));
+          etaCacheReset();
         } else {
           op_focei.stickyTol=1;
         }
@@ -820,28 +1374,24 @@ double likInner0(double *eta, int id){
       predSolve=true;
       op_focei.didPredSolve = true;
     }
-    bool isBadSolve = false;
-    int nsolve = (op->neq + op->nlin)*ind->n_all_times;
-    if (op->neq > 0) {
-      for (int ns = 0; ns < nsolve; ++ns) {
-        if (ISNA(ind->solve[ns]) || std::isnan(ind->solve[ns]) ||
-            std::isinf(ind->solve[ns])) {
-          isBadSolve = true;
-          break;
-        }
-      }
-    }
-    if (isBadSolve){
+    if (innerOdeNonFinite(ind, op)){
       return NA_REAL;
       //throw std::runtime_error("bad solve");
     } else {
       // Update eta.
       arma::mat lp(fInd->lp, op_focei.neta, 1, false, true);
       lp.zeros();
-      arma::mat a(fInd->a, ind->n_all_times - ind->ndoses - ind->nevid2, op_focei.neta, false, true);
-      arma::mat B(fInd->B, ind->n_all_times - ind->ndoses - ind->nevid2, 1, false, true);
-      arma::mat c(fInd->c, ind->n_all_times - ind->ndoses - ind->nevid2,
-                  op_focei.neta, false, true);
+      int nobs = ind->n_all_times - ind->ndoses - ind->nevid2;
+      double *aP = fInd->a, *BP = fInd->B, *cP = fInd->c;
+      if (op_focei.lowMem) {
+        // This thread's a, B and c; the Hessian is assembled below
+        aP = op_focei.gScratch + foceiThread()*op_focei.scratchStride;
+        cP = aP + nobs*op_focei.neta;
+        BP = cP + nobs*op_focei.neta;
+      }
+      arma::mat a(aP, nobs, op_focei.neta, false, true);
+      arma::mat B(BP, nobs, 1, false, true);
+      arma::mat c(cP, nobs, op_focei.neta, false, true);
       arma::mat Vid(fInd->Vid, ind->n_all_times - ind->ndoses - ind->nevid2,
                     ind->n_all_times - ind->ndoses - ind->nevid2, false, true);
       if (op_focei.fo == 1){
@@ -855,6 +1405,12 @@ double likInner0(double *eta, int id){
       double f, err, r, fpm, fpm2, rp = 0,lnr, limit, dv,dv0, curT;
       int cens = 0;
       int oldNeq = op->neq;
+      // Only swap to the prediction system size when finite differences
+      // are needed; op->neq is shared between all threads.
+      bool anyFD = predSolve;
+      for (i = op_focei.neta; !anyFD && i--;) {
+        anyFD = op_focei.etaFD[i] == 1;
+      }
       iniSubjectI(id, 1, ind, op, rx, rxInner.update_inis);
       for (j = 0; j < ind->n_all_times; ++j){
         ind->idx=j;
@@ -921,7 +1477,7 @@ double likInner0(double *eta, int id){
                 a(k, i) = ind->lhs[i+1];
               }
             }
-            op->neq = op_focei.predNeq;
+            if (anyFD) op->neq = op_focei.predNeq;
             fInd->curT = curT;
             fInd->curF = f;
             fInd->curS = getSolve(j);
@@ -931,7 +1487,7 @@ double likInner0(double *eta, int id){
                 a(k, i) = fpm = calcGradForEtaF(eta, fInd->etahf, i, id);
               }
             }
-            op->neq = oldNeq;
+            if (anyFD) op->neq = oldNeq;
             // Ci = fpm %*% omega %*% t(fpm) + Vi; Vi=diag(r)
           } else {
             lnr =_safe_log(ind->lhs[op_focei.neta + 1]);
@@ -952,8 +1508,7 @@ double likInner0(double *eta, int id){
               }
               // Cannot combine for loop with for loop above because
               // calc_lhs overwrites the lhs memory.
-              op->neq = op_focei.predNeq;
-              op->neq = op_focei.predNeq;
+              if (anyFD) op->neq = op_focei.predNeq;
               fInd->curT = curT;
               fInd->curS = getSolve(j);
               for (i = op_focei.neta; i--; ) {
@@ -985,7 +1540,7 @@ double likInner0(double *eta, int id){
                     0.5 * c(k, i) - 0.5 * err * fpm * B(k, 0);
                 lp(i, 0) += dCensNormal1((double)cens, dv, limit, lpCur, f, r, fpm, rp);
               }
-              op->neq = oldNeq;
+              if (anyFD) op->neq = oldNeq;
               // Eq #10
               //llik <- -0.5 * sum(err ^ 2 / R + log(R));
               double ll = err * err/_safe_zero(r) + lnr;
@@ -996,7 +1551,7 @@ double likInner0(double *eta, int id){
                   a(k, i) = ind->lhs[i + 1];
                 }
               }
-              op->neq = op_focei.predNeq;
+              if (anyFD) op->neq = op_focei.predNeq;
               fInd->curT = curT;
               fInd->curF = f;
               fInd->curS = getSolve(j);
@@ -1010,7 +1565,7 @@ double likInner0(double *eta, int id){
                 double lpCur = -0.5 * err * fpm * B(k, 0);
                 lp(i, 0) += dCensNormal1((double)cens, dv, limit, lpCur, f, r, fpm, rp);
               }
-              op->neq = oldNeq;
+              if (anyFD) op->neq = oldNeq;
               // Eq #10
               //llik <- -0.5 * sum(err ^ 2 / R + log(R));
               double ll = err * err/_safe_zero(r) + lnr;
@@ -1065,7 +1620,12 @@ double likInner0(double *eta, int id){
         // Partially finalize #10
         fInd->llik = -trace(fInd->llik - 0.5*(etam.t() * op_focei.omegaInv * etam));
         // print(wrap(fInd->llik));
+        if (op_focei.lowMem) {
+          fInd->hessInf = !innerHessian(fInd->H, aP, BP,
+                                        op_focei.interaction ? cP : NULL, nobs);
+        }
         std::copy(&eta[0], &eta[0] + op_focei.neta, &fInd->oldEta[0]);
+        etaCachePut(eta, id, fInd);
         // for (int ssi = op_focei.neta; ssi--;){
         //   // RSprintf("ssi: %d :%d;\n",id, ssi);
         //   // RSprintf("eta: %f\n", eta[ssi]);
@@ -1119,7 +1679,7 @@ double LikInner2(double *eta, int likId, int id){
     // print(wrap(op_focei.logDetOmegaInv5));
     lik = -likInner0(eta, id) + op_focei.logDetOmegaInv5;
     // print(wrap(lik));
-    rx = getRx();
+    rx_solve *rx = getRx();
     rx_solving_options_ind *ind = &(rx->subjects[id]);
     rx_solving_options *op = rx->op;
     if (op->neq > 0 && ISNA(ind->solve[0])){
@@ -1128,56 +1688,41 @@ double LikInner2(double *eta, int likId, int id){
     }
     // Calculate lik first to calculate components for Hessian
     // Hessian
-    mat H(fInd->H, op_focei.neta, op_focei.neta, false, true);
-    H.zeros();
-    int k, l;
-    mat tmp;
-
-    arma::mat a(fInd->a, ind->n_all_times - ind->ndoses - ind->nevid2, op_focei.neta, false, true);
-    // std::copy(&fInd->a[0], &fInd->a[0]+a.size(), a.begin());
-    arma::mat B(fInd->B, ind->n_all_times - ind->ndoses - ind->nevid2, 1, false, true);
-    // std::copy(&fInd->B[0], &fInd->B[0]+B.size(), B.begin());
-
-    // This is actually -H
-    if (op_focei.interaction){
-      arma::mat c(fInd->c, ind->n_all_times - ind->ndoses - ind->nevid2, op_focei.neta, false, true);
-      // std::copy(&fInd->c[0], &fInd->c[0]+c.size(), c.begin());
-      for (k = op_focei.neta; k--;){
-        for (l = k+1; l--;){
-          // tmp = fInd->a.col(l) %  fInd->B % fInd->a.col(k);
-          H(k, l) = 0.5*sum(a.col(l) % B % a.col(k) +
-                            c.col(l) % c.col(k)) +
-            op_focei.omegaInv(k, l);
-          if (std::isinf(H(k, l))) return NA_REAL;
-          H(l, k) = H(k, l);
-        }
-      }
-    } else {
-      for (k = op_focei.neta; k--;){
-        for (l = k+1; l--;){
-          // tmp = a.col(l) %  B % a.col(k);
-          H(k, l) = 0.5*sum(a.col(l) % B % a.col(k)) +
-            op_focei.omegaInv(k, l);
-          if (std::isinf(H(k, l))) return NA_REAL;
-          H(l, k) = H(k, l);
-        }
-      }
+    int nobs = ind->n_all_times - ind->ndoses - ind->nevid2;
+    if (op_focei.lowMem) {
+      // Already assembled by likInner0()
+      if (fInd->hessInf) return NA_REAL;
+    } else if (!innerHessian(fInd->H, fInd->a, fInd->B,
+                             op_focei.interaction ? fInd->c : NULL, nobs)) {
+      return NA_REAL;
     }
-    arma::mat H0(fInd->H0, op_focei.neta, op_focei.neta, false, true);
-    k=0;
+    // Factor directly into the subject's H0 buffer
     if (fInd->doChol){
-      arma::mat Hout, Hin = H;
-      bool success = chol(Hout, H);
-      if (!success) {
-        return NA_REAL;
+      if (op_focei.cholFix != NULL) {
+        if (!op_focei.cholFix(fInd->H0, fInd->H, 0.0)) {
+          return NA_REAL;
+        }
+      } else {
+        mat H(fInd->H, op_focei.neta, op_focei.neta, false, true);
+        arma::mat H0(fInd->H0, op_focei.neta, op_focei.neta, false, true);
+        bool success = chol(H0, H);
+        if (!success) {
+          return NA_REAL;
+        }
       }
-      H0 = Hout;
     } else {
-      H0=cholSE__(H, op_focei.cholSEtol);
+      if (!foceiProfInd.empty()) foceiProfInd[id].nCholSE++;
+      if (op_focei.cholSEFix != NULL) {
+        op_focei.cholSEFix(fInd->H0, fInd->H, op_focei.cholSEtol);
+      } else {
+        mat H(fInd->H, op_focei.neta, op_focei.neta, false, true);
+        arma::mat H0(fInd->H0, op_focei.neta, op_focei.neta, false, true);
+        H0=cholSE__(H, op_focei.cholSEtol);
+      }
     }
     // - sum(log(H.diag()));
-    for (unsigned int j = H0.n_rows; j--;){
-      lik -= _safe_log(H0(j,j));
+    for (int j = op_focei.neta; j--;){
+      lik -= _safe_log(fInd->H0[j + j*op_focei.neta]);
     }
   }
   lik += fInd->tbsLik;
@@ -1213,7 +1758,6 @@ extern "C" void innerOptimG(int n, double *x, double *g, void *ex) {
 
 // Scli-lab style cost function for inner
 void innerCost(int *ind, int *n, double *x, double *f, double *g, int *ti, float *tr, double *td, int *id){
-  rx = getRx();
   // if (*id < 0 || *id >= rx->nsub){
   //   // Stops from accessing bad memory, but it doesn't fix any
   //   // problems here.  Rather, this allows the error without a R
@@ -1256,7 +1800,17 @@ static inline int innerEval(int id){
   return 1;
 }
 
-static inline int innerOpt1(int id, int likId) {
+// Running mean/variance of the ETAs used for the eta and theta resets
+static inline void updateEtaStats(double *eta) {
+  mat etaMat(op_focei.neta, 1);
+  std::copy(&eta[0], &eta[0] + op_focei.neta, etaMat.begin());
+  op_focei.n = op_focei.n + 1.0;
+  mat oldM = op_focei.etaM;
+  op_focei.etaM = op_focei.etaM + (etaMat - op_focei.etaM)/op_focei.n;
+  op_focei.etaS = op_focei.etaS + (etaMat - op_focei.etaM) %  (etaMat - oldM);
+}
+
+static inline int innerOpt1_(int id, int likId) {
   focei_ind *fInd = &(inds_focei[id]);
   focei_options *fop = &op_focei;
   if (op_focei.neta == 0) {
@@ -1277,10 +1831,10 @@ static inline int innerOpt1(int id, int likId) {
       if (op_focei.resetHessianAndEta){
         fInd->mode = 1;
         fInd->uzm = 1;
-        if (n1qn1Inner) op_focei.didHessianReset=1;
+        if (n1qn1Inner) fInd->didHessianReset=1;
       }
       std::fill(&fInd->eta[0], &fInd->eta[0] + op_focei.neta, 0.0);
-      op_focei.didEtaReset=1;
+      fInd->didEtaReset=1;
     } else if (R_FINITE(op_focei.resetEtaSize)) {
       std::copy(&fInd->eta[0], &fInd->eta[0] + op_focei.neta, etaMat.begin());
       // Standardized ETAs
@@ -1292,10 +1846,10 @@ static inline int innerOpt1(int id, int likId) {
           if (op_focei.resetHessianAndEta){
             fInd->mode = 1;
             fInd->uzm = 1;
-            if (n1qn1Inner) op_focei.didHessianReset=1;
+            if (n1qn1Inner) fInd->didHessianReset=1;
           }
           std::fill(&fInd->eta[0], &fInd->eta[0] + op_focei.neta, 0.0);
-          op_focei.didEtaReset=1;
+          fInd->didEtaReset=1;
           doBreak=true;
           break;
         }
@@ -1307,10 +1861,10 @@ static inline int innerOpt1(int id, int likId) {
             if (op_focei.resetHessianAndEta){
               fInd->mode = 1;
               fInd->uzm = 1;
-              if (n1qn1Inner) op_focei.didHessianReset=1;
+              if (n1qn1Inner) fInd->didHessianReset=1;
             }
             std::fill(&fInd->eta[0], &fInd->eta[0] + op_focei.neta, 0.0);
-            op_focei.didEtaReset=1;
+            fInd->didEtaReset=1;
             break;
           }
         }
@@ -1348,7 +1902,7 @@ static inline int innerOpt1(int id, int likId) {
     if (fInd->doEtaNudge == 1 && op_focei.etaNudge != 0.0){
       bool tryAgain=false;
       // if (nF <= 3) tryAgain = true;
-      op_focei.didEtaNudge =1;
+      fInd->didEtaNudge=1;
       if (!tryAgain){
         tryAgain = true;
         for (int i = fop->neta; i--;){
@@ -1361,7 +1915,7 @@ static inline int innerOpt1(int id, int likId) {
       if (tryAgain){
         fInd->mode = 1;
         fInd->uzm = 1;
-        op_focei.didHessianReset=1;
+        fInd->didHessianReset=1;
         std::fill_n(fInd->x, fop->neta, op_focei.etaNudge);
         //nF = fInd->nInnerF;
         fInd->badSolve = 0;
@@ -1385,7 +1939,7 @@ static inline int innerOpt1(int id, int likId) {
         if (tryAgain) {
           fInd->mode = 1;
           fInd->uzm = 1;
-          op_focei.didHessianReset=1;
+          fInd->didHessianReset=1;
           std::fill_n(fInd->x, fop->neta, -op_focei.etaNudge);
           nF = fInd->nInnerF;
           fInd->badSolve = 0;
@@ -1408,7 +1962,7 @@ static inline int innerOpt1(int id, int likId) {
           if (tryAgain){
             fInd->mode = 1;
             fInd->uzm = 1;
-            op_focei.didHessianReset=1;
+            fInd->didHessianReset=1;
             std::fill_n(fInd->x, fop->neta, -op_focei.etaNudge2);
             nF = fInd->nInnerF;
             fInd->badSolve = 0;
@@ -1431,7 +1985,7 @@ static inline int innerOpt1(int id, int likId) {
             if (tryAgain) {
               fInd->mode = 1;
               fInd->uzm = 1;
-              op_focei.didHessianReset=1;
+              fInd->didHessianReset=1;
               std::fill_n(fInd->x, fop->neta, +op_focei.etaNudge2);
               nF = fInd->nInnerF;
               fInd->badSolve = 0;
@@ -1524,12 +2078,9 @@ static inline int innerOpt1(int id, int likId) {
   fInd->doEtaNudge=0;
 
   std::copy(&fInd->x[0],&fInd->x[0]+fop->neta,&fInd->eta[0]);
-  // Update variances
-  std::copy(&fInd->eta[0], &fInd->eta[0] + op_focei.neta, etaMat.begin());
-  op_focei.n = op_focei.n + 1.0;
-  mat oldM = op_focei.etaM;
-  op_focei.etaM = op_focei.etaM + (etaMat - op_focei.etaM)/op_focei.n;
-  op_focei.etaS = op_focei.etaS + (etaMat - op_focei.etaM) %  (etaMat - oldM);
+  // Update variances; the threaded inner problem updates these in
+  // subject order after the parallel region
+  if (!op_focei.innerPar) updateEtaStats(fInd->eta);
   fInd->llik = f;
   // Use saved Hessian on next opimization.
   fInd->mode=2;
@@ -1538,6 +2089,38 @@ static inline int innerOpt1(int id, int likId) {
   return 1;
 }
 
+// Merge the resets of a subject into the flags of the fit
+static inline void innerResetFlags(focei_ind *fInd) {
+  if (fInd->didEtaReset) op_focei.didEtaReset = 1;
+  if (fInd->didHessianReset) op_focei.didHessianReset = 1;
+  if (fInd->didEtaNudge) op_focei.didEtaNudge = 1;
+  fInd->didEtaReset = 0;
+  fInd->didHessianReset = 0;
+  fInd->didEtaNudge = 0;
+}
+
+static inline void innerResetFlagsAll() {
+  for (int id = 0; id < rx->nsub; id++) {
+    innerResetFlags(&(inds_focei[id]));
+  }
+}
+
+static inline int innerOpt1(int id, int likId) {
+  double t0 = profNow();
+  int ret = innerOpt1_(id, likId);
+  // The threaded callers merge the flags after the parallel region
+  if (!op_focei.innerPar) innerResetFlags(&(inds_focei[id]));
+  if (!foceiSchedTime.empty()) foceiSchedTime[id] = profNow() - t0;
+  if (!foceiProfInd.empty()) {
+    focei_ind *fInd = &(inds_focei[id]);
+    foceiProfInd_t *p = &(foceiProfInd[id]);
+    profAdd(&(p->inner), t0);
+    p->nInnerF += fInd->nInnerF;
+    p->nInnerG += fInd->nInnerG;
+  }
+  return ret;
+}
+
 void parHistData(Environment e, bool focei);
 
 static inline void thetaReset00(NumericVector &thetaIni, NumericVector &omegaTheta, arma::mat &etaMat) {
@@ -1797,59 +2380,163 @@ static inline void resetToZeroWithoutOpt(focei_ind *indF, int& id) {
   }
 }
 
+static inline void innerOptIdReset(focei_ind *indF, int id) {
+  if (!foceiProfInd.empty()) foceiProfInd[id].nReset++;
+  // First try resetting ETA
+  if (didInnerResetFail(indF, id)) {
+    if(!op_focei.noabort){
+      stop("Could not find the best eta even hessian reset and eta reset for ID %d.", id+1);
+    } else if (indF->doChol == 1){
+      indF->doChol = 0; // Use generalized cholesky decomposition
+      if (didInnerResetFail(indF, id)) {
+        resetToZeroWithoutOpt(indF, id);
+      }
+      indF->doChol = 1; // Use cholesky again.
+    } else {
+      resetToZeroWithoutOpt(indF, id);
+    }
+  }
+}
+
 static inline void innerOptId(int id) {
   focei_ind *indF = &(inds_focei[id]);
   if (!innerOpt1(id, 0)) {
-    // First try resetting ETA
-    if (didInnerResetFail(indF, id)) {
-      if(!op_focei.noabort){
-        stop("Could not find the best eta even hessian reset and eta reset for ID %d.", id+1);
-      } else if (indF->doChol == 1){
-        indF->doChol = 0; // Use generalized cholesky decomposition
-        if (didInnerResetFail(indF, id)) {
-          resetToZeroWithoutOpt(indF, id);
-        }
-        indF->doChol = 1; // Use cholesky again.
+    innerOptIdReset(indF, id);
+  }
+}
+
+// Number of threads that can be used for the inner problem.  Only
+// liblsoda is thread safe; finite difference ETA derivatives and FO
+// swap the shared solving system (op->neq) so they are solved serially.
+static inline int getInnerCores() {
+  if (op_focei.cores <= 1 || op_focei.fo == 1 ||
+      rx->op->stiff != 2) return 1;
+  for (int i = op_focei.neta; i--;) {
+    if (op_focei.etaFD[i] == 1) return 1;
+  }
+  return min2(op_focei.cores, rx->nsub);
+}
+
+static inline void innerParSetup(int nsub) {
+  innerParEta.resize(nsub*op_focei.neta);
+  innerParZm.resize(nsub*op_focei.nzm);
+  innerParInd.resize(nsub*4);
+}
+
+static inline void innerParSave(int id) {
+  focei_ind *fInd = &(inds_focei[id]);
+  int neta = op_focei.neta, nzm = op_focei.nzm;
+  std::copy(&fInd->eta[0], &fInd->eta[0] + neta, &innerParEta[id*neta]);
+  std::copy(&fInd->zm[0], &fInd->zm[0] + nzm, &innerParZm[id*nzm]);
+  innerParInd[id*4]     = fInd->mode;
+  innerParInd[id*4 + 1] = fInd->uzm;
+  innerParInd[id*4 + 2] = fInd->doEtaNudge;
+  innerParInd[id*4 + 3] = fInd->doChol;
+}
+
+// Back to the saved state, dropping the resets of the failed attempt
+static inline void innerParRestore(int id) {
+  focei_ind *fInd = &(inds_focei[id]);
+  int neta = op_focei.neta, nzm = op_focei.nzm;
+  std::copy(&innerParEta[id*neta], &innerParEta[id*neta] + neta, &fInd->eta[0]);
+  std::copy(&innerParZm[id*nzm], &innerParZm[id*nzm] + nzm, &fInd->zm[0]);
+  fInd->mode        = innerParInd[id*4];
+  fInd->uzm         = innerParInd[id*4 + 1];
+  fInd->doEtaNudge  = innerParInd[id*4 + 2];
+  fInd->doChol      = innerParInd[id*4 + 3];
+  std::fill_n(&fInd->oldEta[0], neta, -42.0);
+  fInd->didEtaReset = 0;
+  fInd->didHessianReset = 0;
+  fInd->didEtaNudge = 0;
+}
+
+// Threaded inner problem.  Each subject uses its own solving and
+// focei_ind memory; anything that touches R (warnings, errors, eta
+// resets and atol/rtol changes) is deferred to a serial pass in subject
+// order after the parallel region.
+static inline void innerOptPar(int cores) {
+  std::vector<int> innerFail(rx->nsub, 0);
+  foceiSchedUpdate();
+  const int *order = &foceiSchedOrder[0];
+  op_focei.innerPar = true;
+  if (op_focei.maxInnerIterations <= 0) {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cores) schedule(dynamic)
+#endif
+    for (int k = 0; k < rx->nsub; k++){
+      int id = order[k];
+      focei_ind *indF = &(inds_focei[id]);
+      indF->doChol = 1;
+      double t0 = profNow();
+      if (!innerEval(id)) innerFail[id] = 1;
+      foceiSchedTime[id] = profNow() - t0;
+    }
+    op_focei.innerPar = false;
+    for (int id = 0; id < rx->nsub; id++){
+      if (innerFail[id] == 0) continue;
+      focei_ind *indF = &(inds_focei[id]);
+      indF->doChol = 0; // Use generalized cholesky decomposition
+      innerEval(id);
+      warning(_("non-positive definite individual Hessian at solution(ID=%d); FOCEi objective functions may not be comparable"),id);
+      indF->doChol = 1; // Cholesky again.
+    }
+  } else {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cores) schedule(dynamic)
+#endif
+    for (int k = 0; k < rx->nsub; k++){
+      int id = order[k];
+      if (op_focei.neta > 0) innerParSave(id);
+      if (!innerOpt1(id, 0)) innerFail[id] = 1;
+    }
+    op_focei.innerPar = false;
+    // In subject order, as the serial loop: the ETA statistics of the
+    // threaded solves, and the failed subjects solved again serially
+    // (with the ODE tolerance retries before any reset)
+    for (int id = 0; id < rx->nsub; id++){
+      if (innerFail[id] == 0) {
+        innerResetFlags(&(inds_focei[id]));
+        if (op_focei.neta > 0) updateEtaStats(inds_focei[id].eta);
       } else {
-        resetToZeroWithoutOpt(indF, id);
+        if (op_focei.neta > 0) innerParRestore(id);
+        innerOptId(id);
       }
     }
   }
 }
 
-
-
 void innerOpt(){
-  // #ifdef _OPENMP
-  //   int cores = rx->op->cores;
-  // #endif
+  double t0 = profNow();
   rx = getRx();
   if (op_focei.neta > 0) {
     op_focei.omegaInv=getOmegaInv();
     op_focei.logDetOmegaInv5 = getOmegaDet();
   }
+  int cores = getInnerCores();
   if (op_focei.maxInnerIterations <= 0){
     std::fill_n(&op_focei.goldEta[0], op_focei.gEtaGTransN, -42.0); // All etas = -42;  Unlikely if normal
-    // #ifdef _OPENMP
-    // #pragma omp parallel for num_threads(cores)
-    // #endif
-    for (int id = 0; id < rx->nsub; id++){
-      focei_ind *indF = &(inds_focei[id]);
-      indF->doChol = 1;
-      if (!innerEval(id)) {
-        indF->doChol = 0; // Use generalized cholesky decomposition
-        innerEval(id);
-        // Not thread safe
-        warning(_("non-positive definite individual Hessian at solution(ID=%d); FOCEi objective functions may not be comparable"),id);
-        indF->doChol = 1; // Cholesky again.
+    if (cores > 1) {
+      innerOptPar(cores);
+    } else {
+      for (int id = 0; id < rx->nsub; id++){
+        focei_ind *indF = &(inds_focei[id]);
+        indF->doChol = 1;
+        if (!innerEval(id)) {
+          indF->doChol = 0; // Use generalized cholesky decomposition
+          innerEval(id);
+          warning(_("non-positive definite individual Hessian at solution(ID=%d); FOCEi objective functions may not be comparable"),id);
+          indF->doChol = 1; // Cholesky again.
+        }
       }
     }
   } else {
-    // #ifdef _OPENMP
-    // #pragma omp parallel for num_threads(cores)
-    // #endif
-    for (int id = 0; id < rx->nsub; id++){
-      innerOptId(id);
+    if (cores > 1) {
+      if (op_focei.neta > 0) innerParSetup(rx->nsub);
+      innerOptPar(cores);
+    } else {
+      for (int id = 0; id < rx->nsub; id++){
+        innerOptId(id);
+      }
     }
     // Reset ETA variances for next step
     if (op_focei.neta > 0){
@@ -1868,12 +2555,21 @@ void innerOpt(){
       op_focei.n = 0.0;
     }
   }
+  profAdd(&(foceiProf.inner), t0);
   Rcpp::checkUserInterrupt();
 }
 
+static inline void gradPreRewind();
+
 static inline double foceiLik0(double *theta){
+  // Anything solved while threaded perturbations are queued
+  gradPreRewind();
   updateTheta(theta);
   innerOpt();
+  if (foceiMuRefTol > 0) {
+    foceiMuRefTheta.assign(theta, theta + op_focei.npars);
+    foceiMuRefOmegaInv = op_focei.omegaInv;
+  }
   double lik = 0.0;
   double cur;
 
@@ -1896,11 +2592,12 @@ static inline double foceiLik0(double *theta){
 }
 
 
-static inline double foceiOfv0(double *theta){
+static inline double foceiOfv0_(double *theta){
   if (op_focei.objfRecalN != 0 && !op_focei.calcGrad) {
     op_focei.stickyRecalcN1++;
     if (op_focei.stickyRecalcN1 <= op_focei.stickyRecalcN){
       rxode2::atolRtolFactor_(pow(op_focei.odeRecalcFactor, -op_focei.objfRecalN));
+      etaCacheReset();
     } else {
       op_focei.stickyTol=1;
     }
@@ -1911,6 +2608,7 @@ static inline double foceiOfv0(double *theta){
          op_focei.objfRecalN < op_focei.maxOdeRecalc){
     op_focei.reducedTol=1;
     rxode2::atolRtolFactor_(op_focei.odeRecalcFactor);
+    etaCacheReset();
     ret = -2*foceiLik0(theta);
     op_focei.objfRecalN++;
   }
@@ -1950,6 +2648,62 @@ static inline double foceiOfv0(double *theta){
   return ret;
 }
 
+// The state of the outer problem at the current thetas; resumed with
+// the same fields as a theta reset (see .foceiRestartState())
+static inline void foceiCheckpoint(double ofv) {
+  ckpt_t ck;
+  ckptAdd(ck, "type", 1.0);
+  ckptAdd(ck, "objf", ofv);
+  ckptAdd(ck, "nF", (double)(op_focei.nF+op_focei.nF2));
+  ckptAdd(ck, "maxInnerIterations", (double)(op_focei.maxInnerIterations));
+  std::vector<double> thetaIni(op_focei.ntheta);
+  for (int i = op_focei.ntheta; i--;) thetaIni[i] = unscalePar(op_focei.fullTheta, i);
+  ckptAdd(ck, "thetaIni", thetaIni.data(), op_focei.ntheta, 1);
+  ckptAdd(ck, "omegaTheta", op_focei.fullTheta + op_focei.ntheta, op_focei.omegan, 1);
+  int nfull = op_focei.ntheta+op_focei.omegan;
+  std::vector<double> scaleC(nfull);
+  for (int i = nfull; i--;) scaleC[i] = getScaleC(i);
+  ckptAdd(ck, "scaleC", scaleC.data(), nfull, 1);
+  ckptAdd(ck, "initObjective", op_focei.initObjective);
+  if (op_focei.neta > 0) {
+    arma::mat etaMat(rx->nsub, op_focei.neta);
+    for (int i = rx->nsub; i--;) {
+      for (int j = op_focei.neta; j--;) etaMat(i, j) = inds_focei[i].eta[j];
+    }
+    ckptAdd(ck, "etaMat", etaMat);
+    NumericMatrix etaHess = foceiEtaHess();
+    ckptAdd(ck, "etaHess", &etaHess[0], etaHess.nrow(), etaHess.ncol());
+  }
+  ckptAdd(ck, "gillRetC", op_focei.gillRetC, op_focei.npars);
+  ckptAdd(ck, "gillRet", op_focei.gillRet, op_focei.npars);
+  ckptAdd(ck, "gillDf", op_focei.gillDf, op_focei.npars, 1);
+  ckptAdd(ck, "gillDf2", op_focei.gillDf2, op_focei.npars, 1);
+  ckptAdd(ck, "gillErr", op_focei.gillErr, op_focei.npars, 1);
+  ckptAdd(ck, "rEps", op_focei.rEps, op_focei.npars, 1);
+  ckptAdd(ck, "aEps", op_focei.aEps, op_focei.npars, 1);
+  ckptAdd(ck, "rEpsC", op_focei.rEpsC, op_focei.npars, 1);
+  ckptAdd(ck, "aEpsC", op_focei.aEpsC, op_focei.npars, 1);
+  ckptAdd(ck, "c1", op_focei.c1);
+  ckptAdd(ck, "c2", op_focei.c2);
+  if (!ckptWrite(ck, foceiCkptFile)) {
+    warning(_("could not write the checkpoint '%s'"), foceiCkptFile.c_str());
+    foceiCkptOn = false;
+  }
+}
+
+static inline double foceiOfv0(double *theta){
+  double t0 = profNow();
+  double ret = foceiOfv0_(theta);
+  profAdd(&(foceiProf.ofv), t0);
+  if (foceiCkptOn && !op_focei.calcGrad && R_FINITE(ret) && ret < foceiCkptBest &&
+      t0 - foceiCkptLast >= foceiCkptInterval) {
+    foceiCkptBest = ret;
+    foceiCkptLast = t0;
+    foceiCheckpoint(ret);
+  }
+  return ret;
+}
+
 //[[Rcpp::export]]
 double foceiLik(NumericVector theta){
   return foceiLik0(&theta[0]);
@@ -1960,6 +2714,13 @@ double foceiOfv(NumericVector theta){
   return foceiOfv0(&theta[0]);
 }
 
+//[[Rcpp::export]]
+List checkpointRead(std::string file) {
+  ckpt_t ck;
+  ckptRead(ck, file);
+  return ckptList(ck);
+}
+
 SEXP foceiEtas(Environment e) {
   if (op_focei.neta==0) return R_NilValue;
   List ret(op_focei.neta+2);
@@ -2040,7 +2801,10 @@ Function doCall = baseEnv["do.call"];
 Function gillRfn_ = baseEnv["invisible"];
 int gillPar = 0;
 double gillLong = false;
+nlmixr2GradObj_t gillNativeFn = NULL;
+void *gillNativeEx = NULL;
 double gillRfn(double *theta){
+  if (gillNativeFn != NULL) return gillNativeFn(gillThetaN, theta, gillNativeEx);
   List par(1);
   NumericVector par0(gillThetaN);
   std::copy(&theta[0], &theta[0]+gillThetaN,par0.begin());
@@ -2062,8 +2826,338 @@ static inline void gill83tickStep(int &k, int &K) {
   }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Parallel theta perturbations for the outer gradient and covariance.
+//
+// Each perturbation is a full population inner problem, but the
+// subject solving memory is shared between perturbations.  Instead of
+// running perturbations side by side, the perturbations the serial
+// code will use one after the other are queued (gradPreStart() and
+// gradPreAdd()) and, when the serial code needs the first of them,
+// the subjects are split between threads and each subject runs every
+// perturbation.  As in the serial code, each perturbation starts from
+// the ETAs and Hessian the one before left, so the objective functions
+// (and individual likelihoods) picked up by the serial gradient/Hessian
+// code are the ones it would calculate.  When the serial code solves
+// anything else before it has used every queued perturbation (omega
+// parameters, step refinements), the subjects go back to the state
+// after the perturbations it used and the rest are solved serially.
+// With one core nothing is queued, so the serial path is unchanged.
+static inline void gradPreClear() {
+  gradPre.clear();
+  gradPreTheta.clear();
+  gradPreLik.clear();
+  gradPreNext = 0;
+}
+
+// Start a queue of perturbations around theta; returns false (and
+// queues nothing) when the inner problem cannot be threaded.  keepLik0
+// is true when the serial code solves the perturbations without
+// changing lik[0] (foceiS())
+static inline bool gradPreStart(double *theta, bool keepLik0) {
+  gradPreClear();
+  rx = getRx();
+  if (op_focei.cores <= 1 || getInnerCores() <= 1 || op_focei.neta == 0 ||
+      !op_focei.initObj) return false;
+  gradPreTheta.assign(&theta[0], &theta[0] + op_focei.npars);
+  gradPreKeepLik0 = keepLik0;
+  return true;
+}
+
+// Add a perturbation; they are added in the order the serial code uses
+// them
+static inline void gradPreAdd2(int cpar, double x, int cpar2, double x2) {
+  if (gradPreTheta.empty()) return;
+  // Omega parameters change the omega matrices shared by all subjects
+  if (op_focei.fixedTrans[cpar] >= (int)op_focei.ntheta) return;
+  if (cpar2 >= 0 && op_focei.fixedTrans[cpar2] >= (int)op_focei.ntheta) return;
+  gradPre_t cur;
+  cur.cpar = cpar;
+  cur.x = x;
+  cur.cpar2 = cpar2;
+  cur.x2 = x2;
+  cur.scaleC = op_focei.scaleC[cpar];
+  cur.scaleC2 = cpar2 >= 0 ? op_focei.scaleC[cpar2] : NA_REAL;
+  cur.f = NA_REAL;
+  cur.lik = -1;
+  gradPre.push_back(cur);
+}
+
+static inline void gradPreAdd(int cpar, double x) {
+  gradPreAdd2(cpar, x, -1, 0.0);
+}
+
+// Is theta the perturbation p
+static inline bool gradPreIs(int p, double *theta) {
+  gradPre_t *cur = &(gradPre[p]);
+  if (theta[cur->cpar] != cur->x ||
+      op_focei.scaleC[cur->cpar] != cur->scaleC) return false;
+  if (cur->cpar2 >= 0 && (theta[cur->cpar2] != cur->x2 ||
+                          op_focei.scaleC[cur->cpar2] != cur->scaleC2)) return false;
+  for (int k = gradPreTheta.size(); k--;) {
+    if (k != cur->cpar && k != cur->cpar2 && theta[k] != gradPreTheta[k]) return false;
+  }
+  return true;
+}
+
+// Solves the first npt perturbations for every subject from the saved
+// subject state; each subject solves them in order from the ETAs and
+// Hessian of the one before.  Subjects that fail are reset (and the
+// rest of their perturbations solved) serially after the parallel
+// region.  The subjects are left as the serial code would leave them
+// after the npt-th perturbation.
+static inline void gradPreChain(int npt) {
+  int nsub = rx->nsub, ntheta = op_focei.ntheta, neta = op_focei.neta,
+    nzm = op_focei.nzm, npars = op_focei.npars;
+  // Unscaled thetas for every perturbation
+  std::vector<double> thetaP(npt*ntheta);
+  std::vector<double> cur(npars);
+  // Omega matrices and fixed thetas at the unperturbed theta
+  updateTheta(&gradPreTheta[0]);
+  for (int p = 0; p < npt; ++p) {
+    gradPre_t *pre = &(gradPre[p]);
+    std::copy(gradPreTheta.begin(), gradPreTheta.end(), cur.begin());
+    cur[pre->cpar] = pre->x;
+    if (pre->cpar2 >= 0) cur[pre->cpar2] = pre->x2;
+    std::copy(&op_focei.fullTheta[0], &op_focei.fullTheta[0] + ntheta, &thetaP[p*ntheta]);
+    // Scaled with the scaling when it was queued
+    double sc = op_focei.scaleC[pre->cpar], sc2 = NA_REAL;
+    op_focei.scaleC[pre->cpar] = pre->scaleC;
+    if (pre->cpar2 >= 0) {
+      sc2 = op_focei.scaleC[pre->cpar2];
+      op_focei.scaleC[pre->cpar2] = pre->scaleC2;
+    }
+    for (int k = npars; k--;) {
+      int j = op_focei.fixedTrans[k];
+      if (j < ntheta) thetaP[p*ntheta + j] = unscalePar(&cur[0], k);
+    }
+    if (pre->cpar2 >= 0) op_focei.scaleC[pre->cpar2] = sc2;
+    op_focei.scaleC[pre->cpar] = sc;
+  }
+  for (int id = nsub; id--;) {
+    focei_ind *fInd = &(inds_focei[id]);
+    std::copy(&gradPreEta[id*neta], &gradPreEta[id*neta] + neta, &fInd->eta[0]);
+    std::copy(&gradPreSaveEta[id*neta], &gradPreSaveEta[id*neta] + neta, &fInd->saveEta[0]);
+    fInd->lik[0] = gradPreLik0[id];
+    std::copy(&gradPreZm[id*nzm], &gradPreZm[id*nzm] + nzm, &fInd->zm[0]);
+    fInd->mode        = gradPreInd[id*4];
+    fInd->uzm         = gradPreInd[id*4 + 1];
+    fInd->doEtaNudge  = gradPreInd[id*4 + 2];
+    fInd->doChol      = gradPreInd[id*4 + 3];
+  }
+  gradPreLik.assign(npt*nsub, NA_REAL);
+  innerParSetup(nsub);
+  foceiBufferPeak();
+  double *likP = &gradPreLik[0];
+  std::vector<int> failAt(nsub, -1);
+  // The perturbed thetas are only set in par_ptr, so the cached inner
+  // solutions do not apply
+  op_focei.etaCacheOff = true;
+  foceiSchedUpdate();
+  const int *order = &foceiSchedOrder[0];
+  int cores = getInnerCores();
+  op_focei.innerPar = true;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cores) schedule(dynamic)
+#endif
+  for (int k = 0; k < nsub; k++) {
+    int id = order[k];
+    rx_solving_options_ind *ind = &(rx->subjects[id]);
+    focei_ind *fInd = &(inds_focei[id]);
+    for (int p = 0; p < npt; ++p) {
+      for (int j = ntheta; j--;) {
+        ind->par_ptr[op_focei.thetaTrans[j]] = thetaP[p*ntheta + j];
+      }
+      std::fill_n(&fInd->oldEta[0], neta, -42.0);
+      int success;
+      if (op_focei.maxInnerIterations <= 0) {
+        fInd->doChol = 1;
+        success = innerEval(id);
+      } else {
+        innerParSave(id);
+        success = innerOpt1(id, 0);
+      }
+      if (!success) {
+        failAt[id] = p;
+        break;
+      }
+      likP[p*nsub + id] = fInd->lik[0];
+    }
+  }
+  op_focei.innerPar = false;
+  // The failed subjects go back to their state before the failed
+  // perturbation; the resets of the failed attempt are dropped
+  for (int id = 0; id < nsub; id++) {
+    if (failAt[id] >= 0 && op_focei.maxInnerIterations > 0) innerParRestore(id);
+  }
+  innerResetFlagsAll();
+  // The perturbations of the failed subjects from the one that failed
+  // are solved serially, as the serial code would (ODE tolerance
+  // retries, then resets/warnings); the running ETA statistics are set
+  // below
+  arma::mat etaM = op_focei.etaM, etaS = op_focei.etaS;
+  double etaN = op_focei.n;
+  for (int id = 0; id < nsub; id++) {
+    int p0 = failAt[id];
+    if (p0 < 0) continue;
+    rx_solving_options_ind *ind = &(rx->subjects[id]);
+    focei_ind *fInd = &(inds_focei[id]);
+    for (int p = p0; p < npt; ++p) {
+      for (int j = ntheta; j--;) {
+        ind->par_ptr[op_focei.thetaTrans[j]] = thetaP[p*ntheta + j];
+      }
+      std::fill_n(&fInd->oldEta[0], neta, -42.0);
+      if (op_focei.maxInnerIterations <= 0) {
+        fInd->doChol = 1;
+        if (!innerEval(id)) {
+          fInd->doChol = 0; // Use generalized cholesky decomposition
+          innerEval(id);
+          warning(_("non-positive definite individual Hessian at solution(ID=%d); FOCEi objective functions may not be comparable"),id);
+          fInd->doChol = 1; // Cholesky again.
+        }
+      } else if (!innerOpt1(id, 0)) {
+        innerOptIdReset(fInd, id);
+      }
+      likP[p*nsub + id] = fInd->lik[0];
+    }
+  }
+  op_focei.etaM = etaM;
+  op_focei.etaS = etaS;
+  op_focei.n = etaN;
+  op_focei.etaCacheOff = false;
+  if (npt > 0 && gradPreKeepLik0) {
+    // foceiS() solves with separate likelihoods; the running ETA
+    // statistics are not updated, which only changes the ETA reset
+    // checks of a later inner problem
+    for (int id = nsub; id--;) {
+      focei_ind *fInd = &(inds_focei[id]);
+      std::copy(&gradPreSaveEta[id*neta], &gradPreSaveEta[id*neta] + neta, &fInd->saveEta[0]);
+      fInd->lik[0] = gradPreLik0[id];
+    }
+  } else if (npt > 0) {
+    // innerOpt() of the last perturbation: ETA statistics and the
+    // thetas of the saved ETAs
+    if (op_focei.maxInnerIterations > 0) {
+      for (int id = 0; id < nsub; id++) {
+        if (!ISNA(likP[(npt-1)*nsub + id])) updateEtaStats(inds_focei[id].eta);
+      }
+      op_focei.eta1SD = 1/sqrt(op_focei.etaS);
+      std::fill(op_focei.etaM.begin(),op_focei.etaM.end(), 0.0);
+      std::fill(op_focei.etaS.begin(),op_focei.etaS.end(), 0.0);
+      op_focei.n = 0.0;
+    }
+    if (foceiMuRefTol > 0) {
+      foceiMuRefTheta.assign(cur.begin(), cur.end());
+      foceiMuRefOmegaInv = op_focei.omegaInv;
+    }
+  }
+  std::fill_n(&op_focei.goldEta[0], op_focei.gEtaGTransN, -42.0);
+  updateTheta(&gradPreTheta[0]);
+}
+
+// Solves the queued perturbations from the current subject state;
+// returns false (and drops the queue) when the inner problem cannot be
+// threaded.
+static inline bool gradPreCalc() {
+  rx = getRx();
+  if (getInnerCores() <= 1 || !op_focei.calcGrad || op_focei.zeroGrad) {
+    gradPreClear();
+    return false;
+  }
+  int nsub = rx->nsub, neta = op_focei.neta, nzm = op_focei.nzm,
+    nPre = gradPre.size();
+  gradPreEta.resize(nsub*neta);
+  gradPreSaveEta.resize(nsub*neta);
+  gradPreZm.resize(nsub*nzm);
+  gradPreLik0.resize(nsub);
+  gradPreInd.resize(nsub*4);
+  for (int id = nsub; id--;) {
+    focei_ind *fInd = &(inds_focei[id]);
+    std::copy(&fInd->eta[0], &fInd->eta[0] + neta, &gradPreEta[id*neta]);
+    std::copy(&fInd->saveEta[0], &fInd->saveEta[0] + neta, &gradPreSaveEta[id*neta]);
+    gradPreLik0[id] = fInd->lik[0];
+    std::copy(&fInd->zm[0], &fInd->zm[0] + nzm, &gradPreZm[id*nzm]);
+    gradPreInd[id*4]     = fInd->mode;
+    gradPreInd[id*4 + 1] = fInd->uzm;
+    gradPreInd[id*4 + 2] = fInd->doEtaNudge;
+    gradPreInd[id*4 + 3] = fInd->doChol;
+  }
+  gradPreChain(nPre);
+  // Same summation and scaling as foceiLik0()/foceiOfv0()
+  for (int p = 0; p < nPre; ++p) {
+    double lik = 0.0;
+    for (int id = nsub; id--;) {
+      double curLik = gradPreLik[p*nsub + id];
+      if (ISNA(curLik) || std::isinf(curLik) || std::isnan(curLik)) {
+        curLik = -op_focei.badSolveObjfAdj;
+      }
+      lik += curLik;
+    }
+    double ret = -2*lik;
+    if (std::isnan(ret) || std::isinf(ret)){
+      ret=5e100;
+    }
+    if (op_focei.scaleObjective == 2){
+      ret = ret / op_focei.initObjective * op_focei.scaleObjectiveTo;
+    }
+    gradPre[p].f = ret;
+    gradPre[p].lik = p*nsub;
+  }
+  return true;
+}
+
+// The serial code solves something else before using every solved
+// perturbation: go back to the state after the ones it used and drop
+// the queue, so the rest are solved serially
+static inline void gradPreRewind() {
+  if (gradPre.empty() || gradPre[0].lik < 0 ||
+      gradPreNext >= (int)gradPre.size()) return;
+  gradPreChain(gradPreNext);
+  gradPreClear();
+}
+
+// Index of the perturbation theta when it is the next queued
+// perturbation (solving the queue the first time), or -1 when the
+// serial code solves theta
+static inline int gradPreTake(double *theta) {
+  if (gradPreTheta.empty() || foceiGill != 1 ||
+      gradPreNext >= (int)gradPre.size()) return -1;
+  bool solved = gradPre[0].lik >= 0;
+  if (!gradPreIs(gradPreNext, theta)) {
+    // Before the queue is solved the serial code can solve other
+    // points (like the omega parameters) without changing it
+    if (solved) gradPreRewind();
+    return -1;
+  }
+  if (!solved && !gradPreCalc()) return -1;
+  return gradPreNext++;
+}
+
+static inline bool gradPreGet(double *theta, double *f) {
+  int p = gradPreTake(theta);
+  if (p < 0) return false;
+  *f = gradPre[p].f;
+  return true;
+}
+
+static inline double foceiOfvGrad(double *theta) {
+  double f;
+  if (gradPreGet(theta, &f)) return f;
+  return foceiOfv0(theta);
+}
+
+// Gill 1983 initial interval (hbar)
+static inline double gill83hbar(double f, double x, double epsR) {
+  double epsA=std::fabs(f)*epsR;
+  return 2*(1+std::fabs(x))*_safe_sqrt(epsA/(1+std::fabs(f)));
+}
+
 void gill83fnF(double *fp, double *theta, int) {
   if (foceiGill == 1) {
+    if (gradPreGet(theta, fp)) {
+      if (op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
+      return;
+    }
     updateTheta(theta);
     *fp = foceiOfv0(theta);
     if (op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
@@ -2108,7 +3202,7 @@ int gill83(double *hf, double *hphif, double *df, double *df2, double *ef,
   double epsA=std::fabs(f)*epsR;
   x = theta[cpar];
   // FD1: // Initialization
-  hbar = 2*(1+std::fabs(x))*_safe_sqrt(epsA/(1+std::fabs(f)));
+  hbar = gill83hbar(f, x, epsR);
   h0 = gillStep*hbar;
   lasth=h0;
   theta[cpar] = x + h0;
@@ -2308,7 +3402,132 @@ int gill83(double *hf, double *hphif, double *df, double *df2, double *ef,
 }
 
 
-void numericGrad(double *theta, double *g){
+// Forward step seeded for cpar (NA when there is none)
+static inline double gillSeedStep(double *theta, int cpar) {
+  if (gillSeed.empty()) return NA_REAL;
+  double *s = &gillSeed[4*cpar];
+  if (ISNA(s[0]) || ISNA(s[1]) || ISNA(s[2]) || ISNA(s[3])) return NA_REAL;
+  double h = std::fabs(theta[cpar])*s[1] + s[0];
+  if (!(h > 0)) return NA_REAL;
+  return h;
+}
+
+// Use the seeded step sizes of cpar when the forward and backward
+// differences at the seeded step still have acceptable cancellation
+// errors (Gill 1983 FD2); otherwise the interval is searched again
+static inline bool gillSeedUse(double *theta, int cpar, double *g) {
+  double h = gillSeedStep(theta, cpar);
+  if (ISNA(h)) return false;
+  double f = op_focei.lastOfv, x = theta[cpar], fp, fn;
+  theta[cpar] = x + h;
+  gill83fnG(&fp, theta, -1);
+  theta[cpar] = x - h;
+  gill83fnG(&fn, theta, -1);
+  theta[cpar] = x;
+  double epsA = std::fabs(f)*op_focei.gillRtol;
+  double phif = phiF(f, fp, h), phib = phiB(f, fn, h);
+  if (!R_FINITE(fp) || !R_FINITE(fn) ||
+      max2(Chat(phif, h, epsA), Chat(phib, h, epsA)) > 0.1) {
+    gillSeedN[1]++;
+    return false;
+  }
+  double *s = &gillSeed[4*cpar];
+  op_focei.aEps[cpar]  = s[0];
+  op_focei.rEps[cpar]  = s[1];
+  op_focei.aEpsC[cpar] = s[2];
+  op_focei.rEpsC[cpar] = s[3];
+  op_focei.gillRet[cpar] = 1;
+  op_focei.gillDf[cpar] = phiC(fp, fn, h);
+  op_focei.gillDf2[cpar] = Phi(fp, f, fn, h);
+  op_focei.gillErr[cpar] = h*std::fabs(op_focei.gillDf2[cpar])/2 + 2*epsA/h;
+  g[cpar] = op_focei.gillDf[cpar];
+  gillSeedN[0]++;
+  return true;
+}
+
+// Change of the unscaled parameter for a unit change of x[i] (the
+// scaling is linear)
+static inline double unscaleParD(double *x, int i) {
+  double cur = x[i];
+  double u0 = unscalePar(x, i);
+  x[i] = cur + 1.0;
+  double u1 = unscalePar(x, i);
+  x[i] = cur;
+  return u1 - u0;
+}
+
+// Gradient of the mu-referenced thetas from the inner problem.  When
+// theta_k only enters the model as theta_k + eta_k, the data part of
+// each subject's objective changes with theta_k as it does with
+// eta_k, which at the inner mode is balanced by the prior:
+//
+//   d(-2LL)/d theta_k ~ -2 * sum_i (omegaInv %*% eta_i)_k
+//
+// (the ETAs move with theta, but the inner objective is at its
+// minimum).  The change of the individual Hessians is ignored, so the
+// shortcut is compared with the Gill differences and only used for
+// the parameters where it agrees to foceiMuRefTol.  Returns false
+// when the last inner problem was not solved at theta.
+static inline bool foceiMuRefGradCalc(double *theta) {
+  int npars = op_focei.npars, neta = op_focei.neta;
+  if (foceiMuRefTol <= 0 || neta == 0 || op_focei.fo == 1 ||
+      (int)foceiMuRefTheta.size() != npars) return false;
+  for (int cpar = npars; cpar--;) {
+    if (theta[cpar] != foceiMuRefTheta[cpar]) return false;
+  }
+  rx = getRx();
+  // omegaInv is the same for every subject, so sum the ETAs first
+  arma::vec s(neta, fill::zeros);
+  for (int id = rx->nsub; id--;) {
+    focei_ind *fInd = &(inds_focei[id]);
+    for (int k = neta; k--;) s[k] += fInd->saveEta[k];
+  }
+  s = foceiMuRefOmegaInv * s;
+  double fac = op_focei.scaleObjective == 2 ?
+    op_focei.scaleObjectiveTo / op_focei.initObjective : 1.0;
+  bool any = false;
+  foceiMuRefG.assign(npars, NA_REAL);
+  for (int cpar = npars; cpar--;) {
+    if (foceiMuRefOk[cpar] < 0) continue;
+    int j = op_focei.fixedTrans[cpar];
+    if (j >= op_focei.ntheta) continue;
+    double d = 0.0;
+    bool found = false;
+    for (int k = min2(op_focei.muRefN, neta); k--;) {
+      if (op_focei.muRef[k] == j) {
+        d += s[k];
+        found = true;
+      }
+    }
+    if (!found) continue;
+    foceiMuRefG[cpar] = -2.0*d*fac*unscaleParD(theta, cpar);
+    any = true;
+  }
+  return any;
+}
+
+// Accept or reject the shortcut of each parameter against the finite
+// differences g (Gill differences, or every FOCEI_MUREF_CHECK
+// shortcut gradients forward differences of all the parameters).  A
+// rejected parameter is differenced for the rest of the fit.  The
+// shortcut is kept in fit$parHistData as a "Mu-referenced Gradient"
+// row next to the differences it was compared with.
+static inline void foceiMuRefGradCheck(double *g) {
+  for (int cpar = op_focei.npars; cpar--;) {
+    if (ISNA(foceiMuRefG[cpar])) continue;
+    foceiMuRefOk[cpar] =
+      std::fabs(foceiMuRefG[cpar] - g[cpar]) <= foceiMuRefTol*std::fabs(g[cpar]) ? 1 : -1;
+  }
+  foceiMuRefNGrad = 0;
+  parHistAddGrad(foceiHist, 8, foceiMuRefG.data(), op_focei.npars);
+}
+
+static inline bool foceiMuRefGradUse(bool useMu, int cpar) {
+  return useMu && foceiMuRefOk[cpar] == 1 && !ISNA(foceiMuRefG[cpar]);
+}
+
+static inline void numericGrad0(double *theta, double *g){
+  gradPreClear();
   op_focei.mixDeriv=0;
   op_focei.reducedTol2=0;
   op_focei.curGill=0;
@@ -2330,7 +3549,9 @@ void numericGrad(double *theta, double *g){
         RSprintf(_("calculate Gill Difference and optimize forward difference step size:\n"));
       }
     }
+    bool useMu = foceiMuRefGradCalc(theta);
     for (int cpar = op_focei.npars; cpar--;){
+      if (gillSeedUse(theta, cpar, g)) continue;
       op_focei.gillRet[cpar] = gill83(&hf, &hphif, &op_focei.gillDf[cpar], &op_focei.gillDf2[cpar], &op_focei.gillErr[cpar],
                                       theta, cpar, op_focei.gillRtol, op_focei.gillK, op_focei.gillStep, op_focei.gillFtol,
                                       -1, gill83fnG);
@@ -2366,12 +3587,14 @@ void numericGrad(double *theta, double *g){
       }
       g[cpar] = op_focei.gillDf[cpar];
     }
+    if (useMu) foceiMuRefGradCheck(g);
     if(op_focei.slow){
       op_focei.cur=op_focei.totTick;
       op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
       RSprintf("\n");
     }
     op_focei.didGill=1;
+    gillSeed.clear(); // only seeds the first search
     if (op_focei.reducedTol2 && op_focei.repeatGillN < op_focei.repeatGillMax){
       op_focei.repeatGill=1;
       op_focei.repeatGillN++;
@@ -2413,7 +3636,35 @@ void numericGrad(double *theta, double *g){
         doForward=true;
       }
     }
+    // The shortcut replaces forward differences only, so the central
+    // differences near the minimum (derivMethod="switch") are exact
+    bool useMu = doForward && foceiMuRefGradCalc(theta);
+    bool muCheck = false;
+    if (useMu && ++foceiMuRefNGrad >= FOCEI_MUREF_CHECK) {
+      // Difference every parameter and re-check the shortcut
+      useMu = false;
+      muCheck = true;
+    }
+    if (gradPreStart(theta, false)) {
+      for (cpar = npars; cpar--;) {
+        if (foceiMuRefGradUse(useMu, cpar)) continue;
+        if (doForward){
+          delta = (std::fabs(theta[cpar])*op_focei.rEps[cpar] + op_focei.aEps[cpar]);
+          gradPreAdd(cpar, theta[cpar] + delta);
+        } else {
+          delta = (std::fabs(theta[cpar])*op_focei.rEpsC[cpar] + op_focei.aEpsC[cpar]);
+          gradPreAdd(cpar, theta[cpar] + delta);
+          gradPreAdd(cpar, theta[cpar] - delta);
+        }
+      }
+    }
     for (cpar = npars; cpar--;) {
+      if (foceiMuRefGradUse(useMu, cpar)) {
+        g[cpar] = foceiMuRefG[cpar];
+        foceiProf.nMuRef++;
+        if(op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
+        continue;
+      }
       if (doForward){
         delta = (std::fabs(theta[cpar])*op_focei.rEps[cpar] + op_focei.aEps[cpar]);
       } else {
@@ -2422,21 +3673,21 @@ void numericGrad(double *theta, double *g){
       cur = theta[cpar];
       theta[cpar] = cur + delta;
       if (doForward){
-        tmp = foceiOfv0(theta);
+        tmp = foceiOfvGrad(theta);
         if(op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
         g[cpar] = (tmp-f)/delta;
       } else {
-        tmp0 = foceiOfv0(theta);
+        tmp0 = foceiOfvGrad(theta);
         if(op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
         theta[cpar] = cur - delta;
-        tmp = foceiOfv0(theta);
+        tmp = foceiOfvGrad(theta);
         if(op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
         g[cpar] = (tmp0-tmp)/(2*delta);
       }
       if (doForward && fabs(g[cpar]) > op_focei.gradCalcCentralLarge){
         doForward = false;
         theta[cpar] = cur - delta;
-        g[cpar] = (tmp-foceiOfv0(theta))/(2*delta);
+        g[cpar] = (tmp-foceiOfvGrad(theta))/(2*delta);
         if(op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
         op_focei.mixDeriv=1;
       }
@@ -2445,7 +3696,7 @@ void numericGrad(double *theta, double *g){
           // Switch to Backward difference method
           op_focei.mixDeriv=1;
           theta[cpar] = cur - delta;
-          g[cpar] = (f-foceiOfv0(theta))/(delta);
+          g[cpar] = (f-foceiOfvGrad(theta))/(delta);
           if(op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
           if (R_FINITE(op_focei.gradTrim)){
             if (g[cpar] > op_focei.gradTrim){
@@ -2518,7 +3769,7 @@ void numericGrad(double *theta, double *g){
         if (doForward){
           op_focei.mixDeriv=1;
           theta[cpar] = cur - delta;
-          g[cpar] = (tmp-foceiOfv0(theta))/(2*delta);
+          g[cpar] = (tmp-foceiOfvGrad(theta))/(2*delta);
           if(op_focei.slow)  op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
           if (g[cpar] > op_focei.gradTrim){
             g[cpar]=op_focei.gradTrim;
@@ -2532,7 +3783,7 @@ void numericGrad(double *theta, double *g){
         if (doForward){
           op_focei.mixDeriv=1;
           theta[cpar] = cur - delta;
-          g[cpar] = (tmp-foceiOfv0(theta))/(2*delta);
+          g[cpar] = (tmp-foceiOfvGrad(theta))/(2*delta);
           if(op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
           if (g[cpar] > op_focei.gradTrim){
             g[cpar]=op_focei.gradTrim;
@@ -2546,7 +3797,7 @@ void numericGrad(double *theta, double *g){
         op_focei.mixDeriv = 1;
         theta[cpar]       = cur - delta;
         tmp = g[cpar];
-        g[cpar]           = (tmp-foceiOfv0(theta))/(2*delta);
+        g[cpar]           = (tmp-foceiOfvGrad(theta))/(2*delta);
         if(op_focei.slow) op_focei.curTick = par_progress(op_focei.cur++, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
         if (fabs(tmp) > fabs(g[cpar])) g[cpar] = tmp;
       } else if (doForward) {
@@ -2594,6 +3845,7 @@ void numericGrad(double *theta, double *g){
         g[cpar] = op_focei.gillDf[cpar];
       }
     }
+    if (muCheck) foceiMuRefGradCheck(g);
     if(op_focei.slow) {
       op_focei.cur=op_focei.totTick;
       op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
@@ -2601,6 +3853,13 @@ void numericGrad(double *theta, double *g){
     }
     op_focei.calcGrad=0;
   }
+  gradPreClear();
+}
+
+void numericGrad(double *theta, double *g){
+  double t0 = profNow();
+  numericGrad0(theta, g);
+  profAdd(&(foceiProf.grad), t0);
 }
 
 //[[Rcpp::export]]
@@ -2733,6 +3992,11 @@ static inline void foceiSetupTheta_(List mvi,
   op_focei.npars  = npars;
 }
 
+// Number of doubles rounded up to a 64 byte cache line
+static inline size_t foceiAlign(size_t n) {
+  return (n + 7) & ~((size_t)7);
+}
+
 static inline void foceiSetupNoEta_(){
   rx = getRx();
 
@@ -2779,15 +4043,45 @@ static inline void foceiSetupEta_(NumericMatrix etaMat0){
   if (inds_focei != NULL) R_Free(inds_focei);
   inds_focei = R_Calloc(rx->nsub, focei_ind);
   etaMat0 = transpose(etaMat0);
-  op_focei.gEtaGTransN=(op_focei.neta+1)*rx->nsub;
-  int nz = ((op_focei.neta+1)*(op_focei.neta+2)/2+6*(op_focei.neta+1)+1)*rx->nsub;
-
-  if (op_focei.etaUpper != NULL) R_Free(op_focei.etaUpper);
-  op_focei.etaUpper = R_Calloc(op_focei.gEtaGTransN*9+ op_focei.npars*(rx->nsub + 1)+nz+
-                               2*op_focei.neta * rx->nall + rx->nall+ rx->nall*rx->nall +
-                               op_focei.neta*5 + 3*op_focei.neta*op_focei.neta*rx->nsub, double);
-  op_focei.etaLower =  op_focei.etaUpper + op_focei.neta;
-  op_focei.geta     = op_focei.etaLower + op_focei.neta;
+  // All the per-subject buffers come from one allocation.  Each block
+  // (and each subject's part of a block) starts on a 64 byte boundary
+  // so subjects never share a cache line; this matters when subjects
+  // are solved by different threads.  Every block is contiguous across
+  // subjects.
+  int nsub = rx->nsub, neta = op_focei.neta;
+  op_focei.etaStride = foceiAlign(neta+1);
+  op_focei.gEtaGTransN = op_focei.etaStride*nsub;
+  size_t nzm = foceiAlign((neta+1)*(neta+2)/2+6*(neta+1)+1),
+    nH = foceiAlign(neta*neta), nTheta = foceiAlign(op_focei.npars),
+    nA = 0, nB = 0, nVid = 0, maxObs = 0;
+  for (int id = 0; id < nsub; id++) {
+    rx_solving_options_ind *ind = &(rx->subjects[id]);
+    size_t nobs = ind->n_all_times - ind->ndoses - ind->nevid2;
+    if (nobs > maxObs) maxObs = nobs;
+    if (!op_focei.lowMem) {
+      nA   += foceiAlign(neta*nobs);
+      nB   += foceiAlign(nobs);
+    }
+    // Vid is only used by FO
+    if (op_focei.fo == 1) nVid += foceiAlign(nobs*nobs);
+  }
+  // With innerMemory="low" a, B and c are per-thread instead of
+  // per-subject
+  op_focei.scratchStride = 0;
+  if (op_focei.lowMem) {
+    op_focei.scratchStride = foceiAlign(maxObs*(2*neta + 1));
+  }
+  size_t nArena = 2*foceiAlign(neta) + 9*(size_t)(op_focei.gEtaGTransN) +
+    nTheta*(nsub + 1) + nzm*nsub + 2*nA + nB + 2*nH*nsub + nVid +
+    op_focei.scratchStride*op_focei.cores;
+  op_focei.arenaBytes = (nArena + 8)*sizeof(double);
+
+  if (op_focei.etaArena != NULL) R_Free(op_focei.etaArena);
+  // Extra 8 doubles to align the start
+  op_focei.etaArena = R_Calloc(nArena + 8, double);
+  op_focei.etaUpper = (double*)(((uintptr_t)(op_focei.etaArena) + 63) & ~((uintptr_t)63));
+  op_focei.etaLower = op_focei.etaUpper + foceiAlign(neta);
+  op_focei.geta     = op_focei.etaLower + foceiAlign(neta);
   op_focei.goldEta  = op_focei.geta + op_focei.gEtaGTransN;
   op_focei.getahf   = op_focei.goldEta + op_focei.gEtaGTransN;
   op_focei.getahr   = op_focei.getahf + op_focei.gEtaGTransN;
@@ -2796,14 +4090,15 @@ static inline void foceiSetupEta_(NumericMatrix etaMat0){
   op_focei.gVar     = op_focei.gG + op_focei.gEtaGTransN;
   op_focei.gX       = op_focei.gVar + op_focei.gEtaGTransN;
   op_focei.glp      = op_focei.gX + op_focei.gEtaGTransN;
-  op_focei.gthetaGrad = op_focei.glp + op_focei.gEtaGTransN;  // op_focei.npars*(rx->nsub + 1)
-  op_focei.gZm      = op_focei.gthetaGrad + op_focei.npars*(rx->nsub + 1); // nz
-  op_focei.ga       = op_focei.gZm + nz;//[op_focei.neta * rx->nall]
-  op_focei.gc       = op_focei.ga + op_focei.neta * rx->nall;//[op_focei.neta * rx->nall]
-  op_focei.gB       = op_focei.gc + op_focei.neta * rx->nall;//[rx->nall]
-  op_focei.gH       = op_focei.gB + rx->nall; //[op_focei.neta*op_focei.neta*rx->nsub]
-  op_focei.gH0      = op_focei.gB + op_focei.neta*op_focei.neta*rx->nsub; //[op_focei.neta*op_focei.neta*rx->nsub]
-  op_focei.gVid     = op_focei.gH0 + op_focei.neta*op_focei.neta*rx->nsub;
+  op_focei.gthetaGrad = op_focei.glp + op_focei.gEtaGTransN;  // nTheta*(nsub + 1)
+  op_focei.gZm      = op_focei.gthetaGrad + nTheta*(nsub + 1); // nzm*nsub
+  op_focei.ga       = op_focei.gZm + nzm*nsub; //[nA]
+  op_focei.gc       = op_focei.ga + nA; //[nA]
+  op_focei.gB       = op_focei.gc + nA; //[nB]
+  op_focei.gH       = op_focei.gB + nB; //[nH*nsub]
+  op_focei.gH0      = op_focei.gH + nH*nsub; //[nH*nsub]
+  op_focei.gVid     = op_focei.gH0 + nH*nsub; //[nVid]
+  op_focei.gScratch = op_focei.gVid + nVid; //[scratchStride*cores]
   // Could use .zeros() but since I used Calloc, they are already zero.
   // Yet not doing it causes the theta reset error.
   op_focei.etaM     = mat(op_focei.neta, 1, arma::fill::zeros);
@@ -2816,7 +4111,8 @@ static inline void foceiSetupEta_(NumericMatrix etaMat0){
   std::fill_n(&op_focei.goldEta[0], op_focei.gEtaGTransN, -42.0); // All etas = -42;  Unlikely if normal
 
 
-  unsigned int i, j = 0, k = 0, ii=0, jj = 0, iA=0, iB=0, iH=0, iVid=0;
+  unsigned int i;
+  size_t j = 0, ii=0, jj = 0, iA=0, iB=0, iH=0, iVid=0;
   focei_ind *fInd;
   for (i = rx->nsub; i--;){
     fInd = &(inds_focei[i]);
@@ -2836,8 +4132,9 @@ static inline void foceiSetupEta_(NumericMatrix etaMat0){
     fInd->H = &op_focei.gH[iH];
     fInd->H0 = &op_focei.gH0[iH];
     fInd->Vid = &op_focei.gVid[iVid];
-    iH += op_focei.neta*op_focei.neta;
-    iVid += (ind->n_all_times - ind->ndoses - ind->nevid2)*(ind->n_all_times - ind->ndoses - ind->nevid2);
+    size_t nobs = ind->n_all_times - ind->ndoses - ind->nevid2;
+    iH += nH;
+    if (op_focei.fo == 1) iVid += foceiAlign(nobs*nobs);
 
     // Copy in etaMat0 to the inital eta stored (0 if unspecified)
     // std::copy(&etaMat0[i*op_focei.neta], &etaMat0[(i+1)*op_focei.neta], &fInd->saveEta[0]);
@@ -2847,28 +4144,36 @@ static inline void foceiSetupEta_(NumericMatrix etaMat0){
     fInd->saveEta[op_focei.neta] = i;
     fInd->oldEta[op_focei.neta] = i;
 
-    j+=op_focei.neta+1;
-
-    k+=op_focei.neta;
+    j += op_focei.etaStride;
 
-    fInd->a = &op_focei.ga[iA];
-    fInd->c = &op_focei.gc[iA];
-    iA += op_focei.neta * (ind->n_all_times - ind->ndoses - ind->nevid2);
+    if (op_focei.lowMem) {
+      fInd->a = NULL;
+      fInd->c = NULL;
+      fInd->B = NULL;
+    } else {
+      fInd->a = &op_focei.ga[iA];
+      fInd->c = &op_focei.gc[iA];
+      iA += foceiAlign(neta*nobs);
 
-    fInd->B = &op_focei.gB[iB];
-    iB += (ind->n_all_times - ind->ndoses - ind->nevid2);
+      fInd->B = &op_focei.gB[iB];
+      iB += foceiAlign(nobs);
+    }
 
     fInd->zm = &op_focei.gZm[ii];
-    ii+=(op_focei.neta+1) * (op_focei.neta + 2) / 2 + 6*(op_focei.neta + 1)+1;
+    ii += nzm;
 
     fInd->thetaGrad = &op_focei.gthetaGrad[jj];
-    jj+= op_focei.npars;
+    jj += nTheta;
 
     fInd->mode = 1;
     fInd->uzm = 1;
     fInd->doEtaNudge=1;
   }
   op_focei.thetaGrad = &op_focei.gthetaGrad[jj];
+  // Stack based kernels for the common small neta sizes; chosen once
+  // here instead of for every subject evaluation
+  op_focei.cholFix   = cholFixGet(op_focei.neta);
+  op_focei.cholSEFix = cholSEFixGet(op_focei.neta);
   op_focei.alloc=true;
 }
 
@@ -2903,20 +4208,30 @@ NumericVector foceiSetup_(const RObject &obj,
   op_focei.mvi = mvi;
   op_focei.adjLik = as<bool>(foceiO["adjLik"]);
   op_focei.badSolveObjfAdj=fabs(as<double>(foceiO["badSolveObjfAdj"]));
+  // Needed to size the subject buffers in foceiSetupEta_()
+  op_focei.cores = 1;
+  if (foceiO.containsElementNamed("cores")) {
+    op_focei.cores = max2(1, as<int>(foceiO["cores"]));
+  }
+  op_focei.fo = as<int>(foceiO["fo"]);
+  op_focei.lowMem = false;
+  if (foceiO.containsElementNamed("innerMemory")) {
+    op_focei.lowMem = as<int>(foceiO["innerMemory"]) == 2 && op_focei.fo != 1;
+  }
 
   op_focei.zeroGrad = false;
   op_focei.resetThetaCheckPer = as<double>(foceiO["resetThetaCheckPer"]);
   op_focei.printTop = as<int>(foceiO["printTop"]);
   op_focei.nF2 = as<int>(foceiO["nF"]);
+  op_focei.maxOuterIterations = as<int>(foceiO["maxOuterIterations"]);
   if (op_focei.nF2 == 0){
-    vGrad.clear();
-    vPar.clear();
-    iterType.clear();
-    gradType.clear();
-    niter.clear();
-    niterGrad.clear();
+    // three rows for each function evaluation; most iterations take
+    // one or two evaluations.  The iterations are capped first so the
+    // product cannot overflow
+    parHistSetup(foceiHist,
+                 foceiO.containsElementNamed("parHistMax") ? as<int>(foceiO["parHistMax"]) : 0,
+                 6*(std::min(op_focei.maxOuterIterations, PARHIST_RESERVE) + 1));
   }
-  op_focei.maxOuterIterations = as<int>(foceiO["maxOuterIterations"]);
   op_focei.maxInnerIterations = as<int>(foceiO["maxInnerIterations"]);
   op_focei.maxOdeRecalc = as<int>(foceiO["maxOdeRecalc"]);
   op_focei.objfRecalN=0;
@@ -3030,7 +4345,7 @@ NumericVector foceiSetup_(const RObject &obj,
   params.attr("row.names") = IntegerVector::create(NA_INTEGER,-nsub);
   // Now pre-fill parameters.
   if (!Rf_isNull(obj)) {
-    rxControl[Rxc_cores] = IntegerVector::create(1); // #Force one core; parallelization needs to be taken care of here in inner.cpp
+    rxControl[Rxc_cores] = IntegerVector::create(1); // #Force one core; parallelization is done by subject in innerOpt() (see foceiControl(cores=))
     rxode2::rxSolve_(obj, rxControl,
                      R_NilValue,//const Nullable<CharacterVector> &specParams =
                      R_NilValue,//const Nullable<List> &extraArgs =
@@ -3042,6 +4357,27 @@ NumericVector foceiSetup_(const RObject &obj,
     if (op_focei.neta == 0) foceiSetupNoEta_();
     else foceiSetupEta_(etaMat0);
   }
+  op_focei.warmStart = foceiO.containsElementNamed("warmStart") &&
+    !Rf_isNull(foceiO["warmStart"]);
+  if (op_focei.neta != 0 && foceiO.containsElementNamed("etaHess") &&
+      !Rf_isNull(foceiO["etaHess"])) {
+    // Inner Hessians from a parent fit (foceiControl(warmStart=)); one
+    // row per subject with the lower triangle by column, NA rows start
+    // the usual way
+    NumericMatrix etaHess = as<NumericMatrix>(foceiO["etaHess"]);
+    int l_n = op_focei.neta*(op_focei.neta+1)/2;
+    if (etaHess.nrow() != rx->nsub || etaHess.ncol() != l_n) {
+      stop(_("'etaHess' needs one row per subject and one column per lower triangular element"));
+    }
+    for (int id = rx->nsub; id--;) {
+      if (ISNA(etaHess(id, 0))) continue;
+      focei_ind *fInd = &(inds_focei[id]);
+      std::fill(&fInd->zm[0], &fInd->zm[0]+op_focei.nzm, 0.0);
+      for (int k = l_n; k--;) fInd->zm[k] = etaHess(id, k);
+      fInd->uzm = 2;
+      fInd->mode = 2;
+    }
+  }
   op_focei.epsilon=as<double>(foceiO["epsilon"]);
   op_focei.nsim=as<int>(foceiO["n1qn1nsim"]);
   op_focei.imp=0;
@@ -3050,6 +4386,10 @@ NumericVector foceiSetup_(const RObject &obj,
   // if (op_focei.printInner < 0) op_focei.printInner = -op_focei.printInner;
   op_focei.printOuter=as<int>(foceiO["print"]);
   if (op_focei.printOuter < 0) op_focei.printOuter = -op_focei.printOuter;
+  op_focei.printSummary = foceiO.containsElementNamed("printSummary") &&
+    op_focei.printOuter != 0 ? as<double>(foceiO["printSummary"]) : 0.0;
+  foceiSummaryT0 = foceiSummaryLast = profNow();
+  foceiSummaryBest = R_PosInf;
   // if (op_focei.printInner > 0){
   //   rx->op->cores=1;
   // }
@@ -3134,6 +4474,19 @@ NumericVector foceiSetup_(const RObject &obj,
     std::copy(rEpsC.begin(), rEpsC.end(), &op_focei.rEpsC[0]);
     std::copy(aEpsC.begin(), aEpsC.end(), &op_focei.aEpsC[0]);
   } else {
+    gillSeed.clear();
+    gillSeedN[0] = gillSeedN[1] = 0;
+    if (foceiO.containsElementNamed("gillSeed") && !Rf_isNull(foceiO["gillSeed"])) {
+      // rows are the full theta (thetas then omegas)
+      NumericMatrix seed = as<NumericMatrix>(foceiO["gillSeed"]);
+      gillSeed.assign(4*op_focei.npars, NA_REAL);
+      for (int k = op_focei.npars; k--;) {
+        int j = op_focei.fixedTrans[k];
+        if (j < seed.nrow() && seed.ncol() == 4) {
+          for (int c = 4; c--;) gillSeed[4*k + c] = seed(j, c);
+        }
+      }
+    }
     if (op_focei.derivMethod){
       std::fill_n(&op_focei.rEps[0], totN, std::fabs(cEps[0])/2.0);
       std::fill_n(&op_focei.aEps[0], totN, std::fabs(cEps[1])/2.0);
@@ -3247,6 +4600,11 @@ NumericVector foceiSetup_(const RObject &obj,
   op_focei.gradTrim = as<double>(foceiO["gradTrim"]);
   op_focei.gradCalcCentralLarge = as<double>(foceiO["gradCalcCentralLarge"]);
   op_focei.gradCalcCentralSmall = as<double>(foceiO["gradCalcCentralSmall"]);
+  foceiMuRefTol = foceiO.containsElementNamed("muRefGrad") ?
+    as<double>(foceiO["muRefGrad"]) : 0.0;
+  foceiMuRefOk.assign(op_focei.npars, 0);
+  foceiMuRefNGrad = 0;
+  foceiMuRefTheta.clear();
   op_focei.etaNudge = as<double>(foceiO["etaNudge"]);
   op_focei.etaNudge2 = as<double>(foceiO["etaNudge2"]);
   op_focei.eventFD = as<double>(foceiO["eventFD"]);
@@ -3254,8 +4612,33 @@ NumericVector foceiSetup_(const RObject &obj,
   op_focei.predNeq = as<int>(foceiO["predNeq"]);
   op_focei.gradProgressOfvTime = as<double>(foceiO["gradProgressOfvTime"]);
   op_focei.fallbackFD = as<int>(foceiO["fallbackFD"]);
+  op_focei.innerPar = false;
+  op_focei.etaCacheN = 0;
+  if (foceiO.containsElementNamed("etaCache")) {
+    op_focei.etaCacheN = max2(0, as<int>(foceiO["etaCache"]));
+  }
+  etaCacheSetup();
+  foceiBufferPeak();
+  foceiProfSetup(getRx()->nsub);
+  foceiSchedSetup(getRx());
   op_focei.initObj=0;
   op_focei.lastOfv=std::numeric_limits<double>::max();
+  if (op_focei.nF2 > 0 && foceiO.containsElementNamed("initObjective") &&
+      !Rf_isNull(foceiO["initObjective"])) {
+    // Resumed from a checkpoint; keep the objective function scale
+    op_focei.initObj = 1;
+    op_focei.initObjective = as<double>(foceiO["initObjective"]);
+    if (op_focei.scaleObjective == 1) op_focei.scaleObjective=2;
+  }
+  foceiCkptOn = false;
+  foceiCkptFile.clear();
+  if (foceiO.containsElementNamed("checkpoint") && !Rf_isNull(foceiO["checkpoint"])) {
+    foceiCkptFile = as<std::string>(foceiO["checkpoint"]);
+    foceiCkptInterval = as<double>(foceiO["checkpointInterval"]);
+    foceiCkptLast = profNow();
+    foceiCkptBest = R_PosInf;
+    foceiCkptOn = true;
+  }
   for (unsigned int k = op_focei.npars; k--;){
     j=op_focei.fixedTrans[k];
     ret[k] = op_focei.fullTheta[j];
@@ -3453,6 +4836,18 @@ void foceiOuterFinal(double *x, Environment e){
   nlmixr2EnvSetup(e, fmin);
 }
 
+// Progress summary of foceiControl(printSummary=); one line at most
+// every printSummary seconds instead of a row for each evaluation
+static inline void foceiPrintSummary(double objf) {
+  if (R_FINITE(objf) && objf < foceiSummaryBest) foceiSummaryBest = objf;
+  double t = profNow();
+  if (t - foceiSummaryLast < op_focei.printSummary) return;
+  foceiSummaryLast = t;
+  RSprintf("outer: %d evaluations, %d gradients; best objective %#14.8g (%.0f s)\n",
+           op_focei.nF + op_focei.nF2, op_focei.nG, foceiSummaryBest,
+           t - foceiSummaryT0);
+}
+
 static inline void foceiPrintLine(int ncol){
   RSprintf("|-----+---------------+");
   for (int i = 0; i < ncol; i++){
@@ -3468,44 +4863,31 @@ static inline void foceiPrintLine(int ncol){
 // Outer l-BFGS-b from R
 extern "C" double foceiOfvOptim(int n, double *x, void *ex){
   double ret = foceiOfv0(x);
-  niter.push_back(op_focei.nF2+(++op_focei.nF));
-  // Scaled
-  vPar.push_back(ret);
-  iterType.push_back(5);
+  int it = op_focei.nF2+(++op_focei.nF);
   int finalize = 0, i = 0;
-  for (i = 0; i < n; i++){
-    vPar.push_back(x[i]);
-  }
+  double retU = op_focei.scaleObjective ?
+    op_focei.initObjective * ret / op_focei.scaleObjectiveTo : ret;
+  // Scaled
+  parHistAdd(foceiHist, it, 5, ret, x, n);
   // Unscaled
-  iterType.push_back(6);
-  niter.push_back(niter.back());
-  if (op_focei.scaleObjective){
-    vPar.push_back(op_focei.initObjective * ret / op_focei.scaleObjectiveTo);
-  } else {
-    vPar.push_back(ret);
-  }
+  foceiHistRow.resize(n);
   for (i = 0; i < n; i++){
-    vPar.push_back(unscalePar(x, i));
+    foceiHistRow[i] = unscalePar(x, i);
   }
+  parHistAdd(foceiHist, it, 6, retU, foceiHistRow.data(), n);
   // Back-transformed (7)
-  iterType.push_back(7);
-  niter.push_back(niter.back());
-  if (op_focei.scaleObjective){
-    vPar.push_back(op_focei.initObjective * ret / op_focei.scaleObjectiveTo);
-  } else {
-    vPar.push_back(ret);
-  }
   for (i = 0; i < n; i++){
     if (op_focei.xPar[i] == 1){
-      vPar.push_back(exp(unscalePar(x, i)));
+      foceiHistRow[i] = exp(foceiHistRow[i]);
     } else if (op_focei.xPar[i] < 0){
       int m = -op_focei.xPar[i]-1;
-      vPar.push_back(expit(unscalePar(x, i), op_focei.logitThetaLow[m], op_focei.logitThetaHi[m]));
-    } else {
-      vPar.push_back(unscalePar(x, i));
+      foceiHistRow[i] = expit(foceiHistRow[i], op_focei.logitThetaLow[m], op_focei.logitThetaHi[m]);
     }
   }
-  if (op_focei.printOuter != 0 && op_focei.nF % op_focei.printOuter == 0){
+  parHistAdd(foceiHist, it, 7, retU, foceiHistRow.data(), n);
+  if (op_focei.printSummary > 0) {
+    foceiPrintSummary(retU);
+  } else if (op_focei.printOuter != 0 && op_focei.nF % op_focei.printOuter == 0){
     if (op_focei.useColor && !isRstudio())
       RSprintf("|\033[1m%5d\033[0m|%#14.8g |", op_focei.nF+op_focei.nF2, ret);
     else
@@ -3620,22 +5002,22 @@ double foceiOuterF(NumericVector &theta){
 extern "C" void outerGradNumOptim(int n, double *par, double *gr, void *ex){
   numericGrad(par, gr);
   op_focei.nG++;
-  int finalize=0, i = 0;
-  niterGrad.push_back(niter.back());
+  int finalize=0, i = 0, gradType;
   if (op_focei.derivMethod == 0){
     if (op_focei.curGill){
-      gradType.push_back(1);
+      gradType = 1;
     } else if (op_focei.mixDeriv){
-      gradType.push_back(2);
+      gradType = 2;
     } else{
-      gradType.push_back(3);
+      gradType = 3;
     }
   } else {
-    gradType.push_back(4);
+    gradType = 4;
   }
-  if (op_focei.printOuter != 0 && op_focei.nG % op_focei.printOuter == 0){
+  if (op_focei.printSummary <= 0 && op_focei.printOuter != 0 &&
+      op_focei.nG % op_focei.printOuter == 0){
     if (op_focei.useColor && op_focei.printNcol >= n){
-      switch(gradType.back()){
+      switch(gradType){
       case 1:
         RSprintf("|\033[4m    G|    Gill Diff. |");
         break;
@@ -3650,7 +5032,7 @@ extern "C" void outerGradNumOptim(int n, double *par, double *gr, void *ex){
         break;
       }
     } else {
-      switch(gradType.back()){
+      switch(gradType){
       case 1:
         RSprintf("|    G|    Gill Diff. |");
         break;
@@ -3697,7 +5079,6 @@ extern "C" void outerGradNumOptim(int n, double *par, double *gr, void *ex){
       foceiPrintLine(min2(op_focei.npars, op_focei.printNcol));
     }
   }
-  vGrad.push_back(NA_REAL); // Gradient doesn't record objf
   for (i = 0; i < n; i++){
     if (gr[i] == 0){
       if (op_focei.nF+op_focei.nF2 == 1){
@@ -3707,8 +5088,9 @@ extern "C" void outerGradNumOptim(int n, double *par, double *gr, void *ex){
         gr[i]=sqrt(DBL_EPSILON);
       }
     }
-    vGrad.push_back(gr[i]);
   }
+  // Gradient doesn't record objf
+  parHistAddGrad(foceiHist, gradType, gr, n);
 }
 
 //[[Rcpp::export]]
@@ -3935,53 +5317,107 @@ List nlmixr2Gill83_(Function what, NumericVector args, Environment envir,
   df.attr("class") = cls;
   return df;
 }
-//' @rdname nlmixr2GradFun
-//' @export
-//[[Rcpp::export]]
-double nlmixr2Eval_(NumericVector theta, std::string md5){
+// Native state of the nlmixr2GradFun() objectives (by md5).  The
+// settings in .nlmixr2GradInfo are only read when the state is
+// created; the objective is either a registered C function or the R
+// closure (fallback).
+typedef struct {
+  bool init = false;
+  nlmixr2GradObj_t fn = NULL;
+  void *ex = NULL;
+  RObject what;
+  RObject envir;
+  LogicalVector which;
+  int n = 0;
+  // Last evaluation (reused by the gradient)
+  std::vector<double> fTheta;
+  double f = NA_REAL;
+  std::vector<double> uPar;
+  // Gill83 step sizes
+  bool gill = false;
+  double gillRtol, gillStep, gillFtol;
+  int gillK;
+  std::vector<double> aEps, rEps, aEpsC, rEpsC;
+  bool useColor;
+  int printNcol;
+  int print;
+  bool isRstudio;
+} nlmixr2GradState_t;
+
+std::map<std::string, nlmixr2GradState_t> nlmixr2GradStates;
+
+static inline Environment nlmixr2GradInfo() {
   Function loadNamespace("loadNamespace", R_BaseNamespace);
   Environment nlmixr2 = loadNamespace("nlmixr2est");
   Environment gradInfo = nlmixr2[".nlmixr2GradInfo"];
-  std::string EF = md5 + ".f";
-  std::string EE = md5 + ".e";
-  std::string EW = md5 + ".w";
-  LogicalVector lEW;
-  if (!gradInfo.exists(EW)){
-    LogicalVector tmp(theta.size());
-    for (int i = theta.size(); i--;){
-      tmp[i] = true;
+  return gradInfo;
+}
+
+static inline nlmixr2GradState_t *nlmixr2GradStateGet(std::string md5, int n) {
+  nlmixr2GradState_t *st = &(nlmixr2GradStates[md5]);
+  if (!st->init) {
+    Environment gradInfo = nlmixr2GradInfo();
+    std::string EW = md5 + ".w";
+    if (!gradInfo.exists(EW)){
+      LogicalVector tmp(n);
+      for (int i = n; i--;){
+        tmp[i] = true;
+      }
+      gradInfo[EW] = tmp;
     }
-    gradInfo[EW] = tmp;
-  }
-  lEW=gradInfo[EW];
-  if (lEW.size() != theta.size()) stop("invalid theta size");
-  Function cFun = as<Function>(gradInfo[EF]);
-  Environment cEnvir = as<Environment>(gradInfo[EE]);
-  double f0;
-  List par(1);
-  par[0] = theta;
-  f0 = as<double>(doCall(_["what"] = cFun, _["args"]=par, _["envir"]=cEnvir));
-  std::string f0s = md5 + ".fc";
-  std::string f0t = md5 + ".ft";
-  std::string cns = md5 + ".n";
-  f0 = as<double>(doCall(_["what"] = cFun, _["args"]=par, _["envir"]=cEnvir));
-  gradInfo[f0s] = f0;
-  gradInfo[f0t] = theta;
-  int cn = gradInfo[cns]; cn++;
-  gradInfo[cns] = cn;
-  bool useColor = as<bool>(gradInfo["useColor"]);
-  int printNcol=as<int>(gradInfo["printNcol"]);
-  int printN=as<int>(gradInfo["print"]);
-  int i, finalize=0, n=theta.size();
-  bool isRstudio=as<bool>(gradInfo["isRstudio"]);
+    st->which     = gradInfo[EW];
+    st->what      = gradInfo[md5 + ".f"];
+    st->envir     = gradInfo[md5 + ".e"];
+    st->gillRtol  = as<double>(gradInfo[md5 + ".rtol"]);
+    st->gillK     = as<int>(gradInfo[md5 + ".k"]);
+    st->gillStep  = as<double>(gradInfo[md5 + ".s"]);
+    st->gillFtol  = as<double>(gradInfo[md5 + ".ftol"]);
+    st->useColor  = as<bool>(gradInfo["useColor"]);
+    st->printNcol = as<int>(gradInfo["printNcol"]);
+    st->print     = as<int>(gradInfo["print"]);
+    st->isRstudio = as<bool>(gradInfo["isRstudio"]);
+    if (gradInfo.exists(md5 + ".g")) {
+      // Gill83 step sizes from an earlier state with the same md5
+      List Lgill = gradInfo[md5 + ".g"];
+      st->aEps  = as<std::vector<double> >(Lgill["aEps"]);
+      st->rEps  = as<std::vector<double> >(Lgill["rEps"]);
+      st->aEpsC = as<std::vector<double> >(Lgill["aEpsC"]);
+      st->rEpsC = as<std::vector<double> >(Lgill["rEpsC"]);
+      st->gill  = true;
+    }
+    if (gradInfo.exists(md5 + ".uPar")) {
+      NumericVector uPar = gradInfo[md5 + ".uPar"];
+      st->uPar = as<std::vector<double> >(uPar);
+    }
+    st->init = true;
+  }
+  return st;
+}
+
+static inline double nlmixr2GradObj(nlmixr2GradState_t *st, double *theta, int n) {
+  if (st->fn != NULL) return st->fn(n, theta, st->ex);
+  NumericVector par0(n);
+  std::copy(&theta[0], &theta[0] + n, par0.begin());
+  Function cFun = as<Function>(st->what);
+  return as<double>(cFun(par0));
+}
+
+static double nlmixr2EvalState(nlmixr2GradState_t *st, double *theta, int n){
+  if (st->which.size() != n) stop("invalid theta size");
+  LogicalVector lEW = st->which;
+  double f0 = nlmixr2GradObj(st, theta, n);
+  st->f = f0;
+  st->fTheta.assign(&theta[0], &theta[0] + n);
+  int cn = ++(st->n);
+  bool useColor = st->useColor;
+  int printNcol = st->printNcol;
+  int printN = st->print;
+  int i, finalize=0;
+  bool isRstudio = st->isRstudio;
   if (cn == 1){
-    vGrad.clear();
-    vPar.clear();
-    iterType.clear();
-    gradType.clear();
-    niter.clear();
-    niterGrad.clear();
+    parHistSetup(foceiHist, 0, 0);
     if (printN != 0){
+      Environment gradInfo = nlmixr2GradInfo();
       foceiPrintLine(min2(n, printNcol));
       if (gradInfo.exists("thetaNames")){
         CharacterVector tn;
@@ -4032,25 +5468,19 @@ double nlmixr2Eval_(NumericVector theta, std::string md5){
     }
   }
   bool doUnscaled = false;
-  std::string unscaledPar = md5 + ".uPar";
-  NumericVector thetaU;
-  niter.push_back(cn);
+  double *thetaU = NULL;
   // Scaled
-  vPar.push_back(f0);
-  if (gradInfo.exists(unscaledPar)){
-    thetaU=as<NumericVector>(gradInfo[unscaledPar]);
-    if (thetaU.size() != theta.size()){
-      iterType.push_back(6);
+  if (st->uPar.size() != 0){
+    thetaU = &(st->uPar[0]);
+    if ((int)(st->uPar.size()) != n){
+      parHistAdd(foceiHist, cn, 6, f0, theta, n);
     } else {
       doUnscaled=true;
-      iterType.push_back(5);
+      parHistAdd(foceiHist, cn, 5, f0, theta, n);
     }
   } else {
     // Actually unscaled
-    iterType.push_back(6);
-  }
-  for (i = 0; i < n; i++){
-    vPar.push_back(theta[i]);
+    parHistAdd(foceiHist, cn, 6, f0, theta, n);
   }
   if (printN != 0 && cn % printN == 0){
     if (useColor && isRstudio)
@@ -4083,14 +5513,9 @@ double nlmixr2Eval_(NumericVector theta, std::string md5){
     }
   }
   if (doUnscaled){
-    iterType.push_back(6);
-    niter.push_back(niter.back());
     finalize=0;
     // No obj scaling currently
-    vPar.push_back(f0);
-    for (i = 0; i < n; i++){
-      vPar.push_back(thetaU[i]);
-    }
+    parHistAdd(foceiHist, cn, 6, f0, thetaU, n);
     if (printN != 0 && cn % printN == 0){
       if (useColor && isRstudio)
         RSprintf("|    U|%#14.8g |", f0);
@@ -4125,6 +5550,15 @@ double nlmixr2Eval_(NumericVector theta, std::string md5){
   return f0;
 }
 
+//' @rdname nlmixr2GradFun
+//' @export
+//[[Rcpp::export]]
+double nlmixr2Eval_(NumericVector theta, std::string md5){
+  nlmixr2GradState_t *st = nlmixr2GradStateGet(md5, theta.size());
+  return nlmixr2EvalState(st, &theta[0], theta.size());
+}
+
+
 void nlmixr2GradPrint(NumericVector gr, int gradType, int cn, bool useColor,
                       int printNcol, int printN, bool isRstudio){
   int n = gr.size(), finalize=0, i;
@@ -4199,132 +5633,99 @@ void nlmixr2GradPrint(NumericVector gr, int gradType, int cn, bool useColor,
 //[[Rcpp::export]]
 RObject nlmixr2Unscaled_(NumericVector theta, std::string md5){
   // Unscaled
-  Function loadNamespace("loadNamespace", R_BaseNamespace);
-  Environment nlmixr2 = loadNamespace("nlmixr2est");
-  Environment gradInfo = nlmixr2[".nlmixr2GradInfo"];
+  Environment gradInfo = nlmixr2GradInfo();
   std::string unscaledPar = md5 + ".uPar";
   gradInfo[unscaledPar] = theta;
+  std::map<std::string, nlmixr2GradState_t>::iterator it = nlmixr2GradStates.find(md5);
+  if (it != nlmixr2GradStates.end()) {
+    it->second.uPar = as<std::vector<double> >(theta);
+  }
   return R_NilValue;
 }
 
-//' @rdname nlmixr2GradFun
-//' @export
-//[[Rcpp::export]]
-NumericVector nlmixr2Grad_(NumericVector theta, std::string md5){
-  Function loadNamespace("loadNamespace", R_BaseNamespace);
-  Environment nlmixr2 = loadNamespace("nlmixr2est");
-  Environment gradInfo = nlmixr2[".nlmixr2GradInfo"];
-
-  std::string Egill = md5 + ".g";
-  std::string EF = md5 + ".f";
-  std::string EE = md5 + ".e";
-
-  Function cFun = as<Function>(gradInfo[EF]);
-  Environment cEnvir = as<Environment>(gradInfo[EE]);
-  List Lgill;
-  std::string EW = md5 + ".w";
-  LogicalVector lEW;
-  bool useColor = as<bool>(gradInfo["useColor"]);
-  int printNcol=as<int>(gradInfo["printNcol"]);
-  int printN=as<int>(gradInfo["print"]);
-  bool isRstudio=as<bool>(gradInfo["isRstudio"]);
-  if (gradInfo.exists(Egill)){
-    lEW=gradInfo[EW];
-    if (lEW.size() != theta.size()){
-      stop("Invalid theta size");
-    }
-    Lgill = gradInfo[Egill];
-  } else {
-    if (!gradInfo.exists(EW)){
-      LogicalVector tmp(theta.size());
-      for (int i = theta.size(); i--;){
-        tmp[i] = true;
-      }
-      gradInfo[EW] = tmp;
-    }
-    lEW=gradInfo[EW];
-    if (lEW.size() != theta.size()){
-      stop("Invalid theta size (or which size)");
-    }
-    std::string Ertol = md5 + ".rtol";
-    std::string EK = md5 + ".k";
-    std::string Estep = md5 + ".s";
-    std::string EFtol = md5 + ".ftol";
-    Lgill = nlmixr2Gill83_(cFun, theta, gradInfo[EE],
-                           lEW, gradInfo[Ertol],
-                           gradInfo[EK], gradInfo[Estep],
-                           gradInfo[EFtol]);
-    gradInfo[Egill]=Lgill;
-    niterGrad.push_back(niter.back());
-    gradType.push_back(1);
-    vGrad.push_back(NA_REAL); // Gradient doesn't record objf
+static NumericVector nlmixr2GradCalc(nlmixr2GradState_t *st, std::string md5,
+                                     double *thetaIn, int n){
+  if (st->which.size() != n){
+    stop("Invalid theta size (or which size)");
+  }
+  bool useColor = st->useColor;
+  int printNcol = st->printNcol;
+  int printN = st->print;
+  bool isRstudio = st->isRstudio;
+  if (!st->gill){
+    NumericVector theta(n);
+    std::copy(&thetaIn[0], &thetaIn[0] + n, theta.begin());
+    // Gill83 calls the registered C objective when there is one
+    gillNativeFn = st->fn;
+    gillNativeEx = st->ex;
+    List Lgill;
+    try {
+      Lgill = nlmixr2Gill83_(as<Function>(st->what), theta, as<Environment>(st->envir),
+                             st->which, st->gillRtol,
+                             st->gillK, st->gillStep,
+                             st->gillFtol);
+    } catch (...) {
+      gillNativeFn = NULL;
+      gillNativeEx = NULL;
+      throw;
+    }
+    gillNativeFn = NULL;
+    gillNativeEx = NULL;
+    Environment gradInfo = nlmixr2GradInfo();
+    gradInfo[md5 + ".g"]=Lgill;
+    st->aEps  = as<std::vector<double> >(Lgill["aEps"]);
+    st->rEps  = as<std::vector<double> >(Lgill["rEps"]);
+    st->aEpsC = as<std::vector<double> >(Lgill["aEpsC"]);
+    st->rEpsC = as<std::vector<double> >(Lgill["rEpsC"]);
+    st->gill = true;
     NumericVector gr = as<NumericVector>(Lgill["df"]);
     for (int i = 0; i < gr.size(); i++){
       if (gr[i] == 0){
         stop("On initial gradient evaluation, one or more parameters have a zero gradient\nChange model, try different initial estimates or try derivative free optimization)");
       }
-      vGrad.push_back(gr[i]);
     }
-    nlmixr2GradPrint(gr, gradType.back(), niter.back(), useColor,
+    // Gradient doesn't record objf
+    parHistAddGrad(foceiHist, 1, &gr[0], gr.size());
+    nlmixr2GradPrint(gr, 1, foceiHist.last, useColor,
                      printNcol, printN, isRstudio);
     return gr;
   }
-  NumericVector aEps = as<NumericVector>(Lgill["aEps"]);
-  NumericVector rEps = as<NumericVector>(Lgill["rEps"]);
-  NumericVector aEpsC = as<NumericVector>(Lgill["aEpsC"]);
-  NumericVector rEpsC = as<NumericVector>(Lgill["rEpsC"]);
-  NumericVector g(theta.size());
+  std::vector<double> theta(&thetaIn[0], &thetaIn[0] + n);
+  std::vector<double> &aEps = st->aEps, &rEps = st->rEps,
+    &aEpsC = st->aEpsC, &rEpsC = st->rEpsC;
+  NumericVector g(n);
   double f0, delta, cur, tmp=0, tmp0;
   bool doForward=true;
-  // FIXME
-  List par(1);
-  par[0] = theta;
-  std::string f0s = md5 + ".fc";
-  std::string f0t = md5 + ".ft";
   bool reEval = true;
-  if (gradInfo.exists(f0s)){
-    NumericVector thetaL = gradInfo[f0t];
-    if (thetaL.size() == theta.size()){
-      reEval=false;
-      for (int i = theta.size(); i--;){
-        if (thetaL[i] != theta[i]){
-          reEval=true;
-          break;
-        }
-      }
-      if (!reEval){
-        NumericVector tmp  = gradInfo[f0s];
-        if (tmp.size() == 1){
-          f0 = tmp[0];
-        } else {
-          reEval=true;
-        }
+  if ((int)(st->fTheta.size()) == n){
+    reEval=false;
+    for (int i = n; i--;){
+      if (st->fTheta[i] != theta[i]){
+        reEval=true;
+        break;
       }
     }
   }
   if (reEval){
-    f0 = as<double>(doCall(_["what"] = cFun, _["args"]=par, _["envir"]=cEnvir));
+    f0 = nlmixr2GradObj(st, &theta[0], n);
+  } else {
+    f0 = st->f;
   }
-  niterGrad.push_back(niter.back());
-  vGrad.push_back(NA_REAL); // Gradient doesn't record objf
   bool isMixed=false;
-  for (int i = theta.size(); i--;){
+  for (int i = n; i--;){
     cur = theta[i];
     if (doForward){
       delta = (std::fabs(theta[i])*rEps[i] + aEps[i]);
       theta[i] = cur + delta;
-      par[0] = theta;
-      tmp = as<double>(doCall(_["what"] = cFun, _["args"]=par, _["envir"]=cEnvir));
+      tmp = nlmixr2GradObj(st, &theta[0], n);
       g[i] = (tmp-f0)/delta;
       theta[i] = cur;
     } else {
       delta = (std::fabs(theta[i])*rEpsC[i] + aEpsC[i]);
       theta[i] = cur + delta;
-      par[0] = theta;
-      tmp0 = as<double>(doCall(_["what"] = cFun, _["args"]=par, _["envir"]=cEnvir));
+      tmp0 = nlmixr2GradObj(st, &theta[0], n);
       theta[i] = cur - delta;
-      par[0] = theta;
-      tmp = as<double>(doCall(_["what"] = cFun, _["args"]=par, _["envir"]=cEnvir));
+      tmp = nlmixr2GradObj(st, &theta[0], n);
       g[i] = (tmp0-tmp)/(2*delta);
       theta[i] = cur;
     }
@@ -4335,9 +5736,9 @@ NumericVector nlmixr2Grad_(NumericVector theta, std::string md5){
       	// Switch to Backward difference method
       	// op_focei.mixDeriv=1;
       	theta[i] = cur - delta;
-        par[0] = theta;
-        tmp0 = as<double>(doCall(_["what"] = cFun, _["args"]=par, _["envir"]=cEnvir));
+        tmp0 = nlmixr2GradObj(st, &theta[0], n);
       	g[i] = (f0-tmp0)/(delta);
+        theta[i] = cur;
         isMixed=true;
       } else {
       	// We are using the central difference AND there is an NA in one of the terms
@@ -4354,20 +5755,101 @@ NumericVector nlmixr2Grad_(NumericVector theta, std::string md5){
       }
     }
   }
-  for (int i = 0; i < theta.size(); i++){
-    vGrad.push_back(g[i]);
-  }
+  int gradType;
   if (isMixed){
-    gradType.push_back(2);
+    gradType = 2;
   } else if (doForward) {
-    gradType.push_back(3);
+    gradType = 3;
   } else {
-    gradType.push_back(4);
+    gradType = 4;
   }
-  nlmixr2GradPrint(g, gradType.back(), niter.back(), useColor,
+  // Gradient doesn't record objf
+  parHistAddGrad(foceiHist, gradType, &g[0], n);
+  nlmixr2GradPrint(g, gradType, foceiHist.last, useColor,
                    printNcol, printN, isRstudio);
   return g;
 }
+
+//' @rdname nlmixr2GradFun
+//' @export
+//[[Rcpp::export]]
+NumericVector nlmixr2Grad_(NumericVector theta, std::string md5){
+  nlmixr2GradState_t *st = nlmixr2GradStateGet(md5, theta.size());
+  return nlmixr2GradCalc(st, md5, &theta[0], theta.size());
+}
+
+//[[Rcpp::export]]
+RObject nlmixr2GradReset_(std::string md5){
+  nlmixr2GradStates.erase(md5);
+  return R_NilValue;
+}
+
+// C interface (registered with R_RegisterCCallable; see
+// inst/include/nlmixr2est_grad.h).  The objective has to be setup
+// with nlmixr2GradFun() first; the R closure is used unless a C
+// objective is registered.
+//
+// No C++ exception may leave these functions; a failure returns an
+// error code (or NaN) and the message is kept for nlmixr2GradError()
+std::string nlmixr2GradErr;
+
+extern "C" const char *nlmixr2GradError(void) {
+  return nlmixr2GradErr.c_str();
+}
+
+extern "C" int nlmixr2GradSetObj(const char *md5, nlmixr2GradObj_t fn, void *ex) {
+  try {
+    nlmixr2GradState_t *st = &(nlmixr2GradStates[std::string(md5)]);
+    st->fn = fn;
+    st->ex = ex;
+    // New objective; do not reuse the last evaluation
+    st->fTheta.clear();
+  } catch (std::exception &e) {
+    nlmixr2GradErr = e.what();
+    return 1;
+  } catch (...) {
+    nlmixr2GradErr = "unknown error setting the objective";
+    return 1;
+  }
+  nlmixr2GradErr.clear();
+  return 0;
+}
+
+extern "C" double nlmixr2GradEval(const char *md5, int n, double *theta) {
+  double ret;
+  try {
+    nlmixr2GradState_t *st = nlmixr2GradStateGet(std::string(md5), n);
+    ret = nlmixr2EvalState(st, theta, n);
+  } catch (std::exception &e) {
+    nlmixr2GradErr = e.what();
+    return NA_REAL;
+  } catch (...) {
+    nlmixr2GradErr = "unknown error evaluating the objective";
+    return NA_REAL;
+  }
+  nlmixr2GradErr.clear();
+  return ret;
+}
+
+extern "C" int nlmixr2GradGrad(const char *md5, int n, double *theta, double *g) {
+  try {
+    std::string md5s(md5);
+    nlmixr2GradState_t *st = nlmixr2GradStateGet(md5s, n);
+    NumericVector gr = nlmixr2GradCalc(st, md5s, theta, n);
+    std::copy(gr.begin(), gr.end(), &g[0]);
+  } catch (std::exception &e) {
+    nlmixr2GradErr = e.what();
+    std::fill_n(&g[0], n, NA_REAL);
+    return 1;
+  } catch (...) {
+    nlmixr2GradErr = "unknown error evaluating the gradient";
+    std::fill_n(&g[0], n, NA_REAL);
+    return 1;
+  }
+  nlmixr2GradErr.clear();
+  return 0;
+}
+
 //' @rdname nlmixr2GradFun
 //' @export
 //[[Rcpp::export]]
@@ -4404,6 +5886,10 @@ RObject nlmixr2ParHist_(std::string md5){
   }
   std::string cns = md5 + ".n";
   gradInfo[cns] = 0;
+  std::map<std::string, nlmixr2GradState_t>::iterator it = nlmixr2GradStates.find(md5);
+  if (it != nlmixr2GradStates.end()) {
+    it->second.n = 0;
+  }
   parHistData(gradInfo, false);
   return gradInfo["parHistData"];
 }
@@ -4531,30 +6017,49 @@ int foceiCalcR(Environment e){
       fnscale = op_focei.initObjective / op_focei.scaleObjectiveTo;
     }
     double parScaleI=1.0, parScaleJ=1.0;
+    if (gradPreStart(theta.begin(), false)) {
+      // Queue every Hessian point and solve them together
+      for (i=op_focei.npars; i--;){
+        epsI = (std::fabs(theta[i])*op_focei.rEpsC[i] + op_focei.aEpsC[i]);
+        ti = theta[i];
+        gradPreAdd(i, ti + 2*epsI);
+        gradPreAdd(i, ti + epsI);
+        gradPreAdd(i, ti - epsI);
+        gradPreAdd(i, ti - 2*epsI);
+        for (j = i; j--;){
+          epsJ = (std::fabs(theta[j])*op_focei.rEpsC[j] + op_focei.aEpsC[j]);
+          tj = theta[j];
+          gradPreAdd2(i, ti + epsI, j, tj + epsJ);
+          gradPreAdd2(i, ti + epsI, j, tj - epsJ);
+          gradPreAdd2(i, ti - epsI, j, tj + epsJ);
+          gradPreAdd2(i, ti - epsI, j, tj - epsJ);
+        }
+      }
+    }
     for (i=op_focei.npars; i--;){
       epsI = (std::fabs(theta[i])*op_focei.rEpsC[i] + op_focei.aEpsC[i]);
       ti = theta[i];
       theta[i] = ti + 2*epsI;
       updateTheta(theta.begin());
-      f1 = foceiOfv0(theta.begin());
+      f1 = foceiOfvGrad(theta.begin());
       if (ISNA(f1)) return 0;
       op_focei.cur++;
       op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
       theta[i] = ti + epsI;
       updateTheta(theta.begin());
-      f2 = foceiOfv0(theta.begin());
+      f2 = foceiOfvGrad(theta.begin());
       if (ISNA(f2)) return 0;
       op_focei.cur++;
       op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
       theta[i] = ti - epsI;
       updateTheta(theta.begin());
-      f3 = foceiOfv0(theta.begin());
+      f3 = foceiOfvGrad(theta.begin());
       if (ISNA(f3)) return 0;
       op_focei.cur++;
       op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
       theta[i] = ti - 2*epsI;
       updateTheta(theta.begin());
-      f4 = foceiOfv0(theta.begin());
+      f4 = foceiOfvGrad(theta.begin());
       if (ISNA(f4)) return 0;
       op_focei.cur++;
       op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
@@ -4571,28 +6076,28 @@ int foceiCalcR(Environment e){
         theta[i] = ti + epsI;
         theta[j] = tj + epsJ;
         updateTheta(theta.begin());
-        f1 = foceiOfv0(theta.begin());
+        f1 = foceiOfvGrad(theta.begin());
         if (ISNA(f1)) return 0;
         op_focei.cur++;
         op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
         theta[i] = ti + epsI;
         theta[j] = tj - epsJ;
         updateTheta(theta.begin());
-        f2 = foceiOfv0(theta.begin());
+        f2 = foceiOfvGrad(theta.begin());
         if (ISNA(f2)) return 0;
         op_focei.cur++;
         op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
         theta[i] = ti - epsI;
         theta[j] = tj + epsJ;
         updateTheta(theta.begin());
-        f3 = foceiOfv0(theta.begin());
+        f3 = foceiOfvGrad(theta.begin());
         if (ISNA(f3)) return 0;
         op_focei.cur++;
         op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
         theta[i] = ti - epsI;
         theta[j] = tj - epsJ;
         updateTheta(theta.begin());
-        f4 = foceiOfv0(theta.begin());
+        f4 = foceiOfvGrad(theta.begin());
         if (ISNA(f4)) return 0;
         op_focei.cur++;
         op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
@@ -4605,6 +6110,8 @@ int foceiCalcR(Environment e){
       }
     }
   }
+  // The S matrix can reuse the central difference points
+  gradPreClear();
   // R matrix = Hessian/2
   H = H*0.5;
   // https://github.com/cran/nmw/blob/59478fcc91f368bb3bbc23e55d8d1d5d53726a4b/R/CovStep.R
@@ -4641,6 +6148,22 @@ int foceiCalcR(Environment e){
 }
 
 // Necessary for S-matrix calculation
+static inline double foceiSdelta(double *theta, int cpar, bool doForward) {
+  if (op_focei.smatNorm){
+    if (doForward){
+      return (std::fabs(theta[cpar])*op_focei.rEps[cpar] + op_focei.aEps[cpar])/_safe_sqrt(1+std::fabs(min2(op_focei.initObjective, op_focei.lastOfv)));
+    } else {
+      return (std::fabs(theta[cpar])*op_focei.rEpsC[cpar] + op_focei.aEpsC[cpar])/_safe_sqrt(1+std::fabs(min2(op_focei.initObjective, op_focei.lastOfv)));
+    }
+  } else {
+    if (doForward){
+      return std::fabs(theta[cpar])*op_focei.rEps[cpar] + op_focei.aEps[cpar];
+    } else {
+      return std::fabs(theta[cpar])*op_focei.rEpsC[cpar] + op_focei.aEpsC[cpar];
+    }
+  }
+}
+
 int foceiS(double *theta, Environment e){
   rx = getRx();
   op_focei.calcGrad=1;
@@ -4668,20 +6191,43 @@ int foceiS(double *theta, Environment e){
       }
     }
   }
+  // With more than one core, the perturbations are solved together
+  bool usePre = gradPreStart(theta, true);
+  if (usePre) {
+    for (cpar = npars; cpar--;){
+      delta = foceiSdelta(theta, cpar, doForward);
+      gradPreAdd(cpar, theta[cpar] + delta);
+      if (!doForward) gradPreAdd(cpar, theta[cpar] - delta);
+    }
+  }
   for (cpar = npars; cpar--;){
-    if (op_focei.smatNorm){
-      if (doForward){
-        delta = (std::fabs(theta[cpar])*op_focei.rEps[cpar] + op_focei.aEps[cpar])/_safe_sqrt(1+std::fabs(min2(op_focei.initObjective, op_focei.lastOfv)));
-      } else {
-        delta = (std::fabs(theta[cpar])*op_focei.rEpsC[cpar] + op_focei.aEpsC[cpar])/_safe_sqrt(1+std::fabs(min2(op_focei.initObjective, op_focei.lastOfv)));
+    if (usePre) {
+      delta = foceiSdelta(theta, cpar, doForward);
+      cur = theta[cpar];
+      theta[cpar] = cur + delta;
+      int pu = gradPreTake(theta), pl = -1;
+      if (!doForward && pu >= 0) {
+        theta[cpar] = cur - delta;
+        pl = gradPreTake(theta);
       }
-    } else {
-      if (doForward){
-        delta = std::fabs(theta[cpar])*op_focei.rEps[cpar] + op_focei.aEps[cpar];
-      } else {
-        delta = std::fabs(theta[cpar])*op_focei.rEpsC[cpar] + op_focei.aEpsC[cpar];
+      theta[cpar] = cur;
+      if (pu >= 0 && (doForward || pl >= 0)) {
+        double *likU = &gradPreLik[gradPre[pu].lik];
+        double *likL = doForward ? NULL : &gradPreLik[gradPre[pl].lik];
+        for (gid = rx->nsub; gid--;){
+          fInd = &(inds_focei[gid]);
+          if (doForward){
+            fInd->thetaGrad[cpar] = (-2*likU[gid] - op_focei.likSav[gid])/delta;
+          } else {
+            fInd->thetaGrad[cpar] = (-2*likU[gid] + 2*likL[gid])/(2*delta);
+          }
+        }
+        op_focei.cur++;
+        op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
+        continue;
       }
     }
+    delta = foceiSdelta(theta, cpar, doForward);
     if (op_focei.neta != 0) std::fill_n(&op_focei.goldEta[0], op_focei.gEtaGTransN, -42.0); // All etas = -42;  Unlikely if normal
     cur = theta[cpar];
     theta[cpar] = cur + delta;
@@ -4708,13 +6254,21 @@ int foceiS(double *theta, Environment e){
     op_focei.curTick = par_progress(op_focei.cur, op_focei.totTick, op_focei.curTick, 1, op_focei.t0, 0);
   }
   op_focei.calcGrad=0;
-  // Now calculate S matrix
+  if (usePre) {
+    gradPreClear();
+    updateTheta(theta);
+  }
+  // Now calculate S matrix; the rows of fit$score are each subject's
+  // gradient of the log-likelihood (-thetaGrad/2), so S = crossprod(score)
   arma::mat m1(1, op_focei.npars), S(op_focei.npars, op_focei.npars, fill::zeros), s1(1, op_focei.npars,fill::ones);
+  arma::mat score(rx->nsub, op_focei.npars);
   for (gid = rx->nsub; gid--;){
     fInd = &(inds_focei[gid]);
     std::copy(&fInd->thetaGrad[0],&fInd->thetaGrad[0]+op_focei.npars,&m1[0]);
     S = S + m1.t() * m1;
+    score.row(gid) = -0.5*m1;
   }
+  e["score"] = wrap(score);
   // S matrix = S/4
   // According to https://github.com/cran/nmw/blob/59478fcc91f368bb3bbc23e55d8d1d5d53726a4b/R/Objs.R
   S=S*0.25;
@@ -5219,7 +6773,7 @@ NumericMatrix foceiCalcCov(Environment e){
 }
 
 void parHistData(Environment e, bool focei){
-  if (!e.exists("method") && iterType.size() > 0) {
+  if (!e.exists("method") && foceiHist.par.n > 0) {
     CharacterVector thetaNames=as<CharacterVector>(e["thetaNames"]);
     CharacterVector dfNames;
     if (focei){
@@ -5254,52 +6808,22 @@ void parHistData(Environment e, bool focei){
     } else {
       ret = List(3+thetaNames.size());
     }
-    int sz = niter.size()+niterGrad.size();
+    int sz = parHistRows(foceiHist);
     IntegerVector tmp;
-    std::vector<int> iter;
-    iter.reserve(sz);
-    iter.insert(iter.end(), niter.begin(), niter.end());
-    iter.insert(iter.end(), niterGrad.begin(), niterGrad.end());
-    ret[0] = iter;
-    tmp = IntegerVector(sz);
-    std::vector<int> typ;
-    typ.reserve(sz);
-    typ.insert(typ.end(), iterType.begin(), iterType.end());
-    typ.insert(typ.end(), gradType.begin(), gradType.end());
-    tmp = typ;
+    ret[0] = parHistIter(foceiHist, false);
+    tmp = parHistIter(foceiHist, true);
     tmp.attr("levels") = CharacterVector::create("Gill83 Gradient", "Mixed Gradient",
                                                  "Forward Difference", "Central Difference",
-                                                 "Scaled", "Unscaled", "Back-Transformed");
+                                                 "Scaled", "Unscaled", "Back-Transformed",
+                                                 "Mu-referenced Gradient");
     tmp.attr("class") = "factor";
     ret[1] = tmp;
-    arma::mat cPar(vPar.size()/iterType.size(), iterType.size());
-    std::copy(vPar.begin(), vPar.end(), cPar.begin());
-    arma::mat vals;
-    if (vGrad.size() > 0){
-      arma::mat cGrad(vGrad.size()/gradType.size(), gradType.size());
-      std::copy(vGrad.begin(), vGrad.end(), cGrad.begin());
-      cPar = cPar.t();
-      cGrad = cGrad.t();
-      vals = arma::join_cols(cPar, cGrad);
-    } else {
-      cPar = cPar.t();
-      vals = cPar;
-    }
-    if (focei){
-      for (i = 0; i < min2(op_focei.npars+1, vals.n_cols); i++){
-        ret[i+2]= vals.col(i);
-      }
-    } else {
-      for (i = 0; i < thetaNames.size()+1; i++){
-        ret[i+2]= vals.col(i);
-      }
+    int ncol = focei ? op_focei.npars+1 : thetaNames.size()+1;
+    if (focei) ncol = min2(ncol, foceiHist.par.ncol);
+    for (i = 0; i < ncol; i++){
+      ret[i+2] = parHistCol(foceiHist, i);
     }
-    vGrad.clear();
-    vPar.clear();
-    iterType.clear();
-    gradType.clear();
-    niter.clear();
-    niterGrad.clear();
+    parHistClear(foceiHist);
     ret.attr("names")=dfNames;
     ret.attr("class") = "data.frame";
     ret.attr("row.names")=IntegerVector::create(NA_INTEGER, -sz);
@@ -5664,6 +7188,15 @@ void foceiFinalizeTables(Environment e){
       tmpNM.attr("dimnames") = thetaDim;
       e["S"]=tmpNM;
     }
+    if (e.exists("score") && rxode2::rxIs(e["score"], "matrix")){
+      tmpNM = as<NumericMatrix>(e["score"]);
+      if (tmpNM.ncol() == thetaCovN.size()) {
+        SEXP idLvl = e.exists("idLvl") ? as<SEXP>(e["idLvl"]) : R_NilValue;
+        tmpNM.attr("dimnames") = List::create(TYPEOF(idLvl) == STRSXP ? idLvl : R_NilValue,
+                                              thetaCovN);
+        e["score"]=tmpNM;
+      }
+    }
     if (e.exists("R") && rxode2::rxIs(e["R"], "matrix")){
       tmpNM = as<NumericMatrix>(e["R"]);
       tmpNM.attr("dimnames") = thetaDim;
@@ -5946,7 +7479,8 @@ Environment foceiFitCpp_(Environment e){
     }
   }
   std::string tmpS;
-  if (op_focei.maxOuterIterations > 0 && op_focei.printTop == 1 && op_focei.printOuter != 0){
+  if (op_focei.maxOuterIterations > 0 && op_focei.printTop == 1 && op_focei.printOuter != 0 &&
+      op_focei.printSummary <= 0){
     if (op_focei.useColor)
       RSprintf("\033[1mKey:\033[0m ");
     else
@@ -6073,8 +7607,12 @@ Environment foceiFitCpp_(Environment e){
   gillRet.attr("levels") = gillLvl;
   gillRet.attr("class") = "factor";
   e["gillRet"] = gillRet;
+  if (op_focei.neta != 0) e["etaHess"] = foceiEtaHess();
+  foceiCkptOn = false;
   t0 = clock();
+  double tCov = profNow();
   foceiCalcCov(e);
+  profAdd(&(foceiProf.cov), tCov);
   if (op_focei.didPredSolve) {
     warning(_("numerical difficulties solving forward sensitivity inner problem, tried approximating with more inaccurate numeric differences"));
   }
@@ -6101,6 +7639,11 @@ Environment foceiFitCpp_(Environment e){
   timeDf.attr("class") = "data.frame";
   timeDf.attr("row.names") = "";
   e["time"] = timeDf;
+  e["etaCache"] = etaCacheStats();
+  e["bufferSize"] = foceiBufferSize();
+  e["profile"] = foceiProfTable(e.exists("idLvl") ? as<SEXP>(e["idLvl"]) : R_NilValue);
+  foceiSchedUpdate();
+  e["subjectCost"] = foceiSchedTable(e.exists("idLvl") ? as<SEXP>(e["idLvl"]) : R_NilValue);
   List scaleInfo = List::create(as<NumericVector>(e["fullTheta"]),
                                 as<NumericVector>(e["scaleC"]), gillRet,
                                 gillAEps,
@@ -6118,6 +7661,30 @@ Environment foceiFitCpp_(Environment e){
   scaleInfo.attr("class") = "data.frame";
   scaleInfo.attr("row.names") = IntegerVector::create(NA_INTEGER,-gillRet.size());
   e["scaleInfo"] = scaleInfo;
+  // Step sizes for later fits (foceiControl(gillCache=)); only the
+  // parameters with a good Gill interval are kept
+  {
+    int nfull = op_focei.ntheta+op_focei.omegan;
+    NumericVector stAEps(nfull, NA_REAL), stREps(nfull, NA_REAL),
+      stAEpsC(nfull, NA_REAL), stREpsC(nfull, NA_REAL);
+    for (int k = op_focei.npars; k--;) {
+      int jf = op_focei.fixedTrans[k];
+      if (jf < nfull && op_focei.didGill && op_focei.gillRet[k] == 1) {
+        stAEps[jf]  = op_focei.aEps[k];
+        stREps[jf]  = op_focei.rEps[k];
+        stAEpsC[jf] = op_focei.aEpsC[k];
+        stREpsC[jf] = op_focei.rEpsC[k];
+      }
+    }
+    List gillSteps = List::create(_["aEps"]=stAEps, _["rEps"]=stREps,
+                                  _["aEpsC"]=stAEpsC, _["rEpsC"]=stREpsC,
+                                  _["scaleC"]=as<NumericVector>(e["scaleC"]));
+    gillSteps.attr("class") = "data.frame";
+    gillSteps.attr("row.names") = IntegerVector::create(NA_INTEGER,-nfull);
+    e["gillSteps"] = gillSteps;
+    e["gillCache"] = NumericVector::create(_["reused"]=gillSeedN[0],
+                                           _["rejected"]=gillSeedN[1]);
+  }
   if (warnGillC && warnGill){
     warning(_("gradient problems with initial estimate and covariance; see $scaleInfo"));
   } else if (warnGill){
@@ -6148,17 +7715,13 @@ Environment foceiFitCpp_(Environment e){
 //[[Rcpp::export]]
 NumericVector boxCox_(NumericVector x = 1, double lambda=1, int yj = 0){
   NumericVector ret(x.size());
-  for (unsigned int i = x.size(); i--;){
-    ret[i] = _powerD(x[i], lambda, yj, 0.0, 1.0);
-  }
+  tbsD(ret.begin(), x.begin(), x.size(), lambda, yj, 0.0, 1.0);
   return ret;
 }
 
 //[[Rcpp::export]]
 NumericVector iBoxCox_(NumericVector x = 1, double lambda=1, int yj = 0){
   NumericVector ret(x.size());
-  for (unsigned int i = x.size(); i--;){
-    ret[i] = _powerDi(x[i], lambda, yj, 0.0, 1.0);
-  }
+  tbsDi(ret.begin(), x.begin(), x.size(), lambda, yj, 0.0, 1.0);
   return ret;
 }
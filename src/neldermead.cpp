@@ -21,14 +21,39 @@
 #include <cstdlib>
 #include <math.h>
 #include <R.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#define __nlmixr2est_optim_internal__
+#include "../inst/include/nlmixr2est_optim.h"
 
 typedef void (*fn_ptr) (double *, double *);
-#define MXPAR  45
 
-extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
-			  int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
-			  int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
-			  int *iprint)
+// Size (in doubles) of the workspace needed by nelder_fn2()
+extern "C" int nelder_work_size(int n) {
+  return (n+1)*(n+1) + 3*n;
+}
+
+// Evaluate the objective at the ncol columns of p; the vertices are
+// independent so they are evaluated on cores threads (the objective
+// then needs to be thread safe)
+static inline void nelderEvalCols(nmfn_ex_t func, void *ex, double *p, double *y,
+                                  int n, int ncol, int cores) {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cores) if(cores > 1)
+#endif
+  for (int j = 0; j < ncol; ++j) {
+    (*func)(p + j*n, y + j, ex);
+  }
+}
+
+// Reentrant Nelder-Mead.  The objective gets the context pointer ex,
+// work has nelder_work_size(n) doubles and the initial simplex and
+// the shrink steps are evaluated on cores threads.
+extern "C" void nelder_fn2(nmfn_ex_t func, void *ex, int n, double *start, double *step,
+                           int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
+                           int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
+                           int *iprint, double *work, int cores)
 {
   double fval;
   int i, j, k;
@@ -38,28 +63,23 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
   double ystar, xlo, xhi, y2star, bignum;
   double ylo, dchk, z, dn, dabit, yoldlo=0;
 
-  //FIXME: check malloc status
-  p = (double *) R_Calloc(n*(n+1),double);
-  pstar = (double *) R_Calloc(n,double);
-  p2star = (double *) R_Calloc(n,double);
-  pbar = (double *) R_Calloc(n,double);
-  y = (double *) R_Calloc((n+1),double);
-
   kcount = 1000000;
   *nfcall = 0;
   *it = 0;
   *iconv = 0;
 
   /* check inputs */
-  if (n <= 0 || n > MXPAR) *nfcall += -10;
-  if (*nfcall < 0){
-    R_Free(p);
-    R_Free(pstar);
-    R_Free(p2star);
-    R_Free(pbar);
-    R_Free(y);
+  if (n <= 0 || work == NULL) {
+    *nfcall += -10;
     return;
   }
+  if (cores < 1) cores = 1;
+
+  p = work;
+  y = p + n*(n+1);
+  pstar = y + (n+1);
+  p2star = pstar + n;
+  pbar = p2star + n;
 
   /* constants */
   dabit = 2.2204460492503131e-16;
@@ -72,7 +92,7 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
   for (i = 0; i < n; ++i)
     p[i+n*n] = start[i];
 
-  (*func)(start, &fval);
+  (*func)(start, &fval, ex);
   y[n] = fval;
   ++(*nfcall);
 
@@ -81,25 +101,16 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
       xmin[i] = start[i];
 
     *ynewlo = fval;
-    
-    R_Free(p);
-    R_Free(pstar);
-    R_Free(p2star);
-    R_Free(pbar);
-    R_Free(y);
     return;
   }
   else {
     for (j = 0; j < n; ++j) {
-      dchk = start[j];
-      start[j] = dchk + step[j];
       for (i = 0; i < n; ++i)
         p[i+j*n] = start[i];
-      (*func)(start, &fval);
-      y[j] = fval;
-      ++(*nfcall);
-      start[j] = dchk;
+      p[j+j*n] += step[j];
     }
+    nelderEvalCols(func, ex, p, y, n, n, cores);
+    *nfcall += n;
   }
 
   /* hi/lo values */
@@ -187,7 +198,7 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
     /* reflection */
     for (i = 0; i < n; ++i)
       pstar[i] = pbar[i] + rcoef*(pbar[i] - p[i+ihi*n]);
-    (*func)(pstar, &fval);
+    (*func)(pstar, &fval, ex);
     ystar = fval;
     ++(*nfcall);
 
@@ -195,7 +206,7 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
       if (*nfcall < kcount) {
         for (i = 0; i < n; ++i)
           p2star[i] = pbar[i] + ecoef*(pstar[i] - pbar[i]);
-        (*func)(p2star, &fval);
+        (*func)(p2star, &fval, ex);
         y2star = fval;
         ++(*nfcall);
 
@@ -242,7 +253,7 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
     if (*nfcall >= kcount) break;
     for (i = 0; i < n; ++i)
       p2star[i] = pbar[i] + ccoef*(p[i+ihi*n] - pbar[i]);
-    (*func)(p2star, &fval);
+    (*func)(p2star, &fval, ex);
     y2star = fval;
     ++(*nfcall);
 
@@ -253,14 +264,13 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
       continue;
     }
 
+    /* shrink towards the best vertex */
     for (j = 0; j < nn; ++j) {
       for (i = 0; i < n; ++i) {
         p[i+j*n] = (p[i+j*n] + p[i+ilo*n])*.5;
-        xmin[i] = p[i+j*n];
       }
-      (*func)(xmin, &fval);
-      y[j] = fval;
     }
+    nelderEvalCols(func, ex, p, y, n, nn, cores);
     *nfcall += nn;
 
     if (*nfcall >= kcount) break;
@@ -268,12 +278,7 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
   }
 
   /* get optimum & optima */
-  for (j = 0; j < nn; ++j) {
-    for (i = 0; i < n; ++i)
-      xmin[i] = p[i+j*n];
-    (*func)(xmin, &fval);
-    y[j] = fval;
-  }
+  nelderEvalCols(func, ex, p, y, n, nn, cores);
   *nfcall += nn;
 
   *ynewlo = bignum;
@@ -285,12 +290,35 @@ extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
   }
   for (i = 0; i < n; ++i)
     xmin[i] = p[i+ibest*n];
-  
-  R_Free(p);
-  R_Free(pstar);
-  R_Free(p2star);
-  R_Free(pbar);
-  R_Free(y);
-  
+
   return;
 }
+
+typedef struct {
+  fn_ptr fn;
+} nelderFn_t;
+
+static void nelderFnWrap(double *x, double *fx, void *ex) {
+  (*(((nelderFn_t*)ex)->fn))(x, fx);
+}
+
+// Serial version with a bare objective; the workspace is allocated
+// for each call
+extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
+			  int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
+			  int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
+			  int *iprint)
+{
+  if (n <= 0) {
+    *nfcall = -10;
+    *it = 0;
+    *iconv = 0;
+    return;
+  }
+  nelderFn_t ex;
+  ex.fn = func;
+  double *work = (double *) R_Calloc(nelder_work_size(n), double);
+  nelder_fn2(nelderFnWrap, &ex, n, start, step, itmax, ftol_rel, rcoef, ecoef, ccoef,
+             iconv, it, nfcall, ynewlo, xmin, iprint, work, 1);
+  R_Free(work);
+}
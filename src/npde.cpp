@@ -1,5 +1,6 @@
 #define STRICT_R_HEADER
 #include "npde.h"
+#include "tbs.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -180,7 +181,6 @@ static inline void handleNpdeNAandCalculateEpred(calcNpdeInfoId& ret, unsigned i
 static inline void calculatePD(calcNpdeInfoId& ret, unsigned int& id, unsigned int &K, double &tolChol) {
   ret.ydsim = ret.matsim.rows(ret.obs);
   ret.varsim = cov(trans(ret.ydsim));
-  Rcpp::wrap(wrap(ret.varsim));
   ret.ymat = decorrelateNpdeMat(ret.varsim, ret.warn, id, tolChol); // pd= npd
   ret.ymat2 = varNpdMat(ret.varsim); // pd2 = pd
   arma::mat ymatt = trans(ret.ymat);
@@ -279,13 +279,19 @@ calcNpdeInfoId calcNpdeId(arma::ivec& idLoc, arma::vec &sim,
   ret.epred = arma::vec(ret.yobst.size());
   ret.yobs = arma::vec(ret.yobst.size());
   ret.eres = arma::vec(ret.yobst.size());
+  if (censMethod == CENS_EPRED) {
+    for (unsigned int j = ret.yobst.size(); j--; ) {
+      if (cens[j] != 0) ret.yobst[j] = ret.epredt[j];
+    }
+  }
+  // Transfer back to original scale ie log(x) -> exp(log(x)); the
+  // transformation of this id starts at idLoc[id]
+  unsigned int off = idLoc[id];
+  tbsDvD(ret.epred.memptr(), ret.epredt.memptr(), ret.epred.size(), lambda.memptr() + off,
+         yj.memptr() + off, low.memptr() + off, hi.memptr() + off, 1);
+  tbsDvD(ret.yobs.memptr(), ret.yobst.memptr(), ret.yobs.size(), lambda.memptr() + off,
+         yj.memptr() + off, low.memptr() + off, hi.memptr() + off, 1);
   for (unsigned int j = ret.yobst.size(); j--; ) {
-    // Transfer back to original scale ie log(x) -> exp(log(x))
-    ret.epred[j] = _powerDi(ret.epredt[j], lambda[j], (int) yj[j], low[j], hi[j]);
-    if (censMethod == CENS_EPRED && cens[j] != 0) {
-      ret.yobst[j] = ret.epredt[j];
-    } 
-    ret.yobs[j] = _powerDi(ret.yobst[j], lambda[j], (int) yj[j], low[j], hi[j]);
     ret.eres[j] = ret.yobs[j] - ret.epred[j];
     if (censMethod == CENS_OMIT && cens[j] != 0) {
       ret.yobs[j] = NA_REAL;
@@ -305,136 +311,14 @@ calcNpdeInfoId calcNpdeId(arma::ivec& idLoc, arma::vec &sim,
 
 rxGetId2_t rxGetId2;
 
-extern "C" SEXP _nlmixr2est_npdeCalc(SEXP npdeSim, SEXP dvIn, SEXP evidIn, SEXP censIn, SEXP limitIn, SEXP npdeOpt) {
-  BEGIN_RCPP
-    rxGetId2 = (rxGetId2_t) R_GetCCallable("rxode2", "rxGetId");
-  if (TYPEOF(npdeSim) != VECSXP) {
-    Rf_errorcall(R_NilValue, "npdeSim needs to be a data.frame");
-  }
-  List opt = as<List>(npdeOpt);
-  double tolChol = 6.055454e-06;
-  if (opt.containsElementNamed("tolChol")) {
-    RObject tmp = opt["tolChol"];
-    if (TYPEOF(tmp) == REALSXP) {
-      tolChol = as<double>(tmp);
-    }
-  }
-  bool ties = false;
-  if (opt.containsElementNamed("ties")) {
-    RObject tmp = opt["ties"];
-    if (TYPEOF(tmp) == LGLSXP) {
-      ties = as<bool>(tmp);
-    }
-  }
-  int censMethod = CENS_TNORM;
-  if (opt.containsElementNamed("censMethod")) {
-    RObject tmp = opt["censMethod"];
-    if (TYPEOF(tmp) == INTSXP) {
-      censMethod = as<unsigned int>(tmp);
-    }
-  }
-
-  List npdeSimL = as<List>(npdeSim);
-  int nsim = getPredIndex(npdeSimL);
-
-  int dvLen = Rf_length(dvIn);
-  arma::vec dv  = arma::vec(REAL(dvIn), dvLen, false, true);
-  //arma::vec npde(REAL(npdeSEXP), dv.size(), false, true);
-  int pro = 0;
-  SEXP s0 = PROTECT(VECTOR_ELT(npdeSim, 0)); pro++;
-  int simLen = Rf_length(s0);
-  arma::ivec aSimIdVec(INTEGER(s0), simLen, false, true);
-  arma::ivec aIdVec(INTEGER(VECTOR_ELT(npdeSim, 1)), simLen, false, true);
-  unsigned int nid, K;
-  arma::ivec idLoc = getSimIdLoc(aIdVec, aSimIdVec, nid, K);
-  arma::vec sim(REAL(VECTOR_ELT(npdeSim, nsim)), simLen, false, true);
-  arma::vec lambda(REAL(VECTOR_ELT(npdeSim, nsim+1)), simLen, false, true);
-  arma::vec yj(REAL(VECTOR_ELT(npdeSim, nsim+2)), simLen, false, true);
-  arma::vec low(REAL(VECTOR_ELT(npdeSim, nsim+3)), simLen, false, true);
-  arma::vec hi(REAL(VECTOR_ELT(npdeSim, nsim+4)), simLen, false, true);
-  arma::vec dvt(dvLen);
-  // dv -> dv transform
-  for (unsigned int i = dvLen; i--; ) {
-    // powerDi for log-normal transfers dv = log(dv)
-    dvt[i] = _powerD(dv[i], lambda[i], (int) yj[i], low[i], hi[i]);
-  }
-  // sim -> sim transform; simulation is on untransformed scale
-  for (unsigned int i = simLen; i--;) {
-    sim[i] = _powerD(sim[i], lambda[i], (int) yj[i], low[i], hi[i]);
-  }
-  arma::ivec cens;
-  if (Rf_isNull(censIn)) {
-    cens = arma::ivec(dvLen, fill::zeros);
-  } else {
-    cens = as<arma::ivec>(censIn);
-  }
-  arma::ivec evid;
-  if (Rf_isNull(evidIn)) {
-    evid = arma::ivec(dvLen, fill::zeros);
-  } else {
-    evid = as<arma::ivec>(evidIn);
-  }
-  bool doLimit = false;
-
-  arma::vec limit;
-  int hasLimit=0;
-  getLimitFromInput(limitIn, dvLen, limit, hasLimit);
-
-  if (hasLimit && censMethod == CENS_CDF) {
-    for (unsigned int i = 0; i < cens.size(); ++i) {
-      switch(cens[i]){
-      case 1:
-        if (R_FINITE(limit[i])) {
-          warning("limits are ignored for npde back-transformation with 'cdf' method");
-          i= cens.size();
-        }
-        break;
-      case -1:
-        if (R_FINITE(limit[i])) {
-          warning("limits are ignored for npde back-transformation with 'cdf' method");
-          i= cens.size();
-        }
-        break;
-      case 0:
-        break;
-      }
-    }
-  }
-
-  arma::vec ru = randu(simLen); // Pre-fill uniform random numbers to make sure independent
-  arma::vec ru2 = randu(simLen);
-  arma::vec ru3 = randu(simLen);
-
-  SEXP npdeSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
-  SEXP npdSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
-  SEXP pdeSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
-  SEXP pdSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
-  SEXP epredSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
-  SEXP dvSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
-  SEXP eresSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
-  arma::vec npde(REAL(npdeSEXP), dvLen, false, true);
-  arma::vec npd(REAL(npdSEXP), dvLen, false, true);
-  arma::vec pde(REAL(pdeSEXP), dvLen, false, true);
-  arma::vec pd(REAL(pdSEXP), dvLen, false, true);
-  arma::vec epred(REAL(epredSEXP), dvLen, false, true);
-  arma::vec dvf(REAL(dvSEXP), dvLen, false, true);
-  arma::vec eres(REAL(eresSEXP), dvLen, false, true);
-  arma::ivec warn(idLoc.size()-1);
-
-  int cores = as<int>(opt["cores"]);
+// Label of the id for the decorrelation warnings; when the labels are
+// not supplied they come from the last rxode2 solve
+static inline const char *npdeWarnId(SEXP ids, unsigned int id) {
+  if (Rf_isNull(ids)) return rxGetId2(id);
+  return CHAR(STRING_ELT(ids, id));
+}
 
-  for (unsigned int curid = 0; curid < idLoc.size()-1; ++curid) {
-    calcNpdeInfoId idInfo = calcNpdeId(idLoc, sim, dvt, evid, cens, limit, censMethod, doLimit, curid, K, tolChol, ties, ru, ru2, ru3,
-                                       lambda, yj, hi, low);
-    npde(span(idLoc[curid],idLoc[curid+1]-1)) = idInfo.npde;
-    npd(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.npd;
-    pde(span(idLoc[curid],idLoc[curid+1]-1)) = idInfo.pd;
-    pd(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.pd2;
-    epred(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.epred;
-    dvf(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.yobs;
-    eres(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.eres;
-    warn[curid] = idInfo.warn;
-  }
+static inline void npdeWarn(arma::ivec &warn, SEXP ids) {
   std::string sCholPinv = "";
   int nCholPinv = 0;
   std::string sEigen = "";
@@ -450,50 +334,50 @@ extern "C" SEXP _nlmixr2est_npdeCalc(SEXP npdeSim, SEXP dvIn, SEXP evidIn, SEXP
   for (unsigned int curid = 0; curid < warn.size(); ++curid) {
     switch(warn[curid]) {
     case NPDE_CHOL_PINV:
-      if (sCholPinv == "") sCholPinv = rxGetId2(curid);
+      if (sCholPinv == "") sCholPinv = npdeWarnId(ids, curid);
       else {
         sCholPinv += ", ";
-        sCholPinv += rxGetId2(curid);
+        sCholPinv += npdeWarnId(ids, curid);
       }
       nCholPinv++;
       break;
     case NPDE_DECORRELATE_EIGEN:
-      if (sEigen == "") sEigen = rxGetId2(curid);
+      if (sEigen == "") sEigen = npdeWarnId(ids, curid);
       else {
         sEigen += ", ";
-        sEigen += rxGetId2(curid);
+        sEigen += npdeWarnId(ids, curid);
       }
       nEigen++;
       break;
     case NPDE_DECORRELATE_EIGEN_PINV:
-      if (sEigenPinv == "")  sEigenPinv =  rxGetId2(curid);
+      if (sEigenPinv == "")  sEigenPinv =  npdeWarnId(ids, curid);
       else {
         sEigenPinv += ", ";
-        sEigenPinv += rxGetId2(curid);
+        sEigenPinv += npdeWarnId(ids, curid);
       }
       nEigenPinv++;
       break;
     case NPDE_CHOLSE:
-      if (sCholSE == "") sCholSE = rxGetId2(curid);
+      if (sCholSE == "") sCholSE = npdeWarnId(ids, curid);
       else {
         sCholSE += ", ";
-        sCholSE += rxGetId2(curid);
+        sCholSE += npdeWarnId(ids, curid);
       }
       nCholSE++;
       break;
     case NPDE_CHOLSE_PINV:
-      if (sCholSEPinv == "") sCholSEPinv = rxGetId2(curid);
+      if (sCholSEPinv == "") sCholSEPinv = npdeWarnId(ids, curid);
       else {
         sCholSEPinv += ", ";
-        sCholSEPinv += rxGetId2(curid);
+        sCholSEPinv += npdeWarnId(ids, curid);
       }
       nCholSEPinv++;
       break;
     case NPDE_NPD:
-      if (sPD == "") sPD = rxGetId2(curid);
+      if (sPD == "") sPD = npdeWarnId(ids, curid);
       else {
         sPD += ", ";
-        sPD += rxGetId2(curid);
+        sPD += npdeWarnId(ids, curid);
       }
       nPD++;
       break;
@@ -523,7 +407,161 @@ extern "C" SEXP _nlmixr2est_npdeCalc(SEXP npdeSim, SEXP dvIn, SEXP evidIn, SEXP
   if (sPD != "") {
     Rf_warningcall(R_NilValue, _("npde decorrelation failed (return normalized prediction discrepancies) for %.1f%% id: %s"), rPD*100, sPD.c_str());
   }
-  
+}
+
+extern "C" SEXP _nlmixr2est_npdeWarn(SEXP warnIn, SEXP idsIn) {
+  BEGIN_RCPP
+  rxGetId2 = (rxGetId2_t) R_GetCCallable("rxode2", "rxGetId");
+  arma::ivec warn = as<arma::ivec>(warnIn);
+  npdeWarn(warn, idsIn);
+  return R_NilValue;
+  END_RCPP
+}
+
+extern "C" SEXP _nlmixr2est_npdeCalc(SEXP npdeSim, SEXP dvIn, SEXP evidIn, SEXP censIn, SEXP limitIn, SEXP npdeOpt) {
+  BEGIN_RCPP
+    rxGetId2 = (rxGetId2_t) R_GetCCallable("rxode2", "rxGetId");
+  if (TYPEOF(npdeSim) != VECSXP) {
+    Rf_errorcall(R_NilValue, "npdeSim needs to be a data.frame");
+  }
+  List opt = as<List>(npdeOpt);
+  resOpt_t ropt = getResOpt(opt);
+  double tolChol = ropt.tolChol;
+  bool ties = ropt.ties;
+  // When requested, return the decorrelation codes of each id instead
+  // of warning (used when the npde are calculated in chunks of ids)
+  bool warnCodes = ropt.warnCodes;
+  int censMethod = ropt.censMethod;
+
+  List npdeSimL = as<List>(npdeSim);
+  int nsim = getPredIndex(npdeSimL);
+
+  int dvLen = Rf_length(dvIn);
+  resObs_t obs(dvIn, evidIn, censIn, limitIn, dvLen);
+  arma::vec &dv = obs.dv;
+  //arma::vec npde(REAL(npdeSEXP), dv.size(), false, true);
+  int pro = 0;
+  SEXP s0 = PROTECT(VECTOR_ELT(npdeSim, 0)); pro++;
+  int simLen = Rf_length(s0);
+  arma::ivec aSimIdVec(INTEGER(s0), simLen, false, true);
+  arma::ivec aIdVec(INTEGER(VECTOR_ELT(npdeSim, 1)), simLen, false, true);
+  unsigned int nid, K;
+  arma::ivec idLoc = getSimIdLoc(aIdVec, aSimIdVec, nid, K);
+  arma::vec sim(REAL(VECTOR_ELT(npdeSim, nsim)), simLen, false, true);
+  arma::vec lambda(REAL(VECTOR_ELT(npdeSim, nsim+1)), simLen, false, true);
+  arma::vec yj(REAL(VECTOR_ELT(npdeSim, nsim+2)), simLen, false, true);
+  arma::vec low(REAL(VECTOR_ELT(npdeSim, nsim+3)), simLen, false, true);
+  arma::vec hi(REAL(VECTOR_ELT(npdeSim, nsim+4)), simLen, false, true);
+  arma::vec &dvt = obs.dvt;
+  // dv -> dv transform
+  // powerDi for log-normal transfers dv = log(dv)
+  tbsDvD(dvt.memptr(), dv.memptr(), dvLen, lambda.memptr(), yj.memptr(),
+         low.memptr(), hi.memptr(), 0);
+  // sim -> sim transform; simulation is on untransformed scale
+  tbsDvD(sim.memptr(), sim.memptr(), simLen, lambda.memptr(), yj.memptr(),
+         low.memptr(), hi.memptr(), 0);
+  arma::ivec &cens = obs.cens;
+  arma::ivec &evid = obs.evid;
+  bool doLimit = false;
+
+  arma::vec &limit = obs.limit;
+  int hasLimit = obs.hasLimit;
+
+  if (hasLimit && censMethod == CENS_CDF) {
+    for (unsigned int i = 0; i < cens.size(); ++i) {
+      switch(cens[i]){
+      case 1:
+        if (R_FINITE(limit[i])) {
+          warning("limits are ignored for npde back-transformation with 'cdf' method");
+          i= cens.size();
+        }
+        break;
+      case -1:
+        if (R_FINITE(limit[i])) {
+          warning("limits are ignored for npde back-transformation with 'cdf' method");
+          i= cens.size();
+        }
+        break;
+      case 0:
+        break;
+      }
+    }
+  }
+
+  arma::vec ru = randu(simLen); // Pre-fill uniform random numbers to make sure independent
+  arma::vec ru2 = randu(simLen);
+  arma::vec ru3 = randu(simLen);
+
+  SEXP npdeSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
+  SEXP npdSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
+  SEXP pdeSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
+  SEXP pdSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
+  SEXP epredSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
+  SEXP dvSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
+  SEXP eresSEXP = PROTECT(Rf_allocVector(REALSXP, dvLen)); pro++;
+  arma::vec npde(REAL(npdeSEXP), dvLen, false, true);
+  arma::vec npd(REAL(npdSEXP), dvLen, false, true);
+  arma::vec pde(REAL(pdeSEXP), dvLen, false, true);
+  arma::vec pd(REAL(pdSEXP), dvLen, false, true);
+  arma::vec epred(REAL(epredSEXP), dvLen, false, true);
+  arma::vec dvf(REAL(dvSEXP), dvLen, false, true);
+  arma::vec eres(REAL(eresSEXP), dvLen, false, true);
+  arma::ivec warn(idLoc.size()-1);
+
+  int cores = ropt.cores;
+
+  // Each id only reads the shared inputs (including the pre-filled
+  // uniform random numbers for its own rows) and writes its own rows
+  // and warn[id], so the results do not depend on the number of
+  // threads.  The warnings are put together serially below.
+  int nidLoc = idLoc.size()-1;
+  bool hasErr = false;
+  // first (lowest) failing id and its message
+  int errId = nidLoc;
+  std::string errMsg;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cores) schedule(dynamic)
+#endif
+  for (int cid = 0; cid < nidLoc; ++cid) {
+    unsigned int curid = cid;
+    try {
+      calcNpdeInfoId idInfo = calcNpdeId(idLoc, sim, dvt, evid, cens, limit, censMethod, doLimit, curid, K, tolChol, ties, ru, ru2, ru3,
+                                         lambda, yj, hi, low);
+      npde(span(idLoc[curid],idLoc[curid+1]-1)) = idInfo.npde;
+      npd(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.npd;
+      pde(span(idLoc[curid],idLoc[curid+1]-1)) = idInfo.pd;
+      pd(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.pd2;
+      epred(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.epred;
+      dvf(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.yobs;
+      eres(span(idLoc[curid], idLoc[curid+1]-1)) = idInfo.eres;
+      warn[curid] = idInfo.warn;
+    } catch (std::exception &e) {
+      // exceptions cannot leave the parallel region
+#pragma omp critical
+      {
+        hasErr = true;
+        if (cid < errId) {
+          errId = cid;
+          errMsg = e.what();
+        }
+      }
+    } catch (...) {
+#pragma omp critical
+      {
+        hasErr = true;
+        if (cid < errId) {
+          errId = cid;
+          errMsg = "unknown error";
+        }
+      }
+    }
+  }
+  if (hasErr) {
+    UNPROTECT(pro);
+    Rcpp::stop("error calculating the npde for id %d: %s", errId+1, errMsg.c_str());
+  }
+  if (!warnCodes) npdeWarn(warn, R_NilValue);
+
   List ret(6);
   // epred, eres, npde, dv
   ret[0] = List::create(_["EPRED"]=epred);
@@ -534,6 +572,7 @@ extern "C" SEXP _nlmixr2est_npdeCalc(SEXP npdeSim, SEXP dvIn, SEXP evidIn, SEXP
   ret[5] = List::create(_["PD"]=pd);
   SEXP ret2 = PROTECT(dfCbindList(wrap(ret))); pro++;
   UNPROTECT(pro);
+  if (warnCodes) return List::create(dvf, ret2, wrap(warn));
   return List::create(dvf, ret2);
   END_RCPP
  }
@@ -56,6 +56,7 @@ extern "C" {
 #endif
 
   SEXP _nlmixr2est_npdeCalc(SEXP npdeSim, SEXP dvIn, SEXP evidIn, SEXP censIn, SEXP limitIn, SEXP npdeOpt);
+  SEXP _nlmixr2est_npdeWarn(SEXP warnIn, SEXP idsIn);
 
 #if defined(__cplusplus)
 }
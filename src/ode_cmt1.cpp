@@ -6,9 +6,14 @@
 using namespace Rcpp;
 
 #include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <stan/math/rev/core.hpp>
 #include <stan/math.hpp>
 #include "PKPDLib_WW.h"
+#define __nlmixr2est_llik_internal__
+#include "../inst/include/nlmixr2est_llik.h"
 
 // Change to the Rcpp interface and let Rcpp handle the BEGIN_RCPP interface.
 // It may have changed in the new RcppEigen...
@@ -30,14 +35,39 @@ SEXP lin_cmt_stan(Eigen::Map<Eigen::VectorXd> obs_time,
   stan::math::lin_cmt_fun f(obs_time, dose_time, dose, Tinf, ncmt, oral, infusion, parameterization);
   Eigen::VectorXd fx;
   Eigen::Matrix<double, -1, -1> J;
-  // ncol = npar
-  /// nrow = nobs
+  // ncol = nobs
+  /// nrow = npar (the transpose of lin_cmt_sens())
   stan::math::jacobian(f, params, fx, J);
 
   return Rcpp::List::create(Rcpp::Named("fx") = wrap(fx),
 			    Rcpp::Named("J") = wrap(J));
 }
 
+// Same solution and sensitivities as lin_cmt_stan() with forward mode
+// differentiation; J is nobs x npar.  lin_cmt_stan() is kept as the
+// reference.
+//[[Rcpp::export]]
+SEXP lin_cmt_sens(Eigen::Map<Eigen::VectorXd> obs_time,
+		  Eigen::Map<Eigen::VectorXd> dose_time,
+		  Eigen::Map<Eigen::VectorXd> dose,
+		  Eigen::Map<Eigen::VectorXd> Tinf,
+		  Eigen::Map<Eigen::VectorXd> params,
+		  SEXP oralSEXP,
+		  SEXP infusionSEXP,
+		  SEXP ncmtSEXP,
+		  SEXP parameterizationSEXP ) {
+  const int oral = as<int>(oralSEXP);
+  const int infusion = as<int>(infusionSEXP);
+  const int ncmt = as<int>(ncmtSEXP);
+  const int parameterization = as<int>(parameterizationSEXP);
+  stan::math::lin_cmt_fun f(obs_time, dose_time, dose, Tinf, ncmt, oral, infusion, parameterization);
+  Eigen::VectorXd fx;
+  Eigen::MatrixXd J;
+  stan::math::lin_cmt_fwd_jacobian(f, params, fx, J);
+  return Rcpp::List::create(Rcpp::Named("fx") = wrap(fx),
+			    Rcpp::Named("J") = wrap(J));
+}
+
 extern void lin_cmt_stanC(double *obs_timeD, const int nobs, double *dose_timeD, const int ndose, double *doseD, double *TinfD,
 			  double *paramsD, const int oral, const int infusion, const int ncmt, const int parameterization,
 			  const int neta, double *fxD, double *dvdxD, double *fpD){
@@ -48,18 +78,124 @@ extern void lin_cmt_stanC(double *obs_timeD, const int nobs, double *dose_timeD,
   Eigen::Map<Eigen::VectorXd> params(paramsD, (int)(2*ncmt+2));
   stan::math::lin_cmt_fun f(obs_time, dose_time, dose, Tinf, ncmt, oral, infusion, parameterization);
   Eigen::VectorXd fx;
-  Eigen::Matrix<double, -1, -1> J;
-  // Jacobian ncols=npars
-  // nrows=nobs
-  
-  stan::math::jacobian(f, params, fx, J);
-  std::copy(&fx[0],&fx[0]+nobs, fpD);
+  // Jacobian nrows=nobs
+  // ncols=npars
+  Eigen::MatrixXd J;
+  stan::math::lin_cmt_fwd_jacobian(f, params, fx, J);
+  std::copy(&fx[0],&fx[0]+nobs, fxD);
   // dvdx
   // ncol = netas
   // nrow = npars
   Eigen::Map<Eigen::MatrixXd> dvdx(dvdxD, 2*ncmt+2, neta);
   Eigen::Map<Eigen::MatrixXd> fp(fpD, nobs, neta);
-  fp = J.transpose() * dvdx;
+  fp = J * dvdx;
+}
+
+// Linear compartment solutions and forward mode sensitivities for a
+// whole population.  The observations and doses of subject i are
+// obs_off[i]..obs_off[i+1]-1 and dose_off[i]..dose_off[i+1]-1 of the
+// concatenated arrays (0 based), params is the nsub x npar parameter
+// matrix (column major), fxD is nobs and JD is nobs x npar.  The
+// forward mode sweep does not use the autodiff stack, so the subjects
+// can be solved on separate threads (cores below 1 use one thread).
+// Returns 0 on success, 1 when a solution failed (fxD and JD are then
+// undefined).
+extern int lin_cmt_pop_sensC(const double *obs_timeD, const int *obs_off,
+			     const double *dose_timeD, const double *doseD,
+			     const double *TinfD, const int *dose_off,
+			     const double *paramsD, const int nsub,
+			     const int oral, const int infusion, const int ncmt,
+			     const int parameterization, int cores,
+			     double *fxD, double *JD) {
+  if (cores < 1) cores = 1;
+  const int npar = 2*ncmt+2;
+  const int nobs = obs_off[nsub];
+  int hasErr = 0;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cores) schedule(dynamic)
+#endif
+  for (int id = 0; id < nsub; ++id) {
+    if (hasErr) continue;
+    const int o0 = obs_off[id], no = obs_off[id + 1] - o0;
+    const int d0 = dose_off[id], nd = dose_off[id + 1] - d0;
+    if (no == 0) continue;
+    try {
+      Eigen::Map<const Eigen::VectorXd> obs_time(obs_timeD + o0, no);
+      Eigen::Map<const Eigen::VectorXd> dose_time(dose_timeD + d0, nd);
+      Eigen::Map<const Eigen::VectorXd> dose(doseD + d0, nd);
+      Eigen::Map<const Eigen::VectorXd> Tinf(TinfD + d0, nd);
+      Eigen::VectorXd params(npar);
+      for (int j = 0; j < npar; ++j) params(j) = paramsD[id + j*nsub];
+      stan::math::lin_cmt_fun f(obs_time, dose_time, dose, Tinf, ncmt, oral, infusion, parameterization);
+      Eigen::VectorXd fx;
+      Eigen::MatrixXd J;
+      stan::math::lin_cmt_fwd_jacobian(f, params, fx, J);
+      std::copy(fx.data(), fx.data() + no, fxD + o0);
+      for (int j = 0; j < npar; ++j) {
+	std::copy(J.col(j).data(), J.col(j).data() + no, JD + o0 + (size_t)j*nobs);
+      }
+    } catch (...) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+      hasErr = 1;
+    }
+  }
+  return hasErr;
+}
+
+//[[Rcpp::export]]
+SEXP lin_cmt_pop_sens(NumericVector obs_time,
+		      IntegerVector obs_off,
+		      NumericVector dose_time,
+		      NumericVector dose,
+		      NumericVector Tinf,
+		      IntegerVector dose_off,
+		      NumericMatrix params,
+		      SEXP oralSEXP,
+		      SEXP infusionSEXP,
+		      SEXP ncmtSEXP,
+		      SEXP parameterizationSEXP,
+		      SEXP coresSEXP) {
+  const int oral = as<int>(oralSEXP);
+  const int infusion = as<int>(infusionSEXP);
+  const int ncmt = as<int>(ncmtSEXP);
+  const int parameterization = as<int>(parameterizationSEXP);
+  const int cores = as<int>(coresSEXP);
+  const int nsub = params.nrow();
+  const int npar = 2*ncmt+2;
+  if (ncmt < 1 || ncmt > 3) {
+    Rcpp::stop("'ncmt' must be 1, 2 or 3");
+  }
+  if (cores < 1) {
+    Rcpp::stop("'cores' must be at least 1");
+  }
+  if (params.ncol() != npar) {
+    Rcpp::stop("'params' needs %d columns for %d compartments", npar, ncmt);
+  }
+  if (obs_off.size() != nsub + 1 || dose_off.size() != nsub + 1) {
+    Rcpp::stop("'obs_off' and 'dose_off' need one more element than the rows of 'params'");
+  }
+  if (obs_off[0] != 0 || dose_off[0] != 0 ||
+      obs_off[nsub] != obs_time.size() || dose_off[nsub] != dose_time.size() ||
+      dose.size() != dose_time.size() || Tinf.size() != dose_time.size()) {
+    Rcpp::stop("the offsets do not match the concatenated observations and doses");
+  }
+  for (int i = 0; i < nsub; ++i) {
+    if (obs_off[i + 1] < obs_off[i] || dose_off[i + 1] < dose_off[i]) {
+      Rcpp::stop("the offsets need to be non-decreasing");
+    }
+  }
+  const int nobs = obs_time.size();
+  NumericVector fx(nobs);
+  NumericMatrix J(nobs, npar);
+  if (lin_cmt_pop_sensC(&obs_time[0], &obs_off[0], &dose_time[0], &dose[0],
+			&Tinf[0], &dose_off[0], &params[0], nsub, oral, infusion,
+			ncmt, parameterization, cores, &fx[0], &J[0])) {
+    Rcpp::stop("the linear compartment solution failed");
+  }
+  return Rcpp::List::create(Rcpp::Named("fx") = fx,
+			    Rcpp::Named("J") = J);
 }
 
 
@@ -308,6 +444,180 @@ SEXP llik_neg_binomial(Eigen::Map<Eigen::VectorXd> y, Eigen::Map<Eigen::VectorXd
 }
 
 
+//===============================================================
+// Closed form log-likelihoods and gradients for all the observations
+// of a subject (see inst/include/nlmixr2est_llik.h).  These do not
+// use the autodiff stack or the R API, so they may be called from the
+// inner problem and SAEM threads.  Non-positive scale parameters are
+// replaced by 1e-12 (with a zero derivative) like the Stan versions
+// above.
+static inline double llikPos(double x, double *d) {
+  if (x <= 0) {
+    *d = 0.0;
+    return 1.0e-12;
+  }
+  *d = 1.0;
+  return x;
+}
+
+extern "C" int nlmixr2Llik(int family, int n, const double *y, const double *N,
+			   const double *params, double *fx, double *J) {
+  switch (family) {
+  case nlmixr2LlikPoisson:
+    for (int i = 0; i < n; ++i) {
+      const double l = params[i];
+      if (!(y[i] >= 0) || !(l >= 0)) return 1;
+      if (y[i] == 0) {
+	fx[i] = -l;
+	J[i]  = -1.0;
+      } else {
+	fx[i] = y[i] * log(l) - l - R::lgammafn(y[i] + 1.0);
+	J[i]  = y[i] / l - 1.0;
+      }
+    }
+    return 0;
+  case nlmixr2LlikBinomial:
+    for (int i = 0; i < n; ++i) {
+      double p = params[i];
+      if (p > .99999) p = .99999;
+      if (p < .00001) p = .00001;
+      if (!(y[i] >= 0) || !(y[i] <= N[i])) return 1;
+      fx[i] = R::lchoose(N[i], y[i]) + y[i] * log(p) + (N[i] - y[i]) * log1p(-p);
+      J[i]  = y[i] / p - (N[i] - y[i]) / (1.0 - p);
+    }
+    return 0;
+  case nlmixr2LlikNormal: {
+    const double mu = params[0];
+    double ds;
+    const double sigma = llikPos(params[1], &ds);
+    const double lsig = log(sigma);
+    for (int i = 0; i < n; ++i) {
+      if (ISNAN(y[i])) return 1;
+      const double z = (y[i] - mu) / sigma;
+      fx[i]    = -M_LN_SQRT_2PI - lsig - 0.5 * z * z;
+      J[i]     = z / sigma;
+      J[i + n] = ds * (z * z - 1.0) / sigma;
+    }
+    return 0;
+  }
+  case nlmixr2LlikStudentT: {
+    double dn, ds;
+    const double nu = llikPos(params[0], &dn);
+    const double mu = params[1];
+    const double sigma = llikPos(params[2], &ds);
+    const double c  = R::lgammafn(0.5 * (nu + 1.0)) - R::lgammafn(0.5 * nu) -
+      0.5 * log(nu) - M_LN_SQRT_PI - log(sigma);
+    const double cn = 0.5 * (R::digamma(0.5 * (nu + 1.0)) - R::digamma(0.5 * nu) - 1.0 / nu);
+    for (int i = 0; i < n; ++i) {
+      if (ISNAN(y[i])) return 1;
+      const double z  = (y[i] - mu) / sigma;
+      const double z2 = z * z;
+      const double l1 = log1p(z2 / nu);
+      fx[i]        = c - 0.5 * (nu + 1.0) * l1;
+      J[i]         = dn * (cn - 0.5 * l1 + 0.5 * (nu + 1.0) * z2 / (nu * (nu + z2)));
+      J[i + n]     = (nu + 1.0) * z / (sigma * (nu + z2));
+      J[i + 2 * n] = ds * (-1.0 + (nu + 1.0) * z2 / (nu + z2)) / sigma;
+    }
+    return 0;
+  }
+  case nlmixr2LlikBeta: {
+    double da, db;
+    const double a = llikPos(params[0], &da);
+    const double b = llikPos(params[1], &db);
+    const double c  = R::lgammafn(a + b) - R::lgammafn(a) - R::lgammafn(b);
+    const double ca = R::digamma(a + b) - R::digamma(a);
+    const double cb = R::digamma(a + b) - R::digamma(b);
+    for (int i = 0; i < n; ++i) {
+      if (!(y[i] >= 0) || !(y[i] <= 1)) return 1;
+      const double ly  = log(y[i]);
+      const double l1y = log1p(-y[i]);
+      fx[i]    = c + (a - 1.0) * ly + (b - 1.0) * l1y;
+      J[i]     = da * (ca + ly);
+      J[i + n] = db * (cb + l1y);
+    }
+    return 0;
+  }
+  case nlmixr2LlikNegBinomial: {
+    double da, db;
+    const double a = llikPos(params[0], &da);
+    const double b = llikPos(params[1], &db);
+    const double lp  = log(b) - log1p(b);
+    const double l1b = log1p(b);
+    const double c   = R::lgammafn(a);
+    const double ca  = R::digamma(a);
+    for (int i = 0; i < n; ++i) {
+      if (!(y[i] >= 0)) return 1;
+      fx[i]    = R::lgammafn(y[i] + a) - R::lgammafn(y[i] + 1.0) - c + a * lp - y[i] * l1b;
+      J[i]     = da * (R::digamma(y[i] + a) - ca + lp);
+      J[i + n] = db * (a / (b * (1.0 + b)) - y[i] / (1.0 + b));
+    }
+    return 0;
+  }
+  case nlmixr2LlikBetaBinomial: {
+    double da, db;
+    const double a = llikPos(params[0], &da);
+    const double b = llikPos(params[1], &db);
+    const double lb = R::lbeta(a, b);
+    const double cab = R::digamma(a + b);
+    const double ca  = R::digamma(a);
+    const double cb  = R::digamma(b);
+    for (int i = 0; i < n; ++i) {
+      if (!(y[i] >= 0) || !(y[i] <= N[i])) return 1;
+      const double dN = R::digamma(N[i] + a + b);
+      fx[i]    = R::lchoose(N[i], y[i]) + R::lbeta(y[i] + a, N[i] - y[i] + b) - lb;
+      J[i]     = da * (R::digamma(y[i] + a) - dN - ca + cab);
+      J[i + n] = db * (R::digamma(N[i] - y[i] + b) - dN - cb + cab);
+    }
+    return 0;
+  }
+  }
+  return 2;
+}
+
+//[[Rcpp::export]]
+SEXP llik_closed(SEXP familySEXP, NumericVector y, NumericVector N, NumericVector params) {
+  std::string fam = as<std::string>(familySEXP);
+  int family, npar;
+  const int n = y.size();
+  if (fam == "poisson") {
+    family = nlmixr2LlikPoisson; npar = 1;
+  } else if (fam == "binomial") {
+    family = nlmixr2LlikBinomial; npar = 1;
+  } else if (fam == "normal") {
+    family = nlmixr2LlikNormal; npar = 2;
+  } else if (fam == "student_t") {
+    family = nlmixr2LlikStudentT; npar = 3;
+  } else if (fam == "beta") {
+    family = nlmixr2LlikBeta; npar = 2;
+  } else if (fam == "neg_binomial") {
+    family = nlmixr2LlikNegBinomial; npar = 2;
+  } else if (fam == "betabinomial") {
+    family = nlmixr2LlikBetaBinomial; npar = 2;
+  } else {
+    Rcpp::stop("unknown likelihood family '%s'", fam.c_str());
+  }
+  const bool perObs = (npar == 1);
+  if (perObs && params.size() != n) {
+    Rcpp::stop("'params' needs one value for each observation");
+  }
+  if (!perObs && params.size() != npar) {
+    Rcpp::stop("'params' needs %d values for '%s'", npar, fam.c_str());
+  }
+  const bool useN = (family == nlmixr2LlikBinomial || family == nlmixr2LlikBetaBinomial);
+  if (useN && N.size() != n) {
+    Rcpp::stop("'N' needs one value for each observation");
+  }
+  NumericVector fx(n);
+  NumericVector J(perObs ? n : n * npar);
+  if (n > 0 && nlmixr2Llik(family, n, &y[0], useN ? &N[0] : NULL, &params[0], &fx[0], &J[0])) {
+    Rcpp::stop("observations outside of the support of '%s'", fam.c_str());
+  }
+  if (!perObs) J.attr("dim") = IntegerVector::create(n, npar);
+  return Rcpp::List::create(Rcpp::Named("fx") = fx,
+			    Rcpp::Named("J") = J);
+}
+
+
 // I'm not sure why the below is here...
 
 #if 0
@@ -0,0 +1,170 @@
+#ifndef __PARHIST_H__
+#define __PARHIST_H__
+
+#if defined(__cplusplus)
+#include <RcppArmadillo.h>
+#include <vector>
+
+// Iteration history of the outer problem (fit$parHist).  The
+// function evaluations (objective function and parameters for each of
+// the scaled, unscaled and back-transformed types) and the gradients
+// are kept in two column major blocks whose capacity doubles when
+// full, so recording a row only stores its values and the data frame
+// columns are copied in one piece.
+//
+// With a row limit (foceiControl(parHistMax=)) the history is thinned
+// when it exceeds the limit: the stride is doubled and only the
+// evaluations whose number is a multiple of the stride (counting from
+// the first) are kept, so the rows stay spread over the whole fit.  A
+// gradient is recorded with the number of the function evaluation
+// before it and is kept or dropped with it.
+typedef struct {
+  int ncol; // objective function and parameters
+  int n; // rows
+  int cap; // allocated rows
+  std::vector<int> iter;
+  std::vector<int> type;
+  std::vector<double> val; // column major with cap rows
+} parHistBlock_t;
+
+typedef struct {
+  parHistBlock_t par;
+  parHistBlock_t grad;
+  int max; // maximum number of rows; 0 keeps every row
+  int reserve; // rows allocated by the first row of a block
+  int stride; // evaluations kept are 1, 1 + stride, 1 + 2*stride, ...
+  int last; // number of the last function evaluation
+} parHist_t;
+
+static inline void parHistBlockClear(parHistBlock_t &b) {
+  b.ncol = 0;
+  b.n = 0;
+  b.cap = 0;
+  b.iter.clear();
+  b.type.clear();
+  b.val.clear();
+}
+
+static inline void parHistBlockGrow(parHistBlock_t &b, int cap) {
+  std::vector<double> val((size_t)cap*(size_t)b.ncol, NA_REAL);
+  for (int j = 0; j < b.ncol; ++j) {
+    std::copy(b.val.begin() + (size_t)j*b.cap,
+              b.val.begin() + (size_t)j*b.cap + b.n,
+              val.begin() + (size_t)j*cap);
+  }
+  b.val.swap(val);
+  b.iter.resize(cap);
+  b.type.resize(cap);
+  b.cap = cap;
+}
+
+// Keep the rows of the evaluations on the stride
+static inline void parHistBlockThin(parHistBlock_t &b, int stride) {
+  int k = 0;
+  for (int i = 0; i < b.n; ++i) {
+    if ((b.iter[i] - 1) % stride != 0) continue;
+    if (k != i) {
+      b.iter[k] = b.iter[i];
+      b.type[k] = b.type[i];
+      for (int j = 0; j < b.ncol; ++j) {
+        b.val[(size_t)j*b.cap + k] = b.val[(size_t)j*b.cap + i];
+      }
+    }
+    k++;
+  }
+  b.n = k;
+}
+
+static inline void parHistClear(parHist_t &h) {
+  parHistBlockClear(h.par);
+  parHistBlockClear(h.grad);
+  h.stride = 1;
+  h.last = 0;
+}
+
+// Most rows allocated by the first row of a block; longer histories
+// grow by doubling
+#define PARHIST_RESERVE 256
+
+// Start a new history; nrow is the expected number of rows, which are
+// allocated (up to PARHIST_RESERVE) with the first row
+static inline void parHistSetup(parHist_t &h, int max, int nrow) {
+  parHistClear(h);
+  h.max = max;
+  if (max > 0 && nrow > max) nrow = max;
+  if (nrow > PARHIST_RESERVE) nrow = PARHIST_RESERVE;
+  h.reserve = nrow < 32 ? 32 : nrow;
+}
+
+static inline void parHistThin(parHist_t &h) {
+  if (h.max <= 0) return;
+  while (h.par.n + h.grad.n > h.max && h.stride < h.last) {
+    h.stride *= 2;
+    parHistBlockThin(h.par, h.stride);
+    parHistBlockThin(h.grad, h.stride);
+  }
+}
+
+static inline void parHistBlockAdd(parHist_t &h, parHistBlock_t &b, int iter,
+                                   int type, double objf, const double *x, int n) {
+  if (h.stride < 1) h.stride = 1; // not set up
+  if ((iter - 1) % h.stride != 0) return;
+  if (b.ncol == 0) b.ncol = n + 1;
+  if (b.n == b.cap) {
+    int cap = b.cap == 0 ? h.reserve : 2*b.cap;
+    parHistBlockGrow(b, cap < 32 ? 32 : cap);
+  }
+  b.iter[b.n] = iter;
+  b.type[b.n] = type;
+  b.val[b.n] = objf;
+  for (int j = 1; j < b.ncol && j <= n; ++j) {
+    b.val[(size_t)j*b.cap + b.n] = x[j-1];
+  }
+  b.n++;
+  parHistThin(h);
+}
+
+// A row of a function evaluation; iter is its number
+static inline void parHistAdd(parHist_t &h, int iter, int type, double objf,
+                              const double *x, int n) {
+  h.last = iter;
+  parHistBlockAdd(h, h.par, iter, type, objf, x, n);
+}
+
+// A gradient at the last function evaluation
+static inline void parHistAddGrad(parHist_t &h, int type, const double *g, int n) {
+  parHistBlockAdd(h, h.grad, h.last, type, NA_REAL, g, n);
+}
+
+static inline int parHistRows(const parHist_t &h) {
+  return h.par.n + h.grad.n;
+}
+
+// Column j of the data frame: the function evaluations followed by
+// the gradients
+static inline Rcpp::NumericVector parHistCol(const parHist_t &h, int j) {
+  Rcpp::NumericVector ret(parHistRows(h), NA_REAL);
+  if (j < h.par.ncol) {
+    std::copy(h.par.val.begin() + (size_t)j*h.par.cap,
+              h.par.val.begin() + (size_t)j*h.par.cap + h.par.n, ret.begin());
+  }
+  if (j < h.grad.ncol) {
+    std::copy(h.grad.val.begin() + (size_t)j*h.grad.cap,
+              h.grad.val.begin() + (size_t)j*h.grad.cap + h.grad.n,
+              ret.begin() + h.par.n);
+  }
+  return ret;
+}
+
+static inline Rcpp::IntegerVector parHistIter(const parHist_t &h, bool type) {
+  const std::vector<int> &p = type ? h.par.type : h.par.iter;
+  const std::vector<int> &g = type ? h.grad.type : h.grad.iter;
+  Rcpp::IntegerVector ret(parHistRows(h));
+  std::copy(p.begin(), p.begin() + h.par.n, ret.begin());
+  std::copy(g.begin(), g.begin() + h.grad.n, ret.begin() + h.par.n);
+  return ret;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#if defined(__cplusplus)
+#include <RcppArmadillo.h>
+#include <chrono>
+
+// Counters and monotonic timers for fit$profile.  Each counter is
+// only updated by the thread that solves the subject (or by the
+// serial code for the phases of the whole fit).
+typedef struct {
+  double n;
+  double t; // seconds
+} profPhase_t;
+
+static inline double profNow() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void profAdd(profPhase_t *p, double t0) {
+  p->n++;
+  p->t += profNow() - t0;
+}
+
+static inline void profZero(profPhase_t *p) {
+  p->n = 0;
+  p->t = 0;
+}
+
+// Long table of the counters: ID (0 for the whole fit), phase, n and
+// time (NA when the phase is only counted)
+typedef struct {
+  std::vector<int> id;
+  std::vector<std::string> phase;
+  std::vector<double> n;
+  std::vector<double> t;
+} profTable_t;
+
+static inline void profTableAdd(profTable_t &tab, int id, const char *phase,
+                                double n, double t) {
+  tab.id.push_back(id);
+  tab.phase.push_back(phase);
+  tab.n.push_back(n);
+  tab.t.push_back(t);
+}
+
+static inline void profTableAdd(profTable_t &tab, int id, const char *phase,
+                                profPhase_t &p) {
+  profTableAdd(tab, id, phase, p.n, p.t);
+}
+
+// The ID is 1 based with NA for the phases of the whole fit; when the
+// ID levels are known it is returned as a factor
+static inline Rcpp::List profTableDf(profTable_t &tab, SEXP idLvl) {
+  int n = tab.id.size();
+  Rcpp::IntegerVector id(n);
+  Rcpp::CharacterVector phase(n);
+  Rcpp::NumericVector nv(n), tv(n);
+  for (int i = 0; i < n; ++i) {
+    id[i] = tab.id[i] == 0 ? NA_INTEGER : tab.id[i];
+    phase[i] = tab.phase[i];
+    nv[i] = tab.n[i];
+    tv[i] = tab.t[i];
+  }
+  if (TYPEOF(idLvl) == STRSXP) {
+    id.attr("levels") = idLvl;
+    id.attr("class") = "factor";
+  }
+  Rcpp::List ret = Rcpp::List::create(Rcpp::_["ID"]=id,
+                                      Rcpp::_["phase"]=phase,
+                                      Rcpp::_["n"]=nv,
+                                      Rcpp::_["time"]=tv);
+  ret.attr("class") = "data.frame";
+  ret.attr("row.names") = Rcpp::IntegerVector::create(NA_INTEGER, -n);
+  return ret;
+}
+
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #define STRICT_R_HEADER
 #include "res.h"
+#include "tbs.h"
 #include <boost/algorithm/string.hpp>
 #include <string>
 
@@ -61,6 +62,129 @@ void getLimitFromInput(SEXP limitIn, int& ncalc, arma::vec& limit, int &hasLimit
   }
 }
 
+static inline bool getResOptBool(List &opt, const char *what, bool def) {
+  if (opt.containsElementNamed(what)) {
+    RObject tmp = opt[what];
+    if (TYPEOF(tmp) == LGLSXP) {
+      return as<bool>(tmp);
+    }
+  }
+  return def;
+}
+
+resOpt_t getResOpt(List &opt) {
+  resOpt_t ret;
+  ret.doSim = getResOptBool(opt, "doSim", true);
+  ret.ties = getResOptBool(opt, "ties", false);
+  ret.warnCodes = getResOptBool(opt, "npdeWarnCodes", false);
+  ret.censMethod = CENS_TNORM;
+  if (opt.containsElementNamed("censMethod")) {
+    RObject tmp = opt["censMethod"];
+    if (TYPEOF(tmp) == INTSXP) {
+      ret.censMethod = as<int>(tmp);
+    }
+  }
+  ret.tolChol = 6.055454e-06;
+  if (opt.containsElementNamed("tolChol")) {
+    RObject tmp = opt["tolChol"];
+    if (TYPEOF(tmp) == REALSXP) {
+      ret.tolChol = as<double>(tmp);
+    }
+  }
+  ret.cores = 1;
+  if (opt.containsElementNamed("cores")) {
+    RObject tmp = opt["cores"];
+    if (TYPEOF(tmp) == INTSXP || TYPEOF(tmp) == REALSXP) {
+      ret.cores = as<int>(tmp);
+    }
+  }
+  if (ret.cores < 1) ret.cores = 1;
+  return ret;
+}
+
+resObs_t::resObs_t(SEXP dvIn, SEXP evidIn, SEXP censIn, SEXP limitIn, int n) :
+  ncalc(n), dv(REAL(dvIn), n, false, true), dvt(n),
+  lowerLimR(n), upperLimR(n),
+  lowerLim(REAL(lowerLimR), n, false, true),
+  upperLim(REAL(upperLimR), n, false, true) {
+  if (Rf_isNull(censIn)) {
+    cens = arma::ivec(n, fill::zeros);
+  } else {
+    cens = as<arma::ivec>(censIn);
+  }
+  if (Rf_isNull(evidIn)) {
+    evid = arma::ivec(n, fill::zeros);
+  } else {
+    evid = as<arma::ivec>(evidIn);
+  }
+  getLimitFromInput(limitIn, n, limit, hasLimit);
+}
+
+static inline double resWeight(double err, double v) {
+  return v != 0 ? err / sqrt(v) : err;
+}
+
+void resFusedCalc(resObs_t &obs, resOpt_t &opt, resFused_t &r) {
+  double *dv = obs.dv.memptr(), *dvt = obs.dvt.memptr();
+  for (int j = 0; j < obs.ncalc; ++j) {
+    bool omit = opt.censMethod == CENS_OMIT && obs.cens[j] != 0;
+    if (omit || obs.evid[j] != 0) {
+      r.ires[j]	= NA_REAL;
+      r.iwres[j]	= NA_REAL;
+      if (r.pred != NULL) r.res[j] = NA_REAL;
+      if (r.vp != NULL) r.wres[j] = NA_REAL;
+      if (r.cpred != NULL) {
+        r.cres[j]	= NA_REAL;
+        r.cwres[j]	= NA_REAL;
+      }
+      if (omit) {
+        r.ipred[j] = NA_REAL;
+        if (r.pred != NULL) r.pred[j] = NA_REAL;
+        if (r.cpred != NULL) r.cpred[j] = NA_REAL;
+      }
+      dv[j] = NA_REAL;
+      continue;
+    }
+    r.ires[j]	= dv[j] - r.ipred[j];
+    r.iwres[j]	= resWeight(dvt[j] - r.ipredt[j], r.riv[j]);
+    if (r.pred != NULL) {
+      r.res[j] = dv[j] - r.pred[j];
+      if (r.vp != NULL) r.wres[j] = resWeight(dvt[j] - r.predt[j], fabs(r.vp[j]));
+    }
+    if (r.cpred != NULL) {
+      r.cres[j]	= dv[j] - r.cpred[j];
+      r.cwres[j]	= resWeight(dvt[j] - r.cpredt[j], r.vi[j]);
+    }
+  }
+}
+
+// Residual data.frame from the preallocated columns followed by the
+// censoring columns (when there are interesting limits)
+List resDf(resObs_t &obs, bool interestingLimits, CharacterVector nm0, List cols0) {
+  int ncol = cols0.size();
+  if (interestingLimits) {
+    ncol += 3 + obs.hasLimit;
+  }
+  List retDF(ncol);
+  CharacterVector nm(ncol);
+  int i=0;
+  for (; i < cols0.size(); ++i) {
+    nm[i] = nm0[i]; retDF[i] = cols0[i];
+  }
+  if (interestingLimits) {
+    nm[i] = "CENS"; retDF[i++] = wrap(obs.cens);
+    if (obs.hasLimit){
+      nm[i] = "LIMIT"; retDF[i++] = wrap(obs.limit);
+    }
+    nm[i] = "lowerLim"; retDF[i++] = obs.lowerLimR;
+    nm[i] = "upperLim"; retDF[i++] = obs.upperLimR;
+  }
+  retDF.names() = nm;
+  retDF.attr("row.names") = IntegerVector::create(NA_INTEGER,-obs.ncalc);
+  retDF.attr("class") = "data.frame";
+  return retDF;
+}
+
 List getDfIdentifierCols(List &ipred, int &npred, SEXP cmtNames, SEXP idLabels) {
   SEXP cmtVar = PROTECT(getDfSubsetVars(ipred,wrap(CharacterVector::create("CMT","cmt","Cmt"))));
   int extra = 0;
@@ -197,63 +321,32 @@ BEGIN_RCPP
   }
 
   arma::vec ipredt(REAL(ipredL[npred]), ncalc, false, true);
-  arma::vec ipred(ipredt.size());
-
   arma::vec predt(REAL(predL[npred]), ncalc, false, true);
-  arma::vec pred(predt.size());
 
-  arma::vec dv(REAL(dvIn), ncalc, false, true);
-  arma::vec dvt(ncalc);
-
-  arma::vec rpv(REAL(predL[npred+1]), ncalc, false, true);
   arma::vec riv(REAL(ipredL[npred+1]), ncalc, false, true);
 
-
-  arma::ivec cens;
-  if (Rf_isNull(censIn)) {
-    cens = arma::ivec(ncalc, fill::zeros);
-  } else {
-    cens = as<arma::ivec>(censIn);
-  }
-  arma::ivec evid;
-  if (Rf_isNull(evidIn)) {
-    evid = arma::ivec(ncalc, fill::zeros);
-  } else {
-    evid = as<arma::ivec>(evidIn);
-  }
-  arma::vec limit;
-  int hasLimit=0;
-  getLimitFromInput(limitIn, ncalc, limit, hasLimit);
+  resObs_t obs(dvIn, evidIn, censIn, limitIn, ncalc);
 
   arma::vec     hi(REAL(ipredL[ipredL.size()-1]), ncalc, false, true);
   arma::vec    low(REAL(ipredL[ipredL.size()-2]), ncalc, false, true);
   arma::vec     yj(REAL(ipredL[ipredL.size()-3]), ncalc, false, true);
   arma::vec lambda(REAL(ipredL[ipredL.size()-4]), ncalc, false, true);
-  arma::vec lowerLim(ncalc);
-  arma::vec upperLim(ncalc);
 
   arma::mat omegaMat = as<arma::mat>(omegaMatSEXP);
   unsigned int neta = omegaMat.n_rows;
 
-  bool doSim = true;
   List opt = as<List>(resOpt);
-  if (opt.containsElementNamed("doSim")) {
-    RObject tmp = opt["doSim"];
-    if (TYPEOF(tmp) == LGLSXP) {
-      doSim = as<bool>(tmp);
-    }
-  }
-  int censMethod = CENS_TNORM;
-  if (opt.containsElementNamed("censMethod")) {
-    RObject tmp = opt["censMethod"];
-    if (TYPEOF(tmp) == INTSXP) {
-      censMethod = as<int>(opt["censMethod"]);
-    }
-  }
+  resOpt_t ropt = getResOpt(opt);
 
-  bool interestingLimits = censTruncatedMvnReturnInterestingLimits(dv, dvt, ipred, ipredt, pred, predt, cens, limit,
-  								   lambda, yj, low, hi, lowerLim, upperLim,
-  								   riv, doSim, censMethod);
+  // The output columns are allocated once and filled in place
+  NumericVector PRED(ncalc), RES(ncalc), IPRED(ncalc), IRES(ncalc), IWRES(ncalc);
+  arma::vec ipred(REAL(IPRED), ncalc, false, true);
+  arma::vec pred(REAL(PRED), ncalc, false, true);
+
+  bool interestingLimits = censTruncatedMvnReturnInterestingLimits(obs.dv, obs.dvt, ipred, ipredt, pred, predt,
+                                                                   obs.cens, obs.limit,
+                                                                   lambda, yj, low, hi, obs.lowerLim, obs.upperLim,
+                                                                   riv, ropt.doSim, ropt.censMethod);
 
 
   arma::ivec ID(INTEGER(predL[0]), ncalc, false, true);
@@ -274,54 +367,17 @@ BEGIN_RCPP
 
   calculateDfFull(ID, etas, etasDfFull, nid, neta);
 
-  for (unsigned int i = pred.size(); i--;){
-    pred[i] = _powerDi(predt[i], lambda[i], (int)yj[i], low[i], hi[i]);
-  }
-  arma::vec res = dv - pred;
-  arma::uvec riv0 = find(riv != 0);
-  arma::vec iwres=(dvt-ipredt);
-  iwres.elem(riv0) /= sqrt(riv.elem(riv0));
-  arma::vec ires = dv - ipred;
-
-  for (unsigned int j = ires.size(); j--; ) {
-    if (censMethod == CENS_OMIT && cens[j] != 0) {
-      dv[j]	= NA_REAL;
-      pred[j]	= NA_REAL;
-      res[j]	= NA_REAL;
-      ipred[j]	= NA_REAL;
-      ires[j]	= NA_REAL;
-      iwres[j]	= NA_REAL;
-    } else if (evid[j] != 0) {
-      dv[j]	= NA_REAL;
-      res[j]	= NA_REAL;
-      ires[j]	= NA_REAL;
-      iwres[j]	= NA_REAL;
-    }
-  }
-  int ncol = 5;
-  if (interestingLimits) {
-    ncol += 3 + hasLimit;
-  }
-  List retDF(ncol);
-  CharacterVector nm(ncol);
-  int i=0;
-  nm[i] = "PRED"; retDF[i++] = wrap(pred);
-  nm[i] = "RES"; retDF[i++] = wrap(res);
-  nm[i] = "IPRED"; retDF[i++] = wrap(ipred);
-  nm[i] = "IRES"; retDF[i++] = wrap(ires);
-  nm[i] = "IWRES"; retDF[i++] = wrap(iwres);
-  if (interestingLimits) {
-    nm[i] = "CENS"; retDF[i++] = wrap(cens);
-    if (hasLimit){
-      nm[i] = "LIMIT"; retDF[i++] = wrap(limit);
-    }
-    nm[i] = "lowerLim"; retDF[i++] = wrap(lowerLim);
-    nm[i] = "upperLim"; retDF[i++] = wrap(upperLim);
-  }
-  retDF.names() = nm;
-  retDF.attr("row.names") = IntegerVector::create(NA_INTEGER,-ncalc);
-  retDF.attr("class") = "data.frame";
-  calcShrinkFinalize(omegaMat, nid, etaLst, iwres, evid, etaN2, 1);
+  resFused_t r = {ipredt.memptr(), ipred.memptr(), riv.memptr(),
+                  predt.memptr(), pred.memptr(), NULL,
+                  NULL, NULL, NULL,
+                  REAL(IRES), REAL(IWRES), REAL(RES), NULL, NULL, NULL};
+  resFusedCalc(obs, ropt, r);
+
+  List retDF = resDf(obs, interestingLimits,
+                     CharacterVector::create("PRED", "RES", "IPRED", "IRES", "IWRES"),
+                     List::create(PRED, RES, IPRED, IRES, IWRES));
+  arma::vec iwres(REAL(IWRES), ncalc, false, true);
+  calcShrinkFinalize(omegaMat, nid, etaLst, iwres, obs.evid, etaN2, 1);
 
   List retC = List::create(retDF, etasDfFull,
 			   getDfSubsetVars(ipredL, stateSXP),
@@ -330,7 +386,7 @@ BEGIN_RCPP
   dfSetStateLhsOps(retC, opt);
   retC = dfCbindList(wrap(retC));
   List ret(4);
-  ret[0] = wrap(dv);
+  ret[0] = wrap(obs.dv);
   ret[1] = getDfIdentifierCols(ipredL, npred, stateSXP, IDlabelSEXP);
   ret[2] = retC;
   ret[3] = etaLst;
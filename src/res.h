@@ -16,6 +16,51 @@ List getDfIdentifierCols(List &ipred, int &npred, SEXP cmtNames, SEXP IDlabel);
 
 void dfSetStateLhsOps(List& in, List& opt);
 
+// Options of the residual (and npde) tables
+typedef struct {
+  bool doSim;
+  int censMethod;
+  bool ties;
+  double tolChol;
+  int cores;
+  bool warnCodes;
+} resOpt_t;
+
+resOpt_t getResOpt(List &opt);
+
+// Observations shared by the residual calculations.  dv uses the
+// memory of dvIn, so the censoring imputations (and NA values for
+// non-observations) are seen by the calculations that follow.
+struct resObs_t {
+  int ncalc;
+  arma::vec dv;
+  arma::vec dvt;
+  arma::ivec cens;
+  arma::ivec evid;
+  arma::vec limit;
+  int hasLimit;
+  NumericVector lowerLimR;
+  NumericVector upperLimR;
+  arma::vec lowerLim;
+  arma::vec upperLim;
+  resObs_t(SEXP dvIn, SEXP evidIn, SEXP censIn, SEXP limitIn, int n);
+};
+
+// Inputs and (preallocated) outputs of the fused residual pass.  The
+// population (pred) and conditional (cpred) families are only
+// calculated when their pointers are not NULL; wres needs vp (the FO
+// variance plus the population residual variance) and cwres needs vi.
+typedef struct {
+  double *ipredt, *ipred, *riv;
+  double *predt, *pred, *vp;
+  double *cpredt, *cpred, *vi;
+  double *ires, *iwres, *res, *wres, *cres, *cwres;
+} resFused_t;
+
+void resFusedCalc(resObs_t &obs, resOpt_t &opt, resFused_t &r);
+
+List resDf(resObs_t &obs, bool interestingLimits, CharacterVector nm0, List cols0);
+
 extern "C" {
 #endif
   SEXP _nlmixr2est_resCalc(SEXP ipredPredListSEXP, SEXP omegaMatSEXP,
@@ -8,6 +8,14 @@
 #include <rxode2.h>
 #include "utilc.h"
 #include "censEst.h"
+#include "profile.h"
+#include "tbs.h"
+#include "checkpoint.h"
+#define __nlmixr2est_optim_internal__
+#include "../inst/include/nlmixr2est_optim.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifdef ENABLE_NLS
 #include <libintl.h>
@@ -30,33 +38,48 @@ using namespace Rcpp;
 
 typedef void (*fn_ptr) (double *, double *);
 
-extern "C" void nelder_fn(fn_ptr func, int n, double *start, double *step,
-			  int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
-			  int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
-			  int *iprint);
-
-double *_saemYptr;
-double *_saemFptr;
-int _saemLen;
-int _saemYj;
-int _saemAddProp;
-double _saemLambda;
-double _saemLow;
-double _saemHi;
-fn_ptr _saemFn;
-double *_saemStart;
-double *_saemStep;
+extern "C" int nelder_work_size(int n);
+extern "C" void nelder_fn2(nmfn_ex_t func, void *ex, int n, double *start, double *step,
+                           int itmax, double ftol_rel, double rcoef, double ecoef, double ccoef,
+                           int *iconv, int *it, int *nfcall, double *ynewlo, double *xmin,
+                           int *iprint, double *work, int cores);
+
+// The residual objectives of each endpoint are optimized by separate
+// (OpenMP) threads, so their data is thread local
+thread_local double *_saemYptr;
+thread_local double *_saemFptr;
+thread_local int _saemLen;
+thread_local int _saemYj;
+thread_local int _saemAddProp;
+thread_local double _saemLambda;
+thread_local double _saemLow;
+thread_local double _saemHi;
+thread_local fn_ptr _saemFn;
+thread_local double *_saemStart;
+thread_local double *_saemStep;
+// transformed f, y and the f used for the variance when lambda is not
+// estimated (see _saemResidPre())
+thread_local double *_saemFtptr;
+thread_local double *_saemYtptr;
+thread_local double *_saemFaptr;
 double _saemLambdaR;
 double _saemPowR;
-int _saemPropT=0;
+thread_local int _saemPropT=0;
 bool _warnAtolRtol=false;
 int _saemIncreaseTol=0;
 int _saemIncreasedTol2=0;
 double _saemOdeRecalcFactor = 1.0;
 int _saemMaxOdeRecalc = 0;
 
-int _saemFixedIdx[4] = {0, 0, 0, 0};
-double _saemFixedValue[4] = {0.0, 0.0, 0.0, 0.0};
+// fit$profile counters outside of the SAEM class
+profPhase_t _saemProfSolve; // user_function() (all subjects and chains)
+profPhase_t _saemProfResid; // residual error optimization
+double _saemProfRecalc = 0; // solves repeated with relaxed atol/rtol
+double _saemProfSubSolve = 0; // subjects solved by user_function()
+double _saemProfSubCache = 0; // subjects with unchanged parameters
+
+thread_local int _saemFixedIdx[4] = {0, 0, 0, 0};
+thread_local double _saemFixedValue[4] = {0.0, 0.0, 0.0, 0.0};
 
 // res_mod defines
 #define rmAdd 1
@@ -89,6 +112,23 @@ static inline double handleF(int powt, double &ft, double &f, bool trunc, bool a
 #define toPow(x) _powerDi(x, 1.0, 4, -_saemPowR, _saemPowR)
 #define toPowEst(x) _powerD((x < -0.99*_saemPowR ? -0.99*_saemPowR : (x > 0.99*_saemPowR ? 0.99*_saemPowR : x)), 1.0, 4, -_saemPowR, _saemPowR)
 
+// When lambda is fixed the transformed predictions and observations
+// do not change while the residual parameters are optimized, so they
+// are calculated once for obj(), objC() and objD()
+static inline void _saemResidPre(vec &ft, vec &yt, vec &fa, bool adjustF) {
+  ft.set_size(_saemLen);
+  yt.set_size(_saemLen);
+  fa.set_size(_saemLen);
+  tbsD(ft.memptr(), _saemFptr, _saemLen, _saemLambda, _saemYj, _saemLow, _saemHi);
+  tbsD(yt.memptr(), _saemYptr, _saemLen, _saemLambda, _saemYj, _saemLow, _saemHi);
+  for (int i = 0; i < _saemLen; ++i) {
+    fa[i] = handleF(_saemPropT, ft[i], _saemFptr[i], false, adjustF);
+  }
+  _saemFtptr = ft.memptr();
+  _saemYtptr = yt.memptr();
+  _saemFaptr = fa.memptr();
+}
+
 // add+prop
 void obj(double *ab, double *fx) {
   int i;
@@ -111,11 +151,11 @@ void obj(double *ab, double *fx) {
   ab12 = ab12*ab12;
   for (i=0, sum=0; i<_saemLen; ++i) {
     // nelder_() does not al_saemLow _saemLower bounds; we force ab[] be positive here
-    ft  = _powerD(_saemFptr[i], _saemLambda, _saemYj, _saemLow, _saemHi);
-    ytr = _powerD(_saemYptr[i], _saemLambda, _saemYj, _saemLow, _saemHi);
+    ft  = _saemFtptr[i];
+    ytr = _saemYtptr[i];
     // focei: rx_r_ = eff^2 * prop.sd^2 + add_sd^2
     // focei g = sqrt(eff^2*prop.sd^2 + add.sd^2)
-    fa = handleF(_saemPropT, ft, _saemFptr[i], false, false);
+    fa = _saemFaptr[i];
     if (_saemAddProp == 1) {
       g = ab02 + ab12*fa;
     } else {
@@ -154,11 +194,11 @@ void objC(double *ab, double *fx) {
   double pw = toPow(ab22);
   for (i=0, sum=0; i<_saemLen; ++i) {
     // nelder_() does not al_saemLow _saemLower bounds; we force ab[] be positive here
-    ft  = _powerD(_saemFptr[i], _saemLambda, _saemYj, _saemLow, _saemHi);
-    ytr = _powerD(_saemYptr[i], _saemLambda, _saemYj, _saemLow, _saemHi);
+    ft  = _saemFtptr[i];
+    ytr = _saemYtptr[i];
     // focei: rx_r_ = eff^2 * prop.sd^2 + add_sd^2
     // focei g = sqrt(eff^2*prop.sd^2 + add.sd^2)
-    fa = handleF(_saemPropT, ft, _saemFptr[i], false, false);
+    fa = _saemFaptr[i];
     if (_saemAddProp == 1){
       g = ab02*ab02 + ab12*ab12*pow(fa, pw);
     } else {
@@ -195,9 +235,9 @@ void objD(double *ab, double *fx) {
   double fa;
   for (i=0, sum=0; i<_saemLen; ++i) {
     // nelder_() does not al_saemLow _saemLower bounds; we force ab[] be positive here
-    ft = _powerD(_saemFptr[i],  _saemLambda, _saemYj, _saemLow, _saemHi);
-    ytr = _powerD(_saemYptr[i], _saemLambda, _saemYj, _saemLow, _saemHi);
-    fa = handleF(_saemPropT, ft, _saemFptr[i], false, true);
+    ft = _saemFtptr[i];
+    ytr = _saemYtptr[i];
+    fa = _saemFaptr[i];
     g = ab02*ab02*pow(fa, pw);
     if (g < xmin) g = xmin;
     if (g > xmax) g = xmax;
@@ -410,8 +450,22 @@ int _saemItmax = 100;
 double _saemTol = 1e-4;
 int _saemType = 1;
 
-static inline void _saemOpt(int n, double *pxmin) {
-  if (n == 0) return;
+static void _saemFnEx(double *x, double *fx, void *ex) {
+  (*_saemFn)(x, fx);
+}
+
+// The objective uses the thread local data of the endpoint, so the
+// simplex is evaluated serially with a thread local workspace
+static inline void _saemNelder(int n, double *pxmin) {
+  thread_local std::vector<double> work;
+  work.resize(nelder_work_size(n));
+  int iconv, it, nfcall, iprint=0, itmax=_saemItmax*n;
+  double ynewlo;
+  nelder_fn2(_saemFnEx, NULL, n, _saemStart, _saemStep, itmax, _saemTol, 1.0, 2.0, .5,
+             &iconv, &it, &nfcall, &ynewlo, pxmin, &iprint, work.data(), 1);
+}
+
+static inline void _saemOpt0(int n, double *pxmin) {
   if (n == 1) {
     // Use R's optimize for unidimensional optimization
     Function loadNamespace("loadNamespace", R_BaseNamespace);
@@ -423,10 +477,7 @@ static inline void _saemOpt(int n, double *pxmin) {
     pxmin[0] = x0;
   } else {
     if (_saemType == 1) {
-      int iconv, it, nfcall, iprint=0, itmax=_saemItmax*n;
-      double ynewlo;
-      nelder_fn(_saemFn, n, _saemStart, _saemStep, itmax, _saemTol, 1.0, 2.0, .5,
-                &iconv, &it, &nfcall, &ynewlo, pxmin, &iprint);
+      _saemNelder(n, pxmin);
     } else if (_saemType == 2) {
       // Try Newoua
       Function loadNamespace("loadNamespace", R_BaseNamespace);
@@ -442,10 +493,7 @@ static inline void _saemOpt(int n, double *pxmin) {
       double f = as<double>(ret["value"]);
       if (ISNA(f)) {
         RSprintf("newoua failed, switch to nelder-mead\n");
-        int iconv, it, nfcall, iprint=0, itmax=_saemItmax*n;
-        double ynewlo;
-        nelder_fn(_saemFn, n, _saemStart, _saemStep, itmax, _saemTol, 1.0, 2.0, .5,
-                  &iconv, &it, &nfcall, &ynewlo, pxmin, &iprint);
+        _saemNelder(n, pxmin);
       } else {
         NumericVector x = ret["x"];
         for (int i = n; i--;) {
@@ -456,6 +504,20 @@ static inline void _saemOpt(int n, double *pxmin) {
   }
 }
 
+static inline void _saemOpt(int n, double *pxmin) {
+  if (n == 0) return;
+#ifdef _OPENMP
+  if (omp_in_parallel()) {
+    // timed for all the endpoints together
+    _saemOpt0(n, pxmin);
+    return;
+  }
+#endif
+  double t0 = profNow();
+  _saemOpt0(n, pxmin);
+  profAdd(&_saemProfResid, t0);
+}
+
 extern "C" SEXP _saemResidF(SEXP v) {
   SEXP ret = PROTECT(Rf_allocVector(REALSXP, 1));
   _saemFn(REAL(v),REAL(ret));
@@ -497,7 +559,7 @@ uvec getObsIdx(umat m) {
 
 // class def starts
 class SAEM {
-  typedef mat (*user_funct) (const mat&, const mat&, const List&);
+  typedef void (*user_funct) (mat&, const mat&, const mat&, const List&);
 
 public:
 
@@ -576,6 +638,44 @@ public:
     return eta;
   }
 
+  // Conditional mean and sd of phi over all chains and iterations
+  mat get_phi_mean() {
+    return phiMean;
+  }
+
+  mat get_phi_sd() {
+    if (phiN < 2) return zeros<mat>(N, nphi);
+    return sqrt(phiM2/(phiN-1));
+  }
+
+  // fit$saemConverge
+  List get_converge() {
+    return List::create(_["nBurn"] = convBurn,
+                        _["nEm"] = convEm,
+                        _["burn"] = convBurnStop ? "converged" : "iterations",
+                        _["em"] = convEmStop ? "converged" : "iterations",
+                        _["window"] = convWindow,
+                        _["tol"] = convTol,
+                        _["change"] = convChange);
+  }
+
+  // fit$profile; the MCMC time includes the solves of the proposals
+  List get_profile() {
+    profTable_t tab;
+    profTableAdd(tab, 0, "iteration", profIter);
+    profTableAdd(tab, 0, "mcmc", profMcmc);
+    profTableAdd(tab, 0, "solve", _saemProfSolve);
+    profTableAdd(tab, 0, "odeRecalc", _saemProfRecalc, NA_REAL);
+    profTableAdd(tab, 0, "subjectSolve", _saemProfSubSolve, NA_REAL);
+    profTableAdd(tab, 0, "subjectCached", _saemProfSubCache, NA_REAL);
+    profTableAdd(tab, 0, "residual", _saemProfResid);
+    for (int id = 0; id < N; ++id) {
+      profTableAdd(tab, id + 1, "mcmcProposal", profProp[id], NA_REAL);
+      profTableAdd(tab, id + 1, "mcmcAccept", profAcc[id], NA_REAL);
+    }
+    return profTableDf(tab, R_NilValue);
+  }
+
   void inits(List x) {
     _saemItmax = as<int>(x["itmax"]);
     _saemTol = as<double>(x["tol"]);
@@ -703,6 +803,15 @@ public:
     vecbres = bres(ix_endpnt);
     veccres = cres(ix_endpnt);
     veclres = lres(ix_endpnt);
+    endpntIdx.resize(nendpnt);
+    for (int b=0; b<nendpnt; ++b) {
+      endpntIdx[b] = find(ix_endpnt==b);
+    }
+    if (x.containsElementNamed("resCores")) {
+      resCores = max2(as<int>(x["resCores"]), 1);
+    } else {
+      resCores = 1;
+    }
     for (int b=0; b<nendpnt; ++b) {
       sigma2[b] = 10;
       if (res_mod(b) == rmAdd) {
@@ -741,6 +850,33 @@ public:
     DEBUG=as<int>(x["DEBUG"]);
     phiMFile=as<std::vector< std::string > >(x["phiMFile"]);
     //Rcout << phiMFile[0];
+    if (x.containsElementNamed("phiTrace")) {
+      phiTrace = as<int>(x["phiTrace"]);
+    } else {
+      phiTrace = 0;
+    }
+    if (x.containsElementNamed("nburn")) {
+      nburn = as<int>(x["nburn"]);
+    } else {
+      nburn = niter;
+    }
+    if (x.containsElementNamed("convWindow")) {
+      convWindow = as<int>(x["convWindow"]);
+      convTol = as<double>(x["convTol"]);
+    } else {
+      convWindow = 0;
+      convTol = 0.0;
+    }
+    ckptFile.clear();
+    ckptResume.clear();
+    ckptInterval = 0.0;
+    if (x.containsElementNamed("checkpoint") && !Rf_isNull(x["checkpoint"])) {
+      ckptFile = as<std::string>(x["checkpoint"]);
+      ckptInterval = as<double>(x["checkpointInterval"]);
+    }
+    if (x.containsElementNamed("resume") && !Rf_isNull(x["resume"])) {
+      ckptResume = as<std::string>(x["resume"]);
+    }
 
   }
 
@@ -750,12 +886,18 @@ public:
     double xmax = 1e300;
     ofstream phiFile;
     _warnAtolRtol = false;
-    phiFile.open(phiMFile[0].c_str());
+    if (phiTrace > 0) {
+      phiFile.open(phiMFile[0].c_str(), std::ios::out | std::ios::binary);
+    }
+    phiMean.zeros(N, nphi);
+    phiM2.zeros(N, nphi);
+    phiN = 0;
 
     if (DEBUG>0) {
       RSprintf("initialization successful\n");
     }
-    fsaveMat = user_fn(phiM, evtM, optM);
+    mcmcSetup();
+    user_fn(fsaveMat, phiM, evtM, optM);
     limit = fsaveMat.col(2);
     limitT = fsaveMat.col(2);
     cens = fsaveMat.col(1);
@@ -763,7 +905,28 @@ public:
     if (DEBUG>0){
       RSprintf("initial user_fn successful\n");
     }
-    for (unsigned int kiter=0; kiter<(unsigned int)(niter); kiter++) {
+    profZero(&profIter);
+    profZero(&profMcmc);
+    profProp.zeros(N);
+    profAcc.zeros(N);
+    // kiter is the iteration of the step size schedule (which jumps to
+    // the nEm phase when the nBurn phase converges); krow counts the
+    // iterations run and is the row of par_hist
+    int krow = 0, kphase = 0;
+    int minBurn = std::max(std::max(nb_sa, nb_correl), std::max(nb_fixOmega, nb_fixResid));
+    convBurn = convEm = 0;
+    convBurnStop = convEmStop = false;
+    convChange = NA_REAL;
+    unsigned int kiter0 = 0;
+    if (!ckptResume.empty()) {
+      checkpointRead(kiter0, krow, kphase);
+      if (print != 0) {
+        RSprintf("resuming at iteration %d\n", krow+1);
+      }
+    }
+    double ckptLast = profNow();
+    for (unsigned int kiter=kiter0; kiter<(unsigned int)(niter); kiter++) {
+      double tIter = profNow();
       gamma2_phi1=Gamma2_phi1.diag();
       IGamma2_phi1=inv_sympd(Gamma2_phi1);
       D1Gamma21=LCOV1*IGamma2_phi1;
@@ -799,12 +962,12 @@ public:
         // REprintf("dist=1\n");
         vec ft = f;
         vec ftT(ft.size());
-        vec yt = yM;
+        mcmcYtUpdate();
+        const vec &yt = mcmcYt;
+        tbsEndpnt(limitT.memptr(), limit.memptr(), ft.size());
+        tbsEndpnt(ft.memptr(), f.memptr(), ft.size());
         for (int i = ft.size(); i--;) {
           int cur = ix_endpnt(i);
-          limitT[i] = _powerD(limit[i], lambda(cur), yj(cur), low(cur), hi(cur));
-          ft(i)   = _powerD(f(i), lambda(cur), yj(cur), low(cur), hi(cur));
-          yt(i)   = _powerD(yM(i), lambda(cur), yj(cur), low(cur), hi(cur));
           ftT(i)  = handleF(propT(cur), ft(i), f(i), false, true);
         }
         // focei: rx_r_ = eff^2 * prop.sd^2 + add_sd^2
@@ -830,6 +993,7 @@ public:
       //U_y is a vec of subject llik; summed over obs for each subject
       vec U_y=sum(DYF, 0).t();
 
+      double tMcmc = profNow();
       if(nphi1>0) {
         vec U_phi;
         do_mcmc(1, nu1, mx, mphi1, DYF, phiM, U_y, U_phi);
@@ -846,8 +1010,13 @@ public:
         do_mcmc(2, nu2, mx, mphi0, DYF, phiM, U_y, U_phi);
         do_mcmc(3, nu3, mx, mphi0, DYF, phiM, U_y, U_phi);
       }
+      profAdd(&profMcmc, tMcmc);
       if (DEBUG>0) Rcout << "mcmc successful\n";
-      phiFile << phiM;
+      phiAccumulate();
+      if (phiTrace > 0 && krow % phiTrace == 0) {
+        // column major nM x nphi doubles; read by .saemReadPhiTrace()
+        phiFile.write((const char*)phiM.memptr(), sizeof(double)*phiM.n_elem);
+      }
       //mat dphi=phiM.cols(i1)-mphi1.mprior_phiM;
       //vec U_phi=0.5*sum(dphi%(dphi*IGamma2_phi1),1);
 
@@ -896,14 +1065,14 @@ public:
         for(int b=0; b<nendpnt; ++b) {
           y_cur = ys(span(y_offset(b), y_offset(b+1)-1));
           f_cur = fk(span(y_offset(b), y_offset(b+1)-1));
-          vec resid(y_cur.size());
+          vec resid(y_cur.size()), ftb(y_cur.size());
+          tbsD(resid.memptr(), y_cur.memptr(), y_cur.size(), lambda(b), yj(b), low(b), hi(b));
+          tbsD(ftb.memptr(), f_cur.memptr(), f_cur.size(), lambda(b), yj(b), low(b), hi(b));
           for (int i = y_cur.size(); i--;){
-            // lambda(cur), yj(cur), low(cur), hi(cur)
-            resid(i) = _powerD(y_cur[i], lambda(b), yj(b), low(b), hi(b));
             if (std::isnan(resid(i))) {
               Rcpp::stop(_("NaN in data or transformed data; please check transformation/data"));
             }
-            ft = _powerD(f_cur[i], lambda(b), yj(b), low(b), hi(b));
+            ft = ftb[i];
             resid(i) -=  ft;
             if (res_mod(b) == rmProp) {
               fa = handleF(propT(b), ft, f_cur[i], true, true);
@@ -1029,6 +1198,13 @@ public:
         Gamma2_phi0=diagmat(dGamma2_phi0);                         //CHK
       }
       //CHECK the following seg on b & yptr & fptr
+      // The endpoints are independent; they are optimized in parallel
+      // unless an optimization is done in R (see resOptPar())
+      bool resPar = resOptPar(kiter);
+      double tResid = profNow();
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(resCores) schedule(dynamic) if (resPar)
+#endif
       for(int b=0; b<nendpnt; ++b) {
         double sig2=statrese[b]/(y_offset(b+1)-y_offset(b));       //CHK: range
         int offsetR = res_offset[b];
@@ -1056,7 +1232,7 @@ public:
         case rmAddProp:
           {
             uvec idx;
-            idx = find(ix_endpnt==b);
+            idx = endpntIdx[b];
             vec ysb, fsb;
 
             ysb = ysM(idx);
@@ -1102,6 +1278,8 @@ public:
             _saemLambda = lambda(b);
             _saemLow = low(b);
             _saemHi = hi(b);
+            vec ftb, ytb, fab;
+            _saemResidPre(ftb, ytb, fab, false);
             _saemFn = obj;
             _saemStep = step;
             _saemStart=start;
@@ -1128,7 +1306,7 @@ public:
         case rmAddPow:
           { // add + pow
             uvec idx;
-            idx = find(ix_endpnt==b);
+            idx = endpntIdx[b];
             vec ysb, fsb;
 
             ysb = ysM(idx);
@@ -1183,6 +1361,8 @@ public:
             _saemHi = hi(b);
             _saemStep = step;
             _saemStart = start;
+            vec ftb, ytb, fab;
+            _saemResidPre(ftb, ytb, fab, false);
             _saemFn = objC;
             _saemOpt(n, pxmin);
             // REprintf("\tares: %f bres: %f cres: %f\n", pxmin[0], pxmin[1], pxmin[2]);
@@ -1209,7 +1389,7 @@ public:
         case rmPow:
           { // power
             uvec idx;
-            idx = find(ix_endpnt==b);
+            idx = endpntIdx[b];
             vec ysb, fsb;
 
             ysb = ysM(idx);
@@ -1252,6 +1432,8 @@ public:
             _saemHi = hi(b);
             _saemStep = step;
             _saemStart = start;
+            vec ftb, ytb, fab;
+            _saemResidPre(ftb, ytb, fab, true);
             _saemFn = objD;
             _saemOpt(n, pxmin);
             if (kiter > (unsigned int)(nb_fixResid)) {
@@ -1273,7 +1455,7 @@ public:
         case rmAddLam:
           { // additive + lambda
             uvec idx;
-            idx = find(ix_endpnt==b);
+            idx = endpntIdx[b];
             vec ysb, fsb;
 
             ysb = ysM(idx);
@@ -1337,7 +1519,7 @@ public:
         case rmPropLam:
           { // prop + lambda
             uvec idx;
-            idx = find(ix_endpnt==b);
+            idx = endpntIdx[b];
             vec ysb, fsb;
 
             ysb = ysM(idx);
@@ -1401,7 +1583,7 @@ public:
         case rmPowLam:
           { // pow + lambda
             uvec idx;
-            idx = find(ix_endpnt==b);
+            idx = endpntIdx[b];
             vec ysb, fsb;
 
             ysb = ysM(idx);
@@ -1478,7 +1660,7 @@ public:
         case rmAddPropLam:
           { // add + prop + lambda
             uvec idx;
-            idx = find(ix_endpnt==b);
+            idx = endpntIdx[b];
             vec ysb, fsb;
 
             ysb = ysM(idx);
@@ -1555,7 +1737,7 @@ public:
         case rmAddPowLam:
           { // add + pow + lambda
             uvec idx;
-            idx = find(ix_endpnt==b);
+            idx = endpntIdx[b];
             vec ysb, fsb;
 
             ysb = ysM(idx);
@@ -1647,6 +1829,7 @@ public:
         if (sigma2[b]>1.0e99) sigma2[b] = 1.0e99;
         if (std::isnan(sigma2[b])) sigma2[b] = 1.0e99;
       }
+      if (resPar) profAdd(&_saemProfResid, tResid);
       vecares = ares(ix_endpnt);
       vecbres = bres(ix_endpnt);
       if (DEBUG>0) Rcout << "par update successful\n";
@@ -1722,17 +1905,50 @@ public:
       pl = join_cols(pl, g2);
       g2 = vcsig2.elem(resKeep);
       pl = join_cols(pl, g2);
-      par_hist.row(kiter) = pl.t();
-      if (print != 0 && (kiter==0 || (kiter+1)%print==0)) {
-        RSprintf("%03d: ", kiter+1);
+      par_hist.row(krow) = pl.t();
+      if (print != 0 && (krow==0 || (krow+1)%print==0)) {
+        RSprintf("%03d: ", krow+1);
         for (arma::uword j=0; j < pl.size(); ++j) {
           RSprintf("%f\t", pl[j]);
         }
         RSprintf("\n");
       }
+      profAdd(&profIter, tIter);
       Rcpp::checkUserInterrupt();
+      if ((int)kiter < nburn) {
+        convBurn++;
+        if ((int)kiter < nburn - 1 && (int)kiter >= minBurn &&
+            parHistConverged(krow, kphase)) {
+          convBurnStop = true;
+          if (print != 0) {
+            RSprintf("nBurn phase converged at iteration %d\n", krow+1);
+          }
+          kiter = nburn - 1;
+        }
+      } else {
+        // The nEm window starts at its first row, whether or not the
+        // nBurn phase stopped early
+        if ((int)kiter == nburn) kphase = krow;
+        convEm++;
+        if ((int)kiter < niter - 1 && parHistConverged(krow, kphase)) {
+          convEmStop = true;
+          if (print != 0) {
+            RSprintf("nEm phase converged at iteration %d\n", krow+1);
+          }
+          krow++;
+          break;
+        }
+      }
+      if (!ckptFile.empty() && tIter - ckptLast >= ckptInterval) {
+        ckptLast = tIter;
+        checkpointWrite(kiter, krow, kphase);
+      }
+      krow++;
     }//kiter
-    phiFile.close();
+    if (krow < (int)par_hist.n_rows) {
+      par_hist.shed_rows(krow, par_hist.n_rows - 1);
+    }
+    if (phiTrace > 0) phiFile.close();
   }
 
 
@@ -1755,6 +1971,198 @@ private:
   int nmc;
   int nM;
 
+  // do_mcmc() buffers (see mcmcSetup())
+  mat mcmcPhiMc, mcmcFcMat;
+  vec mcmcRand, mcmcProp, mcmcDphi, mcmcDphiG;
+  vec mcmcRandv, mcmcU, mcmcUcY, mcmcUcPhi;
+  vec mcmcFc, mcmcFs, mcmcFcT, mcmcGc;
+  vec mcmcYt, mcmcYtLambda;
+
+  profPhase_t profIter, profMcmc;
+  vec profProp, profAcc; // MCMC proposals/acceptances by subject
+
+  // Convergence monitor: the relative change of the means of the last
+  // two convWindow iterations of par_hist (within the same phase)
+  int nburn, convWindow;
+  double convTol, convChange;
+  int convBurn, convEm;
+  bool convBurnStop, convEmStop;
+
+  bool parHistConverged(int k, int start) {
+    if (convWindow <= 0 || k - start + 1 < 2*convWindow ||
+        par_hist.n_cols == 0) return false;
+    rowvec m0 = arma::mean(par_hist.rows(k - 2*convWindow + 1, k - convWindow), 0);
+    rowvec m1 = arma::mean(par_hist.rows(k - convWindow + 1, k), 0);
+    rowvec den = arma::clamp(arma::abs(m0), 1e-8, datum::inf);
+    convChange = arma::max(arma::abs(m1 - m0)/den);
+    return convChange < convTol;
+  }
+
+  // phi trace (every phiTrace iterations, 0 for none) and the running
+  // (Welford) mean and sum of squares of phi by subject
+  int phiTrace;
+  mat phiMean, phiM2;
+  double phiN;
+
+  // Each chain is one more draw of every subject's phi
+  void phiAccumulate() {
+    for (int k = 0; k < nmc; ++k) {
+      phiN++;
+      for (int j = 0; j < nphi; ++j) {
+        for (int i = 0; i < N; ++i) {
+          double x = phiM(k*N + i, j);
+          double d = x - phiMean(i, j);
+          phiMean(i, j) += d/phiN;
+          phiM2(i, j) += d*(x - phiMean(i, j));
+        }
+      }
+    }
+  }
+
+  // Checkpoints (saemControl(checkpoint=)): every iteration that
+  // starts at least ckptInterval seconds after the last checkpoint
+  // saves the stochastic approximation state and the random number
+  // generator so a resumed fit continues as if uninterrupted
+  std::string ckptFile, ckptResume;
+  double ckptInterval;
+
+  void checkpointWrite(unsigned int kiter, int krow, int kphase) {
+    ckpt_t ck;
+    ckptAdd(ck, "type", 2.0);
+    ckptAdd(ck, "kiter", (double)kiter);
+    ckptAdd(ck, "krow", (double)krow);
+    ckptAdd(ck, "kphase", (double)kphase);
+    ckptAdd(ck, "nburn", (double)nburn);
+    ckptAdd(ck, "N", (double)N);
+    ckptAdd(ck, "nmc", (double)nmc);
+    ckptAdd(ck, "phiM", phiM);
+    ckptAdd(ck, "fsave", fsave);
+    ckptAdd(ck, "limit", limit);
+    ckptAdd(ck, "limitT", limitT);
+    ckptAdd(ck, "cens", cens);
+    ckptAdd(ck, "statphi01", statphi01);
+    ckptAdd(ck, "statphi02", statphi02);
+    ckptAdd(ck, "statphi11", statphi11);
+    ckptAdd(ck, "statphi12", statphi12);
+    ckptAdd(ck, "statrese", statrese, nendpnt, 1);
+    ckptAdd(ck, "sigma2", sigma2, nendpnt, 1);
+    ckptAdd(ck, "Gamma2_phi1", Gamma2_phi1);
+    ckptAdd(ck, "Gamma2_phi0", Gamma2_phi0);
+    ckptAdd(ck, "dGamma2_phi0", dGamma2_phi0);
+    ckptAdd(ck, "MCOV1", MCOV1);
+    ckptAdd(ck, "MCOV0", MCOV0);
+    ckptAdd(ck, "mprior_phi1", mprior_phi1);
+    ckptAdd(ck, "mprior_phi0", mprior_phi0);
+    ckptAdd(ck, "Plambda", Plambda);
+    ckptAdd(ck, "ares", ares);
+    ckptAdd(ck, "bres", bres);
+    ckptAdd(ck, "cres", cres);
+    ckptAdd(ck, "lres", lres);
+    ckptAdd(ck, "vecares", vecares);
+    ckptAdd(ck, "vecbres", vecbres);
+    ckptAdd(ck, "vcsig2", vcsig2);
+    ckptAdd(ck, "L", L);
+    ckptAdd(ck, "Ha", Ha);
+    ckptAdd(ck, "Hb", Hb);
+    ckptAdd(ck, "mpost_phi", mpost_phi);
+    ckptAdd(ck, "cpost_phi", cpost_phi);
+    ckptAdd(ck, "par_hist", par_hist);
+    ckptAdd(ck, "phiMean", phiMean);
+    ckptAdd(ck, "phiM2", phiM2);
+    ckptAdd(ck, "phiN", phiN);
+    ckptAdd(ck, "profProp", profProp);
+    ckptAdd(ck, "profAcc", profAcc);
+    double conv[5] = {(double)convBurn, (double)convEm, (double)convBurnStop,
+                      (double)convEmStop, convChange};
+    ckptAdd(ck, "conv", conv, 5, 1);
+    ckptAddRNG(ck);
+    if (!ckptWrite(ck, ckptFile)) {
+      Rf_warning(_("could not write the checkpoint '%s'"), ckptFile.c_str());
+      ckptFile.clear();
+    }
+  }
+
+  // Copy a checkpointed array into a member
+  void checkpointGet(const ckpt_t &ck, const char *name, double *x, int n) {
+    const ckptArray_t *a = ckptGet(ck, name);
+    if (a == NULL || (int)a->x.size() != n) {
+      Rcpp::stop(_("checkpoint '%s' does not match this fit (%s)"), ckptResume.c_str(), name);
+    }
+    std::copy(a->x.begin(), a->x.end(), x);
+  }
+
+  void checkpointGet(const ckpt_t &ck, const char *name, mat &m) {
+    const ckptArray_t *a = ckptGet(ck, name);
+    if (a == NULL) {
+      Rcpp::stop(_("checkpoint '%s' does not match this fit (%s)"), ckptResume.c_str(), name);
+    }
+    m.set_size(a->nrow, a->ncol);
+    std::copy(a->x.begin(), a->x.end(), m.memptr());
+  }
+
+  void checkpointGet(const ckpt_t &ck, const char *name, vec &v) {
+    const ckptArray_t *a = ckptGet(ck, name);
+    if (a == NULL) {
+      Rcpp::stop(_("checkpoint '%s' does not match this fit (%s)"), ckptResume.c_str(), name);
+    }
+    v.set_size(a->x.size());
+    std::copy(a->x.begin(), a->x.end(), v.memptr());
+  }
+
+  double checkpointGet(const ckpt_t &ck, const char *name) {
+    double x;
+    checkpointGet(ck, name, &x, 1);
+    return x;
+  }
+
+  void checkpointRead(unsigned int &kiter0, int &krow, int &kphase) {
+    ckpt_t ck;
+    ckptRead(ck, ckptResume);
+    const ckptArray_t *ph = ckptGet(ck, "par_hist");
+    // The run can be extended with more nEm iterations: the rows of
+    // the iterations already run are kept and the step sizes of these
+    // iterations do not depend on nEm
+    if (checkpointGet(ck, "type") != 2.0 || checkpointGet(ck, "N") != N ||
+        checkpointGet(ck, "nmc") != nmc || checkpointGet(ck, "nburn") != nburn ||
+        ph == NULL || ph->nrow > (int)par_hist.n_rows ||
+        ph->ncol != (int)par_hist.n_cols) {
+      Rcpp::stop(_("checkpoint '%s' does not match this fit"), ckptResume.c_str());
+    }
+    // the checkpoint is at the end of an iteration
+    kiter0 = (unsigned int)checkpointGet(ck, "kiter") + 1;
+    krow = (int)checkpointGet(ck, "krow") + 1;
+    kphase = (int)checkpointGet(ck, "kphase");
+    checkpointGet(ck, "phiM", phiM.memptr(), phiM.n_elem);
+    mat parHist0;
+    checkpointGet(ck, "par_hist", parHist0);
+    par_hist.rows(0, parHist0.n_rows - 1) = parHist0;
+    checkpointGet(ck, "statrese", statrese, nendpnt);
+    checkpointGet(ck, "sigma2", sigma2, nendpnt);
+    const char *matNames[] = {"statphi01", "statphi02", "statphi11", "statphi12",
+      "Gamma2_phi1", "Gamma2_phi0", "MCOV1", "MCOV0", "mprior_phi1", "mprior_phi0",
+      "Ha", "Hb", "mpost_phi", "cpost_phi", "phiMean", "phiM2"};
+    mat *mats[] = {&statphi01, &statphi02, &statphi11, &statphi12,
+      &Gamma2_phi1, &Gamma2_phi0, &MCOV1, &MCOV0, &mprior_phi1, &mprior_phi0,
+      &Ha, &Hb, &mpost_phi, &cpost_phi, &phiMean, &phiM2};
+    for (int i = 0; i < 16; ++i) checkpointGet(ck, matNames[i], *(mats[i]));
+    const char *vecNames[] = {"fsave", "limit", "limitT", "cens", "dGamma2_phi0",
+      "Plambda", "ares", "bres", "cres", "lres", "vecares", "vecbres", "vcsig2",
+      "L", "profProp", "profAcc"};
+    vec *vecs[] = {&fsave, &limit, &limitT, &cens, &dGamma2_phi0,
+      &Plambda, &ares, &bres, &cres, &lres, &vecares, &vecbres, &vcsig2,
+      &L, &profProp, &profAcc};
+    for (int i = 0; i < 16; ++i) checkpointGet(ck, vecNames[i], *(vecs[i]));
+    phiN = checkpointGet(ck, "phiN");
+    double conv[5];
+    checkpointGet(ck, "conv", conv, 5);
+    convBurn = (int)conv[0];
+    convEm = (int)conv[1];
+    convBurnStop = conv[2] != 0.0;
+    convEmStop = conv[3] != 0.0;
+    convChange = conv[4];
+    ckptSetRNG(ck);
+  }
+
   int ntotal, N;
   vec y, yM, ys;    //ys is y sorted by endpnt
   mat evt, evtM;
@@ -1813,6 +2221,51 @@ private:
 
   int nendpnt;
   uvec ix_endpnt;
+  std::vector<uvec> endpntIdx; // observations of each endpoint in ysM
+  int resCores;
+
+  // Number of residual parameters of endpoint b optimized by _saemOpt()
+  int resOptN(int b, unsigned int kiter) {
+    int n;
+    switch (res_mod(b)) {
+    case rmAddProp:
+    case rmPow:
+    case rmAddLam:
+    case rmPropLam:
+      n = 2;
+      break;
+    case rmAddPow:
+    case rmPowLam:
+    case rmAddPropLam:
+      n = 3;
+      break;
+    case rmAddPowLam:
+      n = 4;
+      break;
+    default:
+      return 0;
+    }
+    if (kiter > (unsigned int)(nb_fixResid)) {
+      int offsetR = res_offset[b], nf = 0;
+      for (int i = 0; i < n; ++i) nf += resFixed[offsetR + i];
+      n -= nf;
+    }
+    return n;
+  }
+
+  // The endpoints can only be optimized in parallel when there is more
+  // than one Nelder-Mead optimization and no one dimensional
+  // optimization (which uses R's optimizer)
+  bool resOptPar(unsigned int kiter) {
+    if (resCores <= 1 || nendpnt <= 1 || _saemType != 1) return false;
+    int nopt = 0;
+    for (int b = 0; b < nendpnt; ++b) {
+      int n = resOptN(b, kiter);
+      if (n == 1) return false;
+      if (n > 1) nopt++;
+    }
+    return nopt > 1;
+  }
   umat ix_idM;
   uvec y_offset;
   uvec res_offset;
@@ -1845,8 +2298,72 @@ private:
   }
 
   static inline void doCens(mat &DYF, vec &cens, vec &limit, vec &fc, vec &r, const vec &dv) {
-    for (int j = (int)cens.size(); j--;) {
-      DYF(j) = doCensNormal1(cens[j], dv[j], limit[j], DYF(j), fc[j], r[j], 0);
+    doCensNormalV((int)cens.size(), cens.memptr(), dv.memptr(), limit.memptr(),
+                  DYF.memptr(), fc.memptr(), r.memptr(), 0);
+  }
+
+  // Allocate the MCMC buffers once per fit; do_mcmc() only writes
+  // into them
+  void mcmcSetup() {
+    int nobs = mx.yM.n_elem;
+    int nphiMax = max2(nphi1, nphi0);
+    mcmcPhiMc.set_size(nM, phiM.n_cols);
+    mcmcRand.set_size(nM*nphiMax);
+    mcmcProp.set_size(nM*nphiMax);
+    mcmcDphi.set_size(nM*nphiMax);
+    mcmcDphiG.set_size(nM*nphiMax);
+    mcmcFcMat.set_size(nobs, 3);
+    mcmcRandv.set_size(nM);
+    mcmcU.set_size(nM);
+    mcmcUcY.set_size(nM);
+    mcmcUcPhi.set_size(nM);
+    mcmcFc.set_size(nobs);
+    mcmcFs.set_size(nobs);
+    mcmcFcT.set_size(nobs);
+    mcmcGc.set_size(nobs);
+    mcmcYt.set_size(nobs);
+    mcmcYtLambda.set_size(nendpnt);
+    mcmcYtLambda.fill(datum::nan);
+  }
+
+  // Transformed observations; only the endpoints where lambda changed
+  // since the last call are transformed again
+  void mcmcYtUpdate() {
+    bool any = false;
+    for (int b = 0; b < nendpnt; ++b) {
+      if (mcmcYtLambda[b] != lambda(b)) {
+        any = true;
+        break;
+      }
+    }
+    if (!any) return;
+    int n = mx.yM.n_elem, i = 0;
+    while (i < n) {
+      int cur = ix_endpnt(i), j = tbsEndpntRunEnd(i, n);
+      if (mcmcYtLambda[cur] != lambda(cur)) {
+        tbsD(mcmcYt.memptr() + i, mx.yM.memptr() + i, j - i,
+             lambda(cur), yj(cur), low(cur), hi(cur));
+      }
+      i = j;
+    }
+    for (int b = 0; b < nendpnt; ++b) {
+      mcmcYtLambda[b] = lambda(b);
+    }
+  }
+
+  // Observations are transformed in runs of the same endpoint
+  int tbsEndpntRunEnd(int i, int n) {
+    int j = i + 1;
+    while (j < n && ix_endpnt(j) == ix_endpnt(i)) j++;
+    return j;
+  }
+
+  void tbsEndpnt(double *out, const double *x, int n) {
+    int i = 0;
+    while (i < n) {
+      int cur = ix_endpnt(i), j = tbsEndpntRunEnd(i, n);
+      tbsD(out + i, x + i, j - i, lambda(cur), yj(cur), low(cur), hi(cur));
+      i = j;
     }
   }
 
@@ -1858,87 +2375,144 @@ private:
                mat &phiM,
                vec &U_y,
                vec &U_phi) {
-    mat fcMat;
-    vec fc, fs, Uc_y, Uc_phi, deltu;
-    uvec ind;
-    vec gc;
-
-    uvec i=mphi.i;
+    const uvec &i=mphi.i;
+    const int nM = mx.nM, nphi = mphi.nphi, nobs = mx.yM.n_elem;
     double double_xmin = 1.0e-200;                               //FIXME hard-coded xmin, also in neldermean.hpp
     double xmax = 1e300;
+    // nM x nphi views of the scratch buffers
+    mat rnd(mcmcRand.memptr(), nM, nphi, false, true);
+    mat prop(mcmcProp.memptr(), nM, nphi, false, true);
+    mat dphic(mcmcDphi.memptr(), nM, nphi, false, true);
+    mat dphicG(mcmcDphiG.memptr(), nM, nphi, false, true);
+    mcmcYtUpdate();
+    // Only the proposed columns differ from phiM
+    mcmcPhiMc = phiM;
     for (int u=0; u<nu; u++)
-      for (int k1=0; k1<mphi.nphi; k1++) {
-        mat phiMc=phiM;
-
+      for (int k1=0; k1<nphi; k1++) {
         switch (method) {
         case 1:
-          phiMc.cols(i)=randn<mat>(mx.nM,mphi.nphi)*mphi.Gamma_phi+mphi.mprior_phiM;
+          rnd.randn();
+          prop = rnd*mphi.Gamma_phi;
+          for (int k = nphi; k--;) {
+            uword c = i(k);
+            for (int r = nM; r--;) {
+              mcmcPhiMc(r, c) = prop(r, k) + mphi.mprior_phiM(r, k);
+            }
+          }
           break;
         case 2:
-          phiMc.cols(i)=phiM.cols(i)+randn<mat>(mx.nM,mphi.nphi)*mphi.Gdiag_phi;
+          rnd.randn();
+          prop = rnd*mphi.Gdiag_phi;
+          for (int k = nphi; k--;) {
+            uword c = i(k);
+            for (int r = nM; r--;) {
+              mcmcPhiMc(r, c) = phiM(r, c) + prop(r, k);
+            }
+          }
           break;
-        case 3:
-          phiMc.col(i(k1))=phiM.col(i(k1))+randn<vec>(mx.nM)*mphi.Gdiag_phi(k1,k1);
+        case 3: {
+          mcmcRandv.randn();
+          uword c = i(k1);
+          double g = mphi.Gdiag_phi(k1,k1);
+          for (int r = nM; r--;) {
+            mcmcPhiMc(r, c) = phiM(r, c) + mcmcRandv[r]*g;
+          }
+        }
           break;
         }
 
-        fcMat = user_fn(phiMc, mx.evtM, mx.optM);
-        limit = fcMat.col(2);
-        limitT = fcMat.col(2);
-        cens = fcMat.col(1);
-
-        fc = fcMat.col(0);
-        vec fcT(fc.size());
-        fs = fc;
-        vec yt(fc.size());
-        for (int i = fc.size(); i--;) {
-          int cur = ix_endpnt(i);
-          limitT[i] = _powerD(limit[i], lambda(cur), yj(cur), low(cur), hi(cur));
-          fc(i)     = _powerD(fc(i), lambda(cur), yj(cur), low(cur), hi(cur));
-          yt(i)     = _powerD(mx.yM(i), lambda(cur), yj(cur), low(cur), hi(cur));
-          fcT(i)    = handleF(propT(cur), fs(i), fc(i), false, true);
+        user_fn(mcmcFcMat, mcmcPhiMc, mx.evtM, mx.optM);
+        limit = mcmcFcMat.col(2);
+        limitT = mcmcFcMat.col(2);
+        cens = mcmcFcMat.col(1);
+
+        std::copy(mcmcFcMat.colptr(0), mcmcFcMat.colptr(0) + nobs, mcmcFs.memptr());
+        tbsEndpnt(limitT.memptr(), limit.memptr(), nobs);
+        tbsEndpnt(mcmcFc.memptr(), mcmcFs.memptr(), nobs);
+        for (int j = nobs; j--;) {
+          int cur = ix_endpnt(j);
+          mcmcFcT[j] = handleF(propT(cur), mcmcFs[j], mcmcFc[j], false, true);
+          double gc = vecares[j] + vecbres[j]*fabs(mcmcFcT[j]); //make sure gc > 0
+          if (gc == 0.0) gc = 1;
+          if (gc < double_xmin) gc = double_xmin;
+          if (gc > xmax) gc = xmax;
+          mcmcGc[j] = gc;
         }
-        gc = vecares + vecbres % abs(fcT); //make sure gc > 0
-        gc.elem( find( gc == 0.0) ).fill(1);
-        gc.elem( find( gc < double_xmin) ).fill(double_xmin);
-        gc.elem( find( gc > xmax) ).fill(xmax);
 
         switch (distribution) {
         case 1:
-          DYF(mx.indioM)=0.5*(((yt-fc)/gc)%((yt-fc)/gc))+log(gc);
+          for (int j = nobs; j--;) {
+            double d = (mcmcYt[j]-mcmcFc[j])/mcmcGc[j];
+            DYF(mx.indioM[j]) = 0.5*(d*d)+log(mcmcGc[j]);
+          }
           break;
         case 2:
-          DYF(mx.indioM)=-mx.yM%log(fc)+fc;
+          for (int j = nobs; j--;) {
+            DYF(mx.indioM[j]) = -mx.yM[j]*log(mcmcFc[j])+mcmcFc[j];
+          }
           break;
         case 3:
-          DYF(mx.indioM)=-mx.yM%log(fc)-(1-mx.yM)%log(1-fc);
+          for (int j = nobs; j--;) {
+            DYF(mx.indioM[j]) = -mx.yM[j]*log(mcmcFc[j])-(1-mx.yM[j])*log(1-mcmcFc[j]);
+          }
           break;
         }
-        doCens(DYF, cens, limitT, fc, gc, mx.yM);
+        doCens(DYF, cens, limitT, mcmcFc, mcmcGc, mx.yM);
 
-        Uc_y=sum(DYF,0).t();
-        if (method==1) {
-          deltu=Uc_y-U_y;
+        for (int r = nM; r--;) {
+          mcmcUcY[r] = accu(DYF.unsafe_col(r));
         }
-        else {
-          mat dphic=phiMc.cols(i)-mphi.mprior_phiM;
-          Uc_phi=0.5*sum(dphic%(dphic*mphi.IGamma2_phi),1);
-          deltu=Uc_y-U_y+Uc_phi-U_phi;
+        if (method > 1) {
+          for (int k = nphi; k--;) {
+            uword c = i(k);
+            for (int r = nM; r--;) {
+              dphic(r, k) = mcmcPhiMc(r, c) - mphi.mprior_phiM(r, k);
+            }
+          }
+          dphicG = dphic*mphi.IGamma2_phi;
+          for (int r = nM; r--;) {
+            double cur = 0.0;
+            for (int k = 0; k < nphi; ++k) {
+              cur += dphic(r, k)*dphicG(r, k);
+            }
+            mcmcUcPhi[r] = 0.5*cur;
+          }
         }
 
-        ind=find( deltu < -log(randu<vec>(mx.nM)) );
-        phiM(ind,i)=phiMc(ind,i);
-        U_y(ind)=Uc_y(ind);
-        if (method>1) {
-          U_phi(ind)=Uc_phi(ind);
+        mcmcU.randu();
+        profProp += nmc;
+        for (int r = 0; r < nM; ++r) {
+          double deltu;
+          if (method==1) {
+            deltu = mcmcUcY[r] - U_y[r];
+          } else {
+            deltu = mcmcUcY[r] - U_y[r] + mcmcUcPhi[r] - U_phi[r];
+          }
+          if (deltu < -log(mcmcU[r])) {
+            for (int k = nphi; k--;) {
+              uword c = i(k);
+              phiM(r, c) = mcmcPhiMc(r, c);
+            }
+            U_y[r] = mcmcUcY[r];
+            if (method>1) {
+              U_phi[r] = mcmcUcPhi[r];
+            }
+            for (uword j = ix_idM(r, 0); j <= ix_idM(r, 1); ++j) {
+              fsave[j] = mcmcFs[j];
+            }
+            profAcc[r % N]++;
+          } else if (method == 3) {
+            // Single column proposals keep the other columns of phiM
+            uword c = i(k1);
+            mcmcPhiMc(r, c) = phiM(r, c);
+          }
         }
-        ind = getObsIdx(ix_idM.rows(ind));
-        fsave(ind)=fs(ind);
         if (method<3) {
           break;
         }
       }
   }
+
 };
 
 
@@ -1989,17 +2563,58 @@ rxGetId_t rxGetIdS;
 
 CharacterVector parNames;
 
-mat user_function(const mat &_phi, const mat &_evt, const List &_opt) {
+// Parameters and predictions (rows of g) of the last solve by subject
+// and chain.  Subjects whose parameters did not change since their last
+// solve are not solved again; the cache is dropped by setupRx().
+std::vector<double> _saemLastPar;
+std::vector<int> _saemLastOff; // first row of each subject in g (N+1)
+std::vector<int> _saemSolveMask;
+mat _saemLastG;
+int _saemLastN = 0;
+int _saemLastK = 0;
+
+static inline void _saemSolveCacheReset() {
+  _saemLastPar.clear();
+  _saemLastOff.clear();
+  _saemLastG.reset();
+  _saemLastN = 0;
+  _saemLastK = 0;
+}
+
+void user_function(mat &g, const mat &_phi, const mat &_evt, const List &_opt) {
   // yp has all the observations in the dataset
+  double t0 = profNow();
   rx_solving_options_ind *ind;
   rx_solving_options *op = _rx->op;
-  vec _id = _evt.col(0);
-  int _Nnlmixr2=(int)(_id.max()+1);
+  int _Nnlmixr2=(int)(_evt.col(0).max()+1);
   SEXP paramUpdate = _opt["paramUpdate"];
   int *doParam = INTEGER(paramUpdate);
   int nPar = Rf_length(paramUpdate);
+  int nK = 0;
+  for (int _j = 0; _j < nPar; _j++){
+    if (doParam[_j] == 1) nK++;
+  }
+  bool useCache = (_saemLastN == _Nnlmixr2 && _saemLastK == nK &&
+                   (int)_saemLastG.n_rows == _rx->nobs2);
+  _saemSolveMask.assign(_Nnlmixr2, 1);
+  int nSolve = 0;
   // Fill in subject parameter information
   for (int _i = 0; _i < _Nnlmixr2; ++_i) {
+    if (useCache) {
+      double *last = _saemLastPar.data() + _i*nK;
+      bool same = true;
+      for (int k = nK; k--;) {
+        if (last[k] != _phi(_i, k)) {
+          same = false;
+          break;
+        }
+      }
+      if (same) {
+        _saemSolveMask[_i] = 0;
+        continue;
+      }
+    }
+    nSolve++;
     ind = &(_rx->subjects[_i]);
     ind->solved = -1;
     // ind->par_ptr
@@ -2010,25 +2625,47 @@ mat user_function(const mat &_phi, const mat &_evt, const List &_opt) {
       }
     }
   }
-  _rx->op->badSolve = 0;
-  saem_solve(_rx); // Solve the complete system (possibly in parallel)
+  _saemProfSubSolve += nSolve;
+  _saemProfSubCache += _Nnlmixr2 - nSolve;
   int j=0;
-  while (_rx->op->badSolve && j < _saemMaxOdeRecalc){
-    _saemIncreaseTol=1;
-    rxode2::atolRtolFactor_(_saemOdeRecalcFactor);
+  if (nSolve > 0) {
     _rx->op->badSolve = 0;
-    saem_solve(_rx);
-    j++;
+    saem_solve(_rx); // Solve the complete system (possibly in parallel)
+    while (_rx->op->badSolve && j < _saemMaxOdeRecalc){
+      _saemIncreaseTol=1;
+      rxode2::atolRtolFactor_(_saemOdeRecalcFactor);
+      _rx->op->badSolve = 0;
+      for (int _i = 0; _i < _Nnlmixr2; ++_i) {
+        if (_saemSolveMask[_i]) _rx->subjects[_i].solved = -1;
+      }
+      saem_solve(_rx);
+      j++;
+    }
   }
   if (j != 0) {
     // Not thread safe
     rxode2::atolRtolFactor_(pow(_saemOdeRecalcFactor, -j));
   }
-  mat g(_rx->nobs2, 3); // nobs EXCLUDING EVID=2
+  _saemProfRecalc += j;
+  g.set_size(_rx->nobs2, 3); // nobs EXCLUDING EVID=2
+  if (!useCache) {
+    _saemLastOff.assign(_Nnlmixr2 + 1, 0);
+  }
   int elt=0;
   bool hasNan = false;
   unsigned int nNanWarn=0;
   for (int id = 0; id < _Nnlmixr2; ++id) {
+    if (!_saemSolveMask[id]) {
+      // Same parameters as the last solve
+      int end = _saemLastOff[id + 1];
+      for (int c = 0; c < 3; ++c) {
+        std::copy(_saemLastG.colptr(c) + elt, _saemLastG.colptr(c) + end,
+                  g.colptr(c) + elt);
+      }
+      elt = end;
+      continue;
+    }
+    _saemLastOff[id] = elt;
     ind = &(_rx->subjects[id]);
     iniSubjectE(op->neq, 1, ind, op, _rx, saem_inis);
     for (int j = 0; j < ind->n_all_times; ++j){
@@ -2066,8 +2703,30 @@ mat user_function(const mat &_phi, const mat &_evt, const List &_opt) {
 	elt++;
       } // evid=2 does not need to be calculated
     }
+    _saemLastOff[id + 1] = elt;
+  }
+  // Save the solved subjects for the next call
+  if (!useCache) {
+    _saemLastG = g;
+    _saemLastPar.resize(_Nnlmixr2*nK);
+    _saemLastN = _Nnlmixr2;
+    _saemLastK = nK;
+  } else if (nSolve > 0) {
+    for (int id = 0; id < _Nnlmixr2; ++id) {
+      if (!_saemSolveMask[id]) continue;
+      int beg = _saemLastOff[id], end = _saemLastOff[id + 1];
+      for (int c = 0; c < 3; ++c) {
+        std::copy(g.colptr(c) + beg, g.colptr(c) + end, _saemLastG.colptr(c) + beg);
+      }
+    }
+  }
+  for (int id = 0; id < _Nnlmixr2; ++id) {
+    if (!_saemSolveMask[id]) continue;
+    for (int k = nK; k--;) {
+      _saemLastPar[id*nK + k] = _phi(id, k);
+    }
   }
-  if (op->stiff == 2) { // liblsoda
+  if (nSolve > 0 && op->stiff == 2) { // liblsoda
     // Order by the overall solve time
     // Should it be done every time? Every x times?
     sortIds(_rx, 0);
@@ -2076,7 +2735,7 @@ mat user_function(const mat &_phi, const mat &_evt, const List &_opt) {
     RSprintf("NaN in prediction; Consider: relax atol & rtol; change initials; change seed; change structural model\n  warning only issued once per problem\n");
     _warnAtolRtol = true;
   }
-  return g;
+  profAdd(&_saemProfSolve, t0);
 }
 
 typedef SEXP(*mv_t)(SEXP);
@@ -2085,6 +2744,7 @@ mv_t rxModelVarsS;
 
 void setupRx(List &opt, SEXP evt, SEXP evtM) {
   RObject obj = opt[".rx"];
+  _saemSolveCacheReset();
   bool doIni = false;
   if (getRx_ == NULL) {
     getRx_ = (getRxSolve_t) R_GetCCallable("rxode2","getRxSolve_");
@@ -2139,7 +2799,8 @@ SEXP saem_do_pred(SEXP in_phi, SEXP in_evt, SEXP in_opt) {
   _rx=getRx_();
   mat phi = as<mat>(in_phi);
   mat evt = as<mat>(in_evt);
-  mat gMat = user_function(phi, evt, opt);
+  mat gMat;
+  user_function(gMat, phi, evt, opt);
   vec g = gMat.col(0);
   return wrap(g);
 }
@@ -2166,6 +2827,11 @@ SEXP saem_fit(SEXP xSEXP) {
   saem_inis = getUpdateInis();
   _rx=getRx_();
 
+  profZero(&_saemProfSolve);
+  profZero(&_saemProfResid);
+  _saemProfRecalc = 0;
+  _saemProfSubSolve = 0;
+  _saemProfSubCache = 0;
   SAEM saem;
   saem.inits(x);
   saem.set_fn(user_function);
@@ -2182,7 +2848,11 @@ SEXP saem_fit(SEXP xSEXP) {
     Named("sig2") = saem.get_sig2(),
     Named("eta") = saem.get_eta(),
     Named("par_hist") = saem.get_par_hist(),
-    Named("res_info") = saem.get_resInfo()
+    Named("res_info") = saem.get_resInfo(),
+    Named("phi_mean") = saem.get_phi_mean(),
+    Named("phi_sd") = saem.get_phi_sd(),
+    Named("converge") = saem.get_converge(),
+    Named("profile") = saem.get_profile()
   );
   out.attr("saem.cfg") = x;
   out.attr("class") = "saemFit";
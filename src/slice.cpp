@@ -22,6 +22,14 @@
 #include <math.h>
 #include <stdlib.h>
 #include <Rcpp.h>
+#include <vector>
+#include <random>
+#include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#define __nlmixr2est_optim_internal__
+#include "../inst/include/nlmixr2est_optim.h"
 
 //#define genunf(a,b) Rcpp::runif(1, (a), (b))[0]
 #define genunf(a,b) (a) + ((b) - (a))*R::unif_rand()
@@ -31,6 +39,14 @@ double rexp(double beta)
 	return -log(genunf(0,1))/beta;
 }
 
+// rexp() from the uniform source of the chain; with R's generator this
+// is the same single uniform draw as rexp(), so the stream is unchanged
+template <class U>
+static inline double slice_rexp(U &unif, double beta)
+{
+	return -log(unif(0,1))/beta;
+}
+
 /*--
 C TRANSLATION OF
 R FUNCTION FOR PERFORMING UNIVARIATE SLICE SAMPLING.
@@ -82,23 +98,22 @@ In addition to giving wrong answers, wrong values for gx0 may result in
 the uni.slice function going into an infinite loop.
 --*/
 
-double uni_slice(double x0, double (*g)(double), double w, int m, double lower, double upper)
+template <class G, class U>
+static inline double uni_slice0(double x0, G &g, double w, int m, double lower, double upper,
+                                U &unif, int *nevals)
 {
 	int J, K;
 	double u, L, R, logy, gx0, x1, gx1;
 
-	// Keep track of the number of calls made to this function.
-	uni_slice_calls ++;
-
 	// Find the log density at the initial point, if not already known.
-	uni_slice_evals ++;
+	(*nevals)++;
     gx0 = g(x0);
 
 	// Determine the slice level, in log terms.
-	logy = gx0 - rexp(1);
+	logy = gx0 - slice_rexp(unif, 1);
 
 	// Find the initial interval to sample from.
-	u = genunf(0,w);
+	u = unif(0,w);
 	L = x0 - u;
 	R = x0 + (w-u);  // should guarantee that x0 is in [L,R], even with roundoff
 
@@ -110,27 +125,27 @@ double uni_slice(double x0, double (*g)(double), double w, int m, double lower,
 		for(;;)
 		{
 			if (L<=lower) break;
-			uni_slice_evals ++;
+			(*nevals)++;
 			if (g(L)<=logy) break;
 			L -= w;
 		}
 		for(;;)
 		{
 			if (R>=upper) break;
-			uni_slice_evals ++;
+			(*nevals)++;
 			if (g(R)<=logy) break;
 			R += w;
 		}
 	}
 	else if (m>1)  // limit on steps, bigger than one
 	{
-		J = floor(genunf(0,m));
+		J = floor(unif(0,m));
 		K = (m-1) - J;
 
 		while (J>0)
 		{
 			if (L<=lower) break;
-			uni_slice_evals ++;
+			(*nevals)++;
 			if (g(L)<=logy) break;
 			L -= w;
 			J--;
@@ -139,7 +154,7 @@ double uni_slice(double x0, double (*g)(double), double w, int m, double lower,
 		while (K>0)
 		{
 			if (R>=upper) break;
-			uni_slice_evals ++;
+			(*nevals)++;
 			if (g(R)<=logy) break;
 			R += w;
 			K --;
@@ -153,9 +168,9 @@ double uni_slice(double x0, double (*g)(double), double w, int m, double lower,
 	// Sample from the interval, shrinking it on each rejection.
 	for(;;)
 	{
-		x1 = genunf(L,R);
+		x1 = unif(L,R);
 
-		uni_slice_evals ++;
+		(*nevals)++;
 		gx1 = g(x1);
 
 		if (gx1>=logy) break;
@@ -169,6 +184,85 @@ double uni_slice(double x0, double (*g)(double), double w, int m, double lower,
 }
 
 
+// Uniforms from R's generator (only from the main thread)
+struct sliceUnifR {
+	double operator()(double a, double b) { return genunf(a,b); }
+};
+
+// Uniforms from a generator owned by one chain
+struct sliceUnifChain {
+	std::mt19937 gen;
+	std::uniform_real_distribution<double> u;
+	sliceUnifChain(uint32_t seed) : gen(seed), u(0.0, 1.0) { }
+	double operator()(double a, double b) {
+		double v;
+		do { v = u(gen); } while (v == 0.0);
+		return a + (b - a)*v;
+	}
+};
+
+struct sliceFn {
+	double (*g)(double);
+	double operator()(double x) { return g(x); }
+};
+
+struct sliceFnEx {
+	slice_ld_t g;
+	int chain;
+	void *ex;
+	double operator()(double x) { return g(x, chain, ex); }
+};
+
+double uni_slice(double x0, double (*g)(double), double w, int m, double lower, double upper)
+{
+	// Keep track of the number of calls made to this function.
+	uni_slice_calls ++;
+	sliceFn f = {g};
+	sliceUnifR unif;
+	return uni_slice0(x0, f, w, m, lower, upper, unif, &uni_slice_evals);
+}
+
+// Reentrant single update with a native log density; nevals is
+// incremented by the number of density evaluations.  It uses R's
+// uniform generator, so it should only be called from the main thread
+extern "C" double uni_slice2(double x0, slice_ld_t g, void *ex, double w, int m,
+                             double lower, double upper, int *nevals)
+{
+	sliceFnEx f = {g, 0, ex};
+	sliceUnifR unif;
+	return uni_slice0(x0, f, w, m, lower, upper, unif, nevals);
+}
+
+// nchain independent chains of nsamp updates each starting at x0[i].
+// The log density is called with the chain number and ex, and needs
+// to be thread safe when cores > 1.  Each chain has its own
+// generator seeded from R's generator, so the samples do not depend
+// on the number of cores.  out is nsamp x nchain (column major) and
+// nevals has the number of density evaluations of each chain.
+extern "C" void slice_chains(slice_ld_t g, void *ex, int nchain, const double *x0, int nsamp,
+                             double w, int m, double lower, double upper,
+                             double *out, int *nevals, int cores)
+{
+	std::vector<uint32_t> seed(nchain);
+	for (int i = 0; i < nchain; i++) {
+		seed[i] = (uint32_t)(genunf(0,1)*4294967295.0);
+	}
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cores) schedule(dynamic) if(cores > 1)
+#endif
+	for (int i = 0; i < nchain; i++) {
+		sliceFnEx f = {g, i, ex};
+		sliceUnifChain unif(seed[i]);
+		double x = x0[i];
+		nevals[i] = 0;
+		for (int j = 0; j < nsamp; j++) {
+			x = uni_slice0(x, f, w, m, lower, upper, unif, &nevals[i]);
+			out[j + (size_t)i*nsamp] = x;
+		}
+	}
+}
+
+
 /*
 
 x = rnorm(20, 1, 1)
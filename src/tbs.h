@@ -0,0 +1,209 @@
+#ifndef __TBS_H__
+#define __TBS_H__
+
+// Batched transform both sides (Box-Cox, Yeo-Johnson, logit, probit,
+// ...) kernels on contiguous arrays.
+//
+// The transformation type is dispatched once for each run of
+// observations sharing lambda, yj, low and hi (ie. an endpoint).
+// Box-Cox, Yeo-Johnson, untransformed and log runs have their own
+// loops; elements outside the regular domain (non-finite, or zero and
+// negative values for Box-Cox and log) and the other transformations
+// (logit, probit, ...) use rxode2's _powerD()/_powerDi() so the edge
+// cases stay defined in one place.  The output may be the same array
+// as the input.
+#include <rxode2.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+  static inline void tbsD(double *out, const double *x, int n,
+                          double lambda, int yj, double low, double hi) {
+    int i;
+    double xi, l2 = 2.0 - lambda;
+    switch (yj) {
+    case 0: // Box-Cox
+      if (lambda == 0.0) {
+        for (i = 0; i < n; ++i) {
+          xi = x[i];
+          out[i] = (xi > 0.0 && xi < R_PosInf) ? log(xi) :
+            _powerD(xi, lambda, yj, low, hi);
+        }
+        return;
+      } else if (lambda != 1.0 && R_FINITE(lambda)) {
+        for (i = 0; i < n; ++i) {
+          xi = x[i];
+          out[i] = (xi > 0.0 && xi < R_PosInf) ? (pow(xi, lambda) - 1.0) / lambda :
+            _powerD(xi, lambda, yj, low, hi);
+        }
+        return;
+      }
+      break;
+    case 1: // Yeo-Johnson
+      if (lambda != 0.0 && lambda != 1.0 && lambda != 2.0 && R_FINITE(lambda)) {
+        for (i = 0; i < n; ++i) {
+          xi = x[i];
+          if (!R_FINITE(xi)) {
+            out[i] = _powerD(xi, lambda, yj, low, hi);
+          } else if (xi >= 0.0) {
+            out[i] = (pow(xi + 1.0, lambda) - 1.0) / lambda;
+          } else {
+            out[i] = (1.0 - pow(1.0 - xi, l2)) / l2;
+          }
+        }
+        return;
+      }
+      break;
+    case 2: // untransformed
+      for (i = 0; i < n; ++i) {
+        xi = x[i];
+        out[i] = R_FINITE(xi) ? xi : _powerD(xi, lambda, yj, low, hi);
+      }
+      return;
+    case 3: // log
+      for (i = 0; i < n; ++i) {
+        xi = x[i];
+        out[i] = (xi > 0.0 && xi < R_PosInf) ? log(xi) :
+          _powerD(xi, lambda, yj, low, hi);
+      }
+      return;
+    }
+    for (i = 0; i < n; ++i) {
+      out[i] = _powerD(x[i], lambda, yj, low, hi);
+    }
+  }
+
+  static inline void tbsDi(double *out, const double *x, int n,
+                           double lambda, int yj, double low, double hi) {
+    int i;
+    double xi, b, l2 = 2.0 - lambda;
+    switch (yj) {
+    case 0: // Box-Cox
+      if (lambda == 0.0) {
+        for (i = 0; i < n; ++i) {
+          xi = x[i];
+          out[i] = R_FINITE(xi) ? exp(xi) : _powerDi(xi, lambda, yj, low, hi);
+        }
+        return;
+      } else if (lambda != 1.0 && R_FINITE(lambda)) {
+        for (i = 0; i < n; ++i) {
+          xi = x[i];
+          b = lambda * xi + 1.0;
+          out[i] = (R_FINITE(xi) && b > 0.0) ? pow(b, 1.0 / lambda) :
+            _powerDi(xi, lambda, yj, low, hi);
+        }
+        return;
+      }
+      break;
+    case 1: // Yeo-Johnson
+      if (lambda != 0.0 && lambda != 1.0 && lambda != 2.0 && R_FINITE(lambda)) {
+        for (i = 0; i < n; ++i) {
+          xi = x[i];
+          b = (xi >= 0.0) ? lambda * xi + 1.0 : 1.0 - l2 * xi;
+          if (!R_FINITE(xi) || b <= 0.0) {
+            out[i] = _powerDi(xi, lambda, yj, low, hi);
+          } else if (xi >= 0.0) {
+            out[i] = pow(b, 1.0 / lambda) - 1.0;
+          } else {
+            out[i] = 1.0 - pow(b, 1.0 / l2);
+          }
+        }
+        return;
+      }
+      break;
+    case 2: // untransformed
+      for (i = 0; i < n; ++i) {
+        xi = x[i];
+        out[i] = R_FINITE(xi) ? xi : _powerDi(xi, lambda, yj, low, hi);
+      }
+      return;
+    case 3: // log
+      for (i = 0; i < n; ++i) {
+        xi = x[i];
+        out[i] = R_FINITE(xi) ? exp(xi) : _powerDi(xi, lambda, yj, low, hi);
+      }
+      return;
+    }
+    for (i = 0; i < n; ++i) {
+      out[i] = _powerDi(x[i], lambda, yj, low, hi);
+    }
+  }
+
+  static inline double tbsL(const double *x, int n,
+                            double lambda, int yj, double low, double hi) {
+    double ret = 0.0;
+    for (int i = 0; i < n; ++i) {
+      ret += _powerL(x[i], lambda, yj, low, hi);
+    }
+    return ret;
+  }
+
+  // End of the run starting at i with the same transformation
+  static inline int tbsRunEndI(int i, int n, const double *lambda, const int *yj,
+                               const double *low, const double *hi) {
+    int j = i + 1;
+    while (j < n && lambda[j] == lambda[i] && yj[j] == yj[i] &&
+           low[j] == low[i] && hi[j] == hi[i]) j++;
+    return j;
+  }
+
+  static inline int tbsRunEndD(int i, int n, const double *lambda, const double *yj,
+                               const double *low, const double *hi) {
+    int j = i + 1;
+    while (j < n && lambda[j] == lambda[i] && yj[j] == yj[i] &&
+           low[j] == low[i] && hi[j] == hi[i]) j++;
+    return j;
+  }
+
+  // Transform (or inverse transform) with one set of parameters for
+  // each element; yj is integer (tbsDvI) or double (tbsDvD)
+  static inline void tbsDvI(double *out, const double *x, int n,
+                            const double *lambda, const int *yj,
+                            const double *low, const double *hi, int inverse) {
+    int i = 0;
+    while (i < n) {
+      int j = tbsRunEndI(i, n, lambda, yj, low, hi);
+      if (inverse) {
+        tbsDi(out + i, x + i, j - i, lambda[i], yj[i], low[i], hi[i]);
+      } else {
+        tbsD(out + i, x + i, j - i, lambda[i], yj[i], low[i], hi[i]);
+      }
+      i = j;
+    }
+  }
+
+  static inline void tbsDvD(double *out, const double *x, int n,
+                            const double *lambda, const double *yj,
+                            const double *low, const double *hi, int inverse) {
+    int i = 0;
+    while (i < n) {
+      int j = tbsRunEndD(i, n, lambda, yj, low, hi);
+      if (inverse) {
+        tbsDi(out + i, x + i, j - i, lambda[i], (int)yj[i], low[i], hi[i]);
+      } else {
+        tbsD(out + i, x + i, j - i, lambda[i], (int)yj[i], low[i], hi[i]);
+      }
+      i = j;
+    }
+  }
+
+  // Sum of the log-likelihood adjustments with integer yj
+  static inline double tbsLvI(const double *x, int n,
+                              const double *lambda, const int *yj,
+                              const double *low, const double *hi) {
+    double ret = 0.0;
+    int i = 0;
+    while (i < n) {
+      int j = tbsRunEndI(i, n, lambda, yj, low, hi);
+      ret += tbsL(x + i, j - i, lambda[i], yj[i], low[i], hi[i]);
+      i = j;
+    }
+    return ret;
+  }
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
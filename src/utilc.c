@@ -20,6 +20,7 @@
 #endif
 
 #include "utilc.h"
+#include "tbs.h"
 
 int _setSilentErr=0;
 extern void setSilentErr(int silent){
@@ -131,9 +132,7 @@ SEXP _nlmixr2est_powerD(SEXP xS, SEXP lambdaS, SEXP yjS, SEXP lowS, SEXP hiS) {
   }
   SEXP retS = PROTECT(Rf_allocVector(REALSXP, len));
   double *ret = REAL(retS);
-  for (int i = len; i--;) {
-    ret[i] = _powerD(x[i], lambda[i], yj[i], low[i], hi[i]);
-  }
+  tbsDvI(ret, x, len, lambda, yj, low, hi, 0);
   UNPROTECT(1);
   return retS;
 }
@@ -186,10 +185,7 @@ SEXP _nlmixr2est_powerL(SEXP xS, SEXP lambdaS, SEXP yjS, SEXP lowS, SEXP hiS) {
   }
   SEXP retS = PROTECT(Rf_allocVector(REALSXP, 1));
   double *ret = REAL(retS);
-  ret[0] = 0;
-  for (int i = len; i--;) {
-    ret[0] += _powerL(x[i], lambda[i], yj[i], low[i], hi[i]);
-  }
+  ret[0] = tbsLvI(x, len, lambda, yj, low, hi);
   UNPROTECT(1);
   return retS;
 }